@@ -0,0 +1,43 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SYNERGY_BENCH_H
+#define SYNERGY_BENCH_H
+
+#include <stdint.h>
+#include <string>
+
+/** What a benchmark measured, printed by bench_synergy as it is reported */
+class CBenchState
+{
+public:
+    std::string strName;
+
+    CBenchState(const std::string& strNameIn) : strName(strNameIn) { }
+
+    void Report(const std::string& strWhat, double dValue, const std::string& strUnit);
+    // nCount operations done in nMicros, as operations per second
+    void ReportRate(const std::string& strWhat, int64_t nCount, int64_t nMicros, const std::string& strUnit);
+};
+
+typedef void (*benchfn_type)(CBenchState& state);
+
+/** Adds a benchmark to the ones bench_synergy runs; use BENCHMARK */
+class CBenchRegister
+{
+public:
+    CBenchRegister(const char* pszName, benchfn_type fn);
+};
+
+#define BENCHMARK(name) \
+    static void name(CBenchState& state); \
+    static CBenchRegister bench_register_##name(#name, name); \
+    static void name(CBenchState& state)
+
+/** Stops a benchmark whose work did not give the expected result */
+void BenchCheck(bool fOk, const char* pszWhat);
+
+/** Peak resident set size of the process so far, in kB */
+int64_t BenchPeakRSS();
+
+#endif
@@ -0,0 +1,117 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "checkpoints.h"
+#include "init.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#include <map>
+#include <sys/resource.h>
+
+using namespace std;
+
+// bench_synergy links everything but init.o, which holds these
+unsigned short onion_port = TOR_PORT;
+unsigned short p2p_port = GetDefaultPort();
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+std::string strWalletFileName;
+bool fConfChange;
+bool fEnforceCanonical;
+unsigned int nNodeLifespan;
+unsigned int nDerivationMethodIndex;
+unsigned int nMinerSleep;
+bool fUseFastIndex;
+enum Checkpoints::CPMode CheckpointsMode;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static map<string, benchfn_type>& Benchmarks()
+{
+    static map<string, benchfn_type> mapBench;
+    return mapBench;
+}
+
+CBenchRegister::CBenchRegister(const char* pszName, benchfn_type fn)
+{
+    Benchmarks()[pszName] = fn;
+}
+
+void CBenchState::Report(const string& strWhat, double dValue, const string& strUnit)
+{
+    fprintf(stdout, "%-24s %-40s %14.2f %s\n", strName.c_str(), strWhat.c_str(), dValue, strUnit.c_str());
+}
+
+void CBenchState::ReportRate(const string& strWhat, int64_t nCount, int64_t nMicros, const string& strUnit)
+{
+    Report(strWhat, nCount * 1000000.0 / max(nMicros, (int64_t)1), strUnit + "/s");
+}
+
+void BenchCheck(bool fOk, const char* pszWhat)
+{
+    if (!fOk)
+        throw runtime_error(pszWhat);
+}
+
+int64_t BenchPeakRSS()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss;
+}
+
+extern void noui_connect();
+
+// bench_synergy [name...]: runs the benchmarks whose names contain one of
+// the arguments, or all of them, in a scratch data directory
+int main(int argc, char* argv[])
+{
+    fPrintToDebugger = true; // no debug.log
+    noui_connect();
+
+    boost::filesystem::path pathData = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_synergy_%%%%%%%%");
+    boost::filesystem::create_directories(pathData);
+    mapArgs["-datadir"] = pathData.string();
+
+    int nFailed = 0;
+    typedef pair<string, benchfn_type> BenchPair;
+    BOOST_FOREACH(const BenchPair& bench, Benchmarks())
+    {
+        bool fRun = (argc < 2);
+        for (int i = 1; i < argc && !fRun; i++)
+            fRun = (bench.first.find(argv[i]) != string::npos);
+        if (!fRun)
+            continue;
+
+        CBenchState state(bench.first);
+        try
+        {
+            bench.second(state);
+        }
+        catch (std::exception& e)
+        {
+            fprintf(stderr, "%s failed: %s\n", bench.first.c_str(), e.what());
+            nFailed++;
+        }
+    }
+
+    boost::filesystem::remove_all(pathData);
+    return nFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned int BENCH_FILE = 9999;
+static const int BENCH_TXS = 20000;
+
+static CTransaction NewTransaction(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1 + n % 3);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        tx.vin[i].prevout.hash = uint256(n * 3 + i);
+        tx.vin[i].prevout.n = i;
+        tx.vin[i].scriptSig = CScript() << vector<unsigned char>(72, n) << vector<unsigned char>(33, i);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n;
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, n) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].nValue = n * 2;
+    return tx;
+}
+
+static int64_t ReadTransactions(const vector<CDiskTxPos>& vPos)
+{
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int n = 0; n < vPos.size(); n++)
+    {
+        CTransaction tx;
+        BenchCheck(tx.ReadFromDisk(vPos[n]), "ReadFromDisk failed");
+    }
+    return GetTimeMicros() - nStart;
+}
+
+// transaction reads from a shared map of the block file against opening
+// the file for each read
+BENCHMARK(BlockFileRead)
+{
+    bool fMapBefore = fMapBlockFiles;
+
+    vector<CDiskTxPos> vPos;
+    {
+        CAutoFile fileout = CAutoFile(OpenBlockFile(BENCH_FILE, 0, "ab"), SER_DISK, CLIENT_VERSION);
+        BenchCheck(!!fileout, "OpenBlockFile failed");
+        for (int n = 0; n < BENCH_TXS; n++)
+        {
+            vPos.push_back(CDiskTxPos(BENCH_FILE, 0, ftell(fileout)));
+            fileout << NewTransaction(n);
+        }
+    }
+
+    fMapBlockFiles = true;
+    state.ReportRate("mapped", BENCH_TXS, ReadTransactions(vPos), "txs");
+    fMapBlockFiles = false;
+    state.ReportRate("OpenBlockFile", BENCH_TXS, ReadTransactions(vPos), "txs");
+
+    fMapBlockFiles = fMapBefore;
+    blockFileMaps.Clear();
+    boost::filesystem::remove(BlockFilePath(BENCH_FILE));
+}
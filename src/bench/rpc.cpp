@@ -0,0 +1,96 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <boost/bind.hpp>
+#include <boost/iostreams/concepts.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include "bitcoinrpc.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static const int BENCH_ENTRIES = 200000;
+
+// Stands in for the connection, keeping only when the first byte came and
+// how many there were
+class CBenchSink : public boost::iostreams::sink
+{
+public:
+    CBenchSink(int64_t* pnFirstIn, int64_t* pnBytesIn) : pnFirst(pnFirstIn), pnBytes(pnBytesIn) { }
+
+    std::streamsize write(const char* s, std::streamsize n)
+    {
+        if (*pnFirst == 0)
+            *pnFirst = GetTimeMicros();
+        *pnBytes += n;
+        return n;
+    }
+
+private:
+    int64_t* pnFirst;
+    int64_t* pnBytes;
+};
+
+// an entry the size of a listunspent one
+static Object BenchEntry(int n)
+{
+    Object entry;
+    entry.push_back(Pair("txid", uint256(n).GetHex()));
+    entry.push_back(Pair("vout", n % 4));
+    entry.push_back(Pair("address", "SYNbenchbenchbenchbenchbenchbench1"));
+    entry.push_back(Pair("amount", ValueFromAmount(n)));
+    entry.push_back(Pair("confirmations", n));
+    return entry;
+}
+
+static void WriteListing(int nEntries, CJSONStreamWriter& writer)
+{
+    writer.BeginArray();
+    for (int n = 0; n < nEntries; n++)
+        writer.Write(BenchEntry(n));
+    writer.EndArray();
+}
+
+// Time to the first byte, time to the whole reply and growth of the peak
+// resident size for a large result, sent through StreamRPCReply as chunks
+// and built whole as for a call without a stream function. The streamed
+// reply goes first, as the peak only grows.
+BENCHMARK(RPCReply)
+{
+    int64_t nFirst = 0, nBytes = 0;
+    int64_t nRSS = BenchPeakRSS();
+    int64_t nStart = GetTimeMicros();
+    {
+        boost::iostreams::stream<CBenchSink> stream(CBenchSink(&nFirst, &nBytes));
+        BenchCheck(StreamRPCReply(stream, "bench", boost::bind(&WriteListing, BENCH_ENTRIES, _1), Value(1), true),
+                   "streamed reply failed");
+    }
+    int64_t nEnd = GetTimeMicros();
+    state.Report(strprintf("streamed, %d entries: first byte", BENCH_ENTRIES), (nFirst - nStart) / 1000.0, "ms");
+    state.Report("streamed: whole reply", (nEnd - nStart) / 1000.0, "ms");
+    state.Report("streamed: reply size", nBytes / 1024.0, "kB");
+    state.Report("streamed: peak RSS growth", BenchPeakRSS() - nRSS, "kB");
+
+    nFirst = 0;
+    nBytes = 0;
+    nRSS = BenchPeakRSS();
+    nStart = GetTimeMicros();
+    {
+        Array result;
+        for (int n = 0; n < BENCH_ENTRIES; n++)
+            result.push_back(BenchEntry(n));
+        string strReply = JSONRPCReply(result, Value::null, Value(1));
+        boost::iostreams::stream<CBenchSink> stream(CBenchSink(&nFirst, &nBytes));
+        stream << strReply << std::flush;
+    }
+    nEnd = GetTimeMicros();
+    state.Report(strprintf("buffered, %d entries: first byte", BENCH_ENTRIES), (nFirst - nStart) / 1000.0, "ms");
+    state.Report("buffered: whole reply", (nEnd - nStart) / 1000.0, "ms");
+    state.Report("buffered: reply size", nBytes / 1024.0, "kB");
+    state.Report("buffered: peak RSS growth", BenchPeakRSS() - nRSS, "kB");
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <openssl/rand.h>
+
+#include "smessage.h"
+#include "util.h"
+
+using namespace std;
+
+static const int BENCH_MESSAGES = 20;
+static const uint32_t BENCH_PAYLOAD = 512;
+
+// proof of work search for secure messages
+BENCHMARK(SecureMessagePow)
+{
+    bool fEnabledBefore = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<unsigned char> vchMessage(SMSG_HDR_LEN + BENCH_PAYLOAD);
+    unsigned char* pHeader = &vchMessage[0];
+    unsigned char* pPayload = &vchMessage[SMSG_HDR_LEN];
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_MESSAGES; i++)
+    {
+        RAND_bytes(pHeader, vchMessage.size());
+        psmsg->version[0] = 1;
+        psmsg->nPayload = BENCH_PAYLOAD;
+        BenchCheck(SecureMsgSetHash(pHeader, pPayload, BENCH_PAYLOAD) == 0, "proof of work not found");
+    }
+    state.ReportRate(strprintf("%u byte payloads", BENCH_PAYLOAD), BENCH_MESSAGES, GetTimeMicros() - nStart, "messages");
+
+    fSecMsgEnabled = fEnabledBefore;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <boost/foreach.hpp>
+
+#include "stealth.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned int BENCH_ADDRESSES = 4;
+static const int BENCH_OUTPUTS = 200;
+
+static CStealthAddress NewStealthAddress()
+{
+    CStealthAddress sxAddr;
+    ec_secret sScan, sSpend;
+    BenchCheck(GenerateRandomSecret(sScan) == 0 && GenerateRandomSecret(sSpend) == 0, "GenerateRandomSecret failed");
+    BenchCheck(SecretToPublicKey(sScan, sxAddr.scan_pubkey) == 0 && SecretToPublicKey(sSpend, sxAddr.spend_pubkey) == 0,
+               "SecretToPublicKey failed");
+    sxAddr.scan_secret.assign(&sScan.e[0], &sScan.e[0] + ec_secret_size);
+    sxAddr.spend_secret.assign(&sSpend.e[0], &sSpend.e[0] + ec_secret_size);
+    return sxAddr;
+}
+
+// CStealthScanner against StealthSecret for every address, as the wallet
+// matched stealth outputs before
+BENCHMARK(StealthScan)
+{
+    set<CStealthAddress> setAddress;
+    while (setAddress.size() < BENCH_ADDRESSES)
+        setAddress.insert(NewStealthAddress());
+
+    CStealthScanner scanner;
+    scanner.SetAddresses(setAddress);
+
+    vector<ec_point> vEphem(BENCH_OUTPUTS);
+    for (int i = 0; i < BENCH_OUTPUTS; i++)
+    {
+        ec_secret sEphem;
+        BenchCheck(GenerateRandomSecret(sEphem) == 0 && SecretToPublicKey(sEphem, vEphem[i]) == 0, "ephemeral key failed");
+    }
+
+    int64_t nStart = GetTimeMicros();
+    vector<CStealthScanResult> vResult;
+    for (int i = 0; i < BENCH_OUTPUTS; i++)
+        BenchCheck(scanner.Scan(vEphem[i], vResult) && vResult.size() == BENCH_ADDRESSES, "scan failed");
+    state.ReportRate(strprintf("CStealthScanner, %u addresses", BENCH_ADDRESSES), BENCH_OUTPUTS, GetTimeMicros() - nStart, "outputs");
+
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const CStealthAddress& sxAddr, setAddress)
+    {
+        ec_secret sScan, sShared;
+        memcpy(&sScan.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+        for (int i = 0; i < BENCH_OUTPUTS; i++)
+        {
+            ec_point pkOut;
+            BenchCheck(StealthSecret(sScan, vEphem[i], sxAddr.spend_pubkey, sShared, pkOut) == 0, "StealthSecret failed");
+        }
+    }
+    state.ReportRate(strprintf("StealthSecret, %u addresses", BENCH_ADDRESSES), BENCH_OUTPUTS, GetTimeMicros() - nStart, "outputs");
+}
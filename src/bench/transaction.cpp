@@ -0,0 +1,47 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static const int BENCH_HASHES = 100000;
+
+// the hash a transaction read from a stream keeps, against serializing
+// and hashing it again
+BENCHMARK(TransactionHash)
+{
+    CTransaction txNew;
+    txNew.vin.resize(2);
+    for (unsigned int i = 0; i < txNew.vin.size(); i++)
+    {
+        txNew.vin[i].prevout.hash = uint256(i + 1);
+        txNew.vin[i].prevout.n = i;
+        txNew.vin[i].scriptSig = CScript() << vector<unsigned char>(72, i) << vector<unsigned char>(33, i);
+    }
+    txNew.vout.resize(2);
+    txNew.vout[0].nValue = 1;
+    txNew.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txNew.vout[1].nValue = 2;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txNew;
+    CTransaction tx;
+    ss >> tx;
+
+    uint256 hash;
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_HASHES; i++)
+        hash = tx.GetHash();
+    state.ReportRate("GetHash, kept", BENCH_HASHES, GetTimeMicros() - nStart, "hashes");
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_HASHES; i++)
+        hash = SerializeHash(tx);
+    state.ReportRate("SerializeHash", BENCH_HASHES, GetTimeMicros() - nStart, "hashes");
+    BenchCheck(hash == tx.GetHash(), "kept hash differs");
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+static const int BENCH_SIGNATURES = 2000;
+
+// signature verification through CKey (OpenSSL) and through CPubKey, which
+// uses libsecp256k1 when built with USE_SECP256K1
+BENCHMARK(VerifySignatures)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int i = 0; i < BENCH_SIGNATURES; i++)
+    {
+        string strMsg = strprintf("Benchmark message %i", i);
+        vHash.push_back(Hash(strMsg.begin(), strMsg.end()));
+        vSig.push_back(vector<unsigned char>());
+        BenchCheck(key.Sign(vHash.back(), vSig.back()), "signing failed");
+    }
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_SIGNATURES; i++)
+    {
+        CKey keyVerify;
+        keyVerify.SetPubKey(pubkey);
+        BenchCheck(keyVerify.Verify(vHash[i], vSig[i]), "OpenSSL verification failed");
+    }
+    state.ReportRate("OpenSSL", BENCH_SIGNATURES, GetTimeMicros() - nStart, "verifications");
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < BENCH_SIGNATURES; i++)
+        BenchCheck(pubkey.Verify(vHash[i], vSig[i]), "CPubKey verification failed");
+#ifdef USE_SECP256K1
+    state.ReportRate("libsecp256k1", BENCH_SIGNATURES, GetTimeMicros() - nStart, "verifications");
+#else
+    state.ReportRate("CPubKey (OpenSSL)", BENCH_SIGNATURES, GetTimeMicros() - nStart, "verifications");
+#endif
+}
@@ -24,6 +24,7 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -39,7 +40,10 @@ static std::string strRPCUserColonPass;
 
 const Object emptyobj;
 
-void ThreadRPCServer3(void* parg);
+static const int DEFAULT_RPC_THREADS = 4;
+static const int MAX_RPC_THREADS = 64;
+// seconds a connection may sit between requests before it is closed
+static const int RPC_IDLE_TIMEOUT = 30;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -227,6 +231,38 @@ Value stop(const Array& params, bool fHelp)
     return "synergy server stopping";
 }
 
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "Returns call counts, latencies and a latency histogram of each RPC method called since startup.");
+
+    static const char* pszBucket[RPC_LATENCY_BUCKETS] = { "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s" };
+
+    map<string, CRPCMethodStats> mapStats;
+    tableRPC.GetStats(mapStats);
+
+    Object ret;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        Object obj;
+        obj.push_back(Pair("calls", stats.nCalls));
+        obj.push_back(Pair("errors", stats.nErrors));
+        obj.push_back(Pair("totalms", stats.nTotalMicros / 1000.0));
+        obj.push_back(Pair("avgms", stats.nCalls ? stats.nTotalMicros / 1000.0 / stats.nCalls : 0.0));
+        obj.push_back(Pair("maxms", stats.nMaxMicros / 1000.0));
+        obj.push_back(Pair("lockwaitms", stats.nLockWaitMicros / 1000.0));
+        Object histogram;
+        for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            histogram.push_back(Pair(pszBucket[i], stats.vLatency[i]));
+        obj.push_back(Pair("histogram", histogram));
+        ret.push_back(Pair(item.first, obj));
+    }
+    return ret;
+}
+
 
 
 //
@@ -235,94 +271,98 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                         function                 safemd  unlocked
-  //  ------------------------     -----------------------  ------  --------
-    { "help",                      &help,                      true,   true },
-    { "stop",                      &stop,                      true,   true },
-    { "getbestblockhash",          &getbestblockhash,          true,   false },
-    { "getblockcount",             &getblockcount,             true,   false },
-    { "getconnectioncount",        &getconnectioncount,        true,   false },
-    { "getpeerinfo",               &getpeerinfo,               true,   false },
-    { "getdifficulty",             &getdifficulty,             true,   false },
-    { "getinfo",                   &getinfo,                   true,   false },
-    { "getsubsidy",                &getsubsidy,                true,   false },
-    { "getmininginfo",             &getmininginfo,             true,   false },
-    { "getstakinginfo",            &getstakinginfo,            true,   false },
-    { "getnewaddress",             &getnewaddress,             true,   false },
-    { "makeburnaddress",           &makeburnaddress,           true,   false },
-    { "getnewpubkey",              &getnewpubkey,              true,   false },
-    { "getaccountaddress",         &getaccountaddress,         true,   false },
-    { "setaccount",                &setaccount,                true,   false },
-    { "getaccount",                &getaccount,                false,  false },
-    { "getaddressesbyaccount",     &getaddressesbyaccount,     true,   false },
-    { "sendtoaddress",             &sendtoaddress,             false,  false },
-    { "getreceivedbyaddress",      &getreceivedbyaddress,      false,  false },
-    { "getreceivedbyaccount",      &getreceivedbyaccount,      false,  false },
-    { "listreceivedbyaddress",     &listreceivedbyaddress,     false,  false },
-    { "listreceivedbyaccount",     &listreceivedbyaccount,     false,  false },
-    { "backupwallet",              &backupwallet,              true,   false },
-    { "keypoolrefill",             &keypoolrefill,             true,   false },
-    { "walletpassphrase",          &walletpassphrase,          true,   false },
-    { "walletpassphrasechange",    &walletpassphrasechange,    false,  false },
-    { "walletlock",                &walletlock,                true,   false },
-    { "encryptwallet",             &encryptwallet,             false,  false },
-    { "validateaddress",           &validateaddress,           true,   false },
-    { "validatepubkey",            &validatepubkey,            true,   false },
-    { "getbalance",                &getbalance,                false,  false },
-    { "move",                      &movecmd,                   false,  false },
-    { "sendfrom",                  &sendfrom,                  false,  false },
-    { "sendmany",                  &sendmany,                  false,  false },
-    { "addmultisigaddress",        &addmultisigaddress,        false,  false },
-    { "addredeemscript",           &addredeemscript,           false,  false },
-    { "getrawmempool",             &getrawmempool,             true,   false },
-    { "getblock",                  &getblock,                  false,  false },
-    { "getblockbynumber",          &getblockbynumber,          false,  false },
-    { "getblockhash",              &getblockhash,              false,  false },
-    { "gettransaction",            &gettransaction,            false,  false },
-    { "listtransactions",          &listtransactions,          false,  false },
-    { "getaddressbalancebyblock",  &getaddressbalancebyblock,  false,  false },
-    { "getfirstturboblock",        &getfirstturboblock,        false,  false },
-    { "getturbo",                  &getturbo,                  false,  false },
-    { "getmyturboaddresses",       &getmyturboaddresses,       false,  false },
-    { "getallturboaddresses",      &getallturboaddresses,      false,  false },
-    { "getturboredemption",        &getturboredemption,        false,  false },
-    { "listaddressgroupings",      &listaddressgroupings,      false,  false },
-    { "signmessage",               &signmessage,               false,  false },
-    { "verifymessage",             &verifymessage,             false,  false },
-    { "getwork",                   &getwork,                   true,   false },
-    { "getworkex",                 &getworkex,                 true,   false },
-    { "listaccounts",              &listaccounts,              false,  false },
-    { "settxfee",                  &settxfee,                  false,  false },
-    { "getblocktemplate",          &getblocktemplate,          true,   false },
-    { "submitblock",               &submitblock,               false,  false },
-    { "listsinceblock",            &listsinceblock,            false,  false },
-    { "dumpprivkey",               &dumpprivkey,               false,  false },
-    { "dumpwallet",                &dumpwallet,                true,   false },
-    { "importwallet",              &importwallet,              false,  false },
-    { "importprivkey",             &importprivkey,             false,  false },
-    { "encodebase58",              &encodebase58,              false,  false },
-    { "scrypthash",                &scrypthash,                false,  false },
-    { "listunspent",               &listunspent,               false,  false },
-    { "getrawtransaction",         &getrawtransaction,         false,  false },
-    { "createrawtransaction",      &createrawtransaction,      false,  false },
-    { "decoderawtransaction",      &decoderawtransaction,      false,  false },
-    { "decodescript",              &decodescript,              false,  false },
-    { "signrawtransaction",        &signrawtransaction,        false,  false },
-    { "sendrawtransaction",        &sendrawtransaction,        false,  false },
-    { "getcheckpoint",             &getcheckpoint,             true,   false },
-    { "reservebalance",            &reservebalance,            false,  true},
-    { "checkwallet",               &checkwallet,               false,  true},
-    { "repairwallet",              &repairwallet,              false,  true},
-    { "resendtx",                  &resendtx,                  false,  true},
-    { "makekeypair",               &makekeypair,               false,  true},
-    { "sendalert",                 &sendalert,                 false,  false},
-    { "getnewstealthaddress",      &getnewstealthaddress,      false,  false},
-    { "liststealthaddresses",      &liststealthaddresses,      false,  false},
-    { "importstealthaddress",      &importstealthaddress,      false,  false},
-    { "sendtostealthaddress",      &sendtostealthaddress,      false,  false},
-    { "clearwallettransactions",   &clearwallettransactions,   false,  false},
-    { "scanforalltxns",            &scanforalltxns,            false,  false},
-    { "scanforstealthtxns",        &scanforstealthtxns,        false,  false}
+{ //  name                         function                    safemd  locks            streamed
+  //  ------------------------     --------------------------  ------  ---------------  ------------------
+    { "help",                      &help,                      true,  RPC_LOCK_NONE,   NULL },
+    { "stop",                      &stop,                      true,  RPC_LOCK_NONE,   NULL },
+    { "getbestblockhash",          &getbestblockhash,          true,  RPC_LOCK_MAIN,   NULL },
+    { "getblockcount",             &getblockcount,             true,  RPC_LOCK_MAIN,   NULL },
+    { "getconnectioncount",        &getconnectioncount,        true,  RPC_LOCK_MAIN,   NULL },
+    { "getpeerinfo",               &getpeerinfo,               true,  RPC_LOCK_NONE,   NULL },
+    { "getdifficulty",             &getdifficulty,             true,  RPC_LOCK_MAIN,   NULL },
+    { "getinfo",                   &getinfo,                   true,  RPC_LOCK_WALLET, NULL },
+    { "getsubsidy",                &getsubsidy,                true,  RPC_LOCK_MAIN,   NULL },
+    { "getmininginfo",             &getmininginfo,             true,  RPC_LOCK_WALLET, NULL },
+    { "getstakinginfo",            &getstakinginfo,            true,  RPC_LOCK_WALLET, NULL },
+    { "getnewaddress",             &getnewaddress,             true,  RPC_LOCK_WALLET, NULL },
+    { "makeburnaddress",           &makeburnaddress,           true,  RPC_LOCK_WALLET, NULL },
+    { "getnewpubkey",              &getnewpubkey,              true,  RPC_LOCK_WALLET, NULL },
+    { "getaccountaddress",         &getaccountaddress,         true,  RPC_LOCK_WALLET, NULL },
+    { "setaccount",                &setaccount,                true,  RPC_LOCK_WALLET, NULL },
+    { "getaccount",                &getaccount,                false, RPC_LOCK_WALLET, NULL },
+    { "getaddressesbyaccount",     &getaddressesbyaccount,     true,  RPC_LOCK_WALLET, NULL },
+    { "sendtoaddress",             &sendtoaddress,             false, RPC_LOCK_WALLET, NULL },
+    { "getreceivedbyaddress",      &getreceivedbyaddress,      false, RPC_LOCK_WALLET, NULL },
+    { "getreceivedbyaccount",      &getreceivedbyaccount,      false, RPC_LOCK_WALLET, NULL },
+    { "listreceivedbyaddress",     &listreceivedbyaddress,     false, RPC_LOCK_WALLET, NULL },
+    { "listreceivedbyaccount",     &listreceivedbyaccount,     false, RPC_LOCK_WALLET, NULL },
+    { "backupwallet",              &backupwallet,              true,  RPC_LOCK_WALLET, NULL },
+    { "keypoolrefill",             &keypoolrefill,             true,  RPC_LOCK_WALLET, NULL },
+    { "walletpassphrase",          &walletpassphrase,          true,  RPC_LOCK_WALLET, NULL },
+    { "walletpassphrasechange",    &walletpassphrasechange,    false, RPC_LOCK_WALLET, NULL },
+    { "walletlock",                &walletlock,                true,  RPC_LOCK_WALLET, NULL },
+    { "encryptwallet",             &encryptwallet,             false, RPC_LOCK_WALLET, NULL },
+    { "validateaddress",           &validateaddress,           true,  RPC_LOCK_NONE,   NULL },
+    { "validatepubkey",            &validatepubkey,            true,  RPC_LOCK_WALLET, NULL },
+    { "getbalance",                &getbalance,                false, RPC_LOCK_WALLET, NULL },
+    { "move",                      &movecmd,                   false, RPC_LOCK_WALLET, NULL },
+    { "sendfrom",                  &sendfrom,                  false, RPC_LOCK_WALLET, NULL },
+    { "sendmany",                  &sendmany,                  false, RPC_LOCK_WALLET, NULL },
+    { "addmultisigaddress",        &addmultisigaddress,        false, RPC_LOCK_WALLET, NULL },
+    { "addredeemscript",           &addredeemscript,           false, RPC_LOCK_WALLET, NULL },
+    { "getrawmempool",             &getrawmempool,             true,  RPC_LOCK_MAIN,   NULL },
+    { "getblock",                  &getblock,                  false, RPC_LOCK_MAIN,   &getblock_stream },
+    { "getblockbynumber",          &getblockbynumber,          false, RPC_LOCK_MAIN,   &getblockbynumber_stream },
+    { "getblockhash",              &getblockhash,              false, RPC_LOCK_MAIN,   NULL },
+    { "gettransaction",            &gettransaction,            false, RPC_LOCK_WALLET, NULL },
+    { "listtransactions",          &listtransactions,          false, RPC_LOCK_WALLET, &listtransactions_stream },
+    { "getaddressbalancebyblock",  &getaddressbalancebyblock,  false, RPC_LOCK_MAIN,   &getaddressbalancebyblock_stream },
+    { "getfirstturboblock",        &getfirstturboblock,        false, RPC_LOCK_MAIN,   NULL },
+    { "getturbo",                  &getturbo,                  false, RPC_LOCK_MAIN,   NULL },
+    { "getmyturboaddresses",       &getmyturboaddresses,       false, RPC_LOCK_WALLET, NULL },
+    { "getallturboaddresses",      &getallturboaddresses,      false, RPC_LOCK_MAIN,   NULL },
+    { "getturboredemption",        &getturboredemption,        false, RPC_LOCK_MAIN,   NULL },
+    { "listaddressgroupings",      &listaddressgroupings,      false, RPC_LOCK_WALLET, NULL },
+    { "signmessage",               &signmessage,               false, RPC_LOCK_WALLET, NULL },
+    { "verifymessage",             &verifymessage,             false, RPC_LOCK_NONE,   NULL },
+    { "getwork",                   &getwork,                   true,  RPC_LOCK_WALLET, NULL },
+    { "getworkex",                 &getworkex,                 true,  RPC_LOCK_WALLET, NULL },
+    { "listaccounts",              &listaccounts,              false, RPC_LOCK_WALLET, NULL },
+    { "settxfee",                  &settxfee,                  false, RPC_LOCK_WALLET, NULL },
+    { "getblocktemplate",          &getblocktemplate,          true,  RPC_LOCK_WALLET, NULL },
+    { "submitblock",               &submitblock,               false, RPC_LOCK_MAIN,   NULL },
+    { "listsinceblock",            &listsinceblock,            false, RPC_LOCK_WALLET, NULL },
+    { "dumpprivkey",               &dumpprivkey,               false, RPC_LOCK_WALLET, NULL },
+    { "dumpwallet",                &dumpwallet,                true,  RPC_LOCK_WALLET, NULL },
+    { "importwallet",              &importwallet,              false, RPC_LOCK_WALLET, NULL },
+    { "importprivkey",             &importprivkey,             false, RPC_LOCK_NONE,   NULL },
+    { "encodebase58",              &encodebase58,              false, RPC_LOCK_NONE,   NULL },
+    { "scrypthash",                &scrypthash,                false, RPC_LOCK_NONE,   NULL },
+    { "listunspent",               &listunspent,               false, RPC_LOCK_WALLET, &listunspent_stream },
+    { "getrawtransaction",         &getrawtransaction,         false, RPC_LOCK_MAIN,   NULL },
+    { "createrawtransaction",      &createrawtransaction,      false, RPC_LOCK_NONE,   NULL },
+    { "decoderawtransaction",      &decoderawtransaction,      false, RPC_LOCK_MAIN,   NULL },
+    { "decodescript",              &decodescript,              false, RPC_LOCK_NONE,   NULL },
+    { "signrawtransaction",        &signrawtransaction,        false, RPC_LOCK_WALLET, NULL },
+    { "sendrawtransaction",        &sendrawtransaction,        false, RPC_LOCK_MAIN,   NULL },
+    { "getcheckpoint",             &getcheckpoint,             true,  RPC_LOCK_MAIN,   NULL },
+    { "getdbstats",                &getdbstats,                true,  RPC_LOCK_MAIN,   NULL },
+    { "getsigcacheinfo",           &getsigcacheinfo,           true,  RPC_LOCK_NONE,   NULL },
+    { "getcoincacheinfo",          &getcoincacheinfo,          true,  RPC_LOCK_NONE,   NULL },
+    { "getrpcstats",               &getrpcstats,               true,  RPC_LOCK_NONE,   NULL },
+    { "reservebalance",            &reservebalance,            false, RPC_LOCK_NONE,   NULL },
+    { "checkwallet",               &checkwallet,               false, RPC_LOCK_NONE,   NULL },
+    { "repairwallet",              &repairwallet,              false, RPC_LOCK_NONE,   NULL },
+    { "resendtx",                  &resendtx,                  false, RPC_LOCK_NONE,   NULL },
+    { "makekeypair",               &makekeypair,               false, RPC_LOCK_NONE,   NULL },
+    { "sendalert",                 &sendalert,                 false, RPC_LOCK_MAIN,   NULL },
+    { "getnewstealthaddress",      &getnewstealthaddress,      false, RPC_LOCK_WALLET, NULL },
+    { "liststealthaddresses",      &liststealthaddresses,      false, RPC_LOCK_WALLET, NULL },
+    { "importstealthaddress",      &importstealthaddress,      false, RPC_LOCK_WALLET, NULL },
+    { "sendtostealthaddress",      &sendtostealthaddress,      false, RPC_LOCK_WALLET, NULL },
+    { "clearwallettransactions",   &clearwallettransactions,   false, RPC_LOCK_WALLET, NULL },
+    { "scanforalltxns",            &scanforalltxns,            false, RPC_LOCK_NONE,   NULL },
+    { "scanforstealthtxns",        &scanforstealthtxns,        false, RPC_LOCK_NONE,   NULL }
 };
 
 CRPCTable::CRPCTable()
@@ -466,7 +506,7 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet, int* pnProto = NULL)
 {
     mapHeadersRet.clear();
     strMessageRet = "";
@@ -474,6 +514,8 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
     // Read status
     int nProto = 0;
     int nStatus = ReadHTTPStatus(stream, nProto);
+    if (pnProto)
+        *pnProto = nProto;
 
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
@@ -481,7 +523,26 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        // streamed replies come as chunks of hex length, a CRLF, the data
+        // and a CRLF, up to a chunk of length 0
+        while (stream)
+        {
+            string str;
+            getline(stream, str);
+            unsigned int nChunk = strtoul(str.c_str(), NULL, 16);
+            if (nChunk == 0 || strMessageRet.size() + nChunk > MAX_SIZE)
+                break;
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strMessageRet.append(vch.begin(), vch.end());
+            getline(stream, str);
+        }
+        string str;
+        getline(stream, str);
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -548,6 +609,70 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
+void CJSONStreamWriter::BeginValue()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty())
+    {
+        if (!vEmpty.back())
+            os << ',';
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    BeginValue();
+    os << '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    os << '}';
+    vEmpty.pop_back();
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    BeginValue();
+    os << '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    os << ']';
+    vEmpty.pop_back();
+}
+
+void CJSONStreamWriter::Key(const std::string& strKey)
+{
+    BeginValue();
+    write_stream(Value(strKey), os, false);
+    os << ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::Write(const Value& value)
+{
+    BeginValue();
+    write_stream(value, os, false);
+}
+
+void CJSONStreamWriter::WritePairs(const Object& obj)
+{
+    BOOST_FOREACH(const Pair& pair, obj)
+    {
+        Key(pair.name_);
+        Write(pair.value_);
+    }
+}
+
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
 {
     // Send error reply from json-rpc error object
@@ -638,11 +763,17 @@ private:
 class AcceptedConnection
 {
 public:
+    AcceptedConnection() : nIdleSince(0) {}
     virtual ~AcceptedConnection() {}
 
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    virtual void shutdown() = 0;
+
+    // time the worker started waiting for the next request, 0 while a
+    // request is being served (guarded by cs_THREAD_RPCHANDLER)
+    int64_t nIdleSince;
 };
 
 template <typename Protocol>
@@ -674,6 +805,13 @@ public:
         _stream.close();
     }
 
+    // wakes a handler blocked reading from this connection
+    virtual void shutdown()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -703,6 +841,8 @@ void ThreadRPCServer(void* parg)
     printf("ThreadRPCServer exited\n");
 }
 
+static void ServiceConnection(AcceptedConnection *conn);
+
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
@@ -770,15 +910,65 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
+    // serve the connection on this worker until it is closed, another
+    // worker takes the next accept meanwhile
+    else
+    {
+        vnThreadsRunning[THREAD_RPCLISTENER]--;
+        ServiceConnection(conn);
+        return;
     }
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
 
+static void ThreadRPCWorker(asio::io_service* pio_service)
+{
+    // Make this thread recognisable as an RPC handler
+    RenameThread("synergy-rpchand");
+
+    try
+    {
+        pio_service->run();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadRPCWorker()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadRPCWorker()");
+    }
+}
+
+static CCriticalSection cs_THREAD_RPCHANDLER;
+static set<AcceptedConnection*> setRPCConnections;
+
+// Unblocks the workers waiting on kept alive connections
+static void ShutdownRPCConnections()
+{
+    LOCK(cs_THREAD_RPCHANDLER);
+    BOOST_FOREACH(AcceptedConnection* conn, setRPCConnections)
+        conn->shutdown();
+}
+
+// Each connection holds a worker while it waits for its next request, so
+// connections idle for longer than RPC_IDLE_TIMEOUT are closed, and when
+// every worker is held all idle ones are, to leave a worker for accepts
+static void ExpireRPCConnections(int nThreads)
+{
+    LOCK(cs_THREAD_RPCHANDLER);
+    bool fSaturated = (int)setRPCConnections.size() >= nThreads;
+    int64_t nNow = GetTime();
+    BOOST_FOREACH(AcceptedConnection* conn, setRPCConnections)
+    {
+        if (conn->nIdleSince == 0)
+            continue;
+        if (fSaturated || nNow - conn->nIdleSince >= RPC_IDLE_TIMEOUT)
+        {
+            conn->shutdown();
+            conn->nIdleSince = 0;
+        }
+    }
+}
+
 void ThreadRPCServer2(void* parg)
 {
     printf("ThreadRPCServer started\n");
@@ -903,10 +1093,27 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // Accepts and the connections they bring are handled by a fixed pool
+    // of workers, each serving one connection at a time for as long as the
+    // client keeps it alive
+    int nThreads = GetArg("-rpcthreads", DEFAULT_RPC_THREADS);
+    nThreads = max(1, min(nThreads, MAX_RPC_THREADS));
+    asio::io_service::work work(io_service);
+    boost::thread_group workers;
+    for (int i = 0; i < nThreads; i++)
+        workers.create_thread(boost::bind(&ThreadRPCWorker, &io_service));
+    printf("ThreadRPCServer serving on %d threads\n", nThreads);
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
-        io_service.run_one();
+    {
+        ExpireRPCConnections(nThreads);
+        MilliSleep(100);
+    }
     vnThreadsRunning[THREAD_RPCLISTENER]++;
+    io_service.stop();
+    ShutdownRPCConnections();
+    workers.join_all();
     StopRequests();
 }
 
@@ -984,36 +1191,133 @@ static string JSONRPCExecBatch(const Array& vReq)
     return write_string(Value(ret), false) + "\n";
 }
 
-static CCriticalSection cs_THREAD_RPCHANDLER;
+//
+// Streamed replies go out with chunked transfer encoding while the result
+// is written. Nothing, not even the headers, is sent before the first chunk
+// fills, so errors up to then still get a normal error reply.
+//
+static const std::streamsize RPC_STREAM_CHUNK_SIZE = 64 * 1024;
 
-void ThreadRPCServer3(void* parg)
+class HTTPChunkedSink : public iostreams::sink
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("synergy-rpchand");
+public:
+    HTTPChunkedSink(std::ostream& streamIn, bool fKeepAliveIn, bool* pfSentIn, bool* pfAbandonIn) :
+        stream(streamIn), fKeepAlive(fKeepAliveIn), pfSent(pfSentIn), pfAbandon(pfAbandonIn)
+    {
+    }
+
+    std::streamsize write(const char* s, std::streamsize n)
+    {
+        if (*pfAbandon || n <= 0)
+            return n;
+        if (!*pfSent)
+        {
+            stream << strprintf(
+                    "HTTP/1.1 200 OK\r\n"
+                    "Date: %s\r\n"
+                    "Connection: %s\r\n"
+                    "Transfer-Encoding: chunked\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Server: synergy-json-rpc/%s\r\n"
+                    "\r\n",
+                rfc1123Time().c_str(),
+                fKeepAlive ? "keep-alive" : "close",
+                FormatFullVersion().c_str());
+            *pfSent = true;
+        }
+        stream << strprintf("%x\r\n", (unsigned int)n);
+        stream.write(s, n);
+        stream << "\r\n";
+        return n;
+    }
+
+private:
+    std::ostream& stream;
+    bool fKeepAlive;
+    bool* pfSent;
+    bool* pfAbandon;
+};
 
+bool StreamRPCReply(std::ostream& stream, const std::string& strMethod, boost::function<void (CJSONStreamWriter&)> fnResult,
+                    const Value& id, bool fKeepAlive)
+{
+    bool fSent = false;
+    bool fAbandon = false;
+    Object objError;
+    {
+        iostreams::stream<HTTPChunkedSink> chunked(HTTPChunkedSink(stream, fKeepAlive, &fSent, &fAbandon), RPC_STREAM_CHUNK_SIZE);
+        CJSONStreamWriter writer(chunked);
+        try
+        {
+            chunked << "{\"result\":";
+            fnResult(writer);
+            chunked << ",\"error\":null,\"id\":" << write_string(id, false) << "}\n";
+            chunked.flush();
+        }
+        catch (Object& e)
+        {
+            objError = e;
+        }
+        catch (std::exception& e)
+        {
+            objError = JSONRPCError(RPC_MISC_ERROR, e.what());
+        }
+        if (!objError.empty())
+            fAbandon = true;
+    }
+
+    if (objError.empty())
+    {
+        stream << "0\r\n\r\n" << std::flush;
+        return true;
+    }
+
+    // part of the result is out already, all that is left is to cut it short
+    if (fSent)
+        printf("ThreadRPCServer %s failed while streaming: %s\n", strMethod.c_str(),
+               find_value(objError, "message").get_str().c_str());
+    else
+        ErrorReply(stream, objError, id);
+    return false;
+}
+
+// Returns false if the connection has to be closed
+static bool StreamReply(AcceptedConnection* conn, const JSONRequest& jreq, bool fKeepAlive)
+{
+    return StreamRPCReply(conn->stream(), jreq.strMethod,
+                          boost::bind(&CRPCTable::executeStream, &tableRPC, jreq.strMethod, jreq.params, _1),
+                          jreq.id, fKeepAlive);
+}
+
+static void ServiceConnection(AcceptedConnection *conn)
+{
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]++;
+        setRPCConnections.insert(conn);
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
     bool fRun = true;
-    while (true)
+    while (fRun && !fShutdown)
     {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
         map<string, string> mapHeaders;
         string strRequest;
+        int nProto = 0;
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        {
+            LOCK(cs_THREAD_RPCHANDLER);
+            conn->nIdleSince = GetTime();
+        }
+        ReadHTTP(conn->stream(), mapHeaders, strRequest, &nProto);
+        {
+            LOCK(cs_THREAD_RPCHANDLER);
+            conn->nIdleSince = 0;
+        }
+
+        // the client closed a kept alive connection, or it was shut down
+        // for sitting idle
+        if (!conn->stream())
+            break;
 
         // Check authorization
         if (mapHeaders.count("authorization") == 0)
@@ -1050,6 +1354,15 @@ void ThreadRPCServer3(void* parg)
             if (valRequest.type() == obj_type) {
                 jreq.parse(valRequest);
 
+                // large results are written out as they are produced, to
+                // clients that take chunked replies
+                if (nProto >= 1 && tableRPC.IsStreamed(jreq.strMethod))
+                {
+                    if (!StreamReply(conn, jreq, fRun))
+                        break;
+                    continue;
+                }
+
                 Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
                 // Send reply
@@ -1075,14 +1388,16 @@ void ThreadRPCServer3(void* parg)
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
+        setRPCConnections.erase(conn);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
+    conn->close();
+    delete conn;
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand* CRPCTable::Lookup(const std::string &strMethod) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1095,24 +1410,99 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    return pcmd;
+}
+
+bool CRPCTable::IsStreamed(const std::string &strMethod) const
+{
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    return pcmd && pcmd->streamActor;
+}
+
+void CRPCTable::executeStream(const std::string &strMethod, const json_spirit::Array &params, CJSONStreamWriter& writer) const
+{
+    const CRPCCommand *pcmd = Lookup(strMethod);
+    if (!pcmd->streamActor)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method is not streamed");
+
+    int64_t nStart = GetTimeMicros();
+    try
+    {
+        pcmd->streamActor(params, writer);
+        RecordCall(strMethod, GetTimeMicros() - nStart, 0, false);
+    }
+    catch (std::exception& e)
+    {
+        RecordCall(strMethod, GetTimeMicros() - nStart, 0, true);
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+    catch (...)
+    {
+        RecordCall(strMethod, GetTimeMicros() - nStart, 0, true);
+        throw;
+    }
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = Lookup(strMethod);
+
+    int64_t nStart = GetTimeMicros();
+    int64_t nLocked = nStart;
     try
     {
         // Execute
         Value result;
         {
-            if (pcmd->unlocked)
+            if (pcmd->lock == RPC_LOCK_NONE)
+                result = pcmd->actor(params, false);
+            else if (pcmd->lock == RPC_LOCK_MAIN) {
+                LOCK(cs_main);
+                nLocked = GetTimeMicros();
                 result = pcmd->actor(params, false);
+            }
             else {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
+                nLocked = GetTimeMicros();
                 result = pcmd->actor(params, false);
             }
         }
+        RecordCall(strMethod, GetTimeMicros() - nStart, nLocked - nStart, false);
         return result;
     }
     catch (std::exception& e)
     {
+        RecordCall(strMethod, GetTimeMicros() - nStart, nLocked - nStart, true);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordCall(strMethod, GetTimeMicros() - nStart, nLocked - nStart, true);
+        throw;
+    }
+}
+
+void CRPCTable::RecordCall(const std::string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, bool fError) const
+{
+    int nBucket = 0;
+    while (nBucket < RPC_LATENCY_BUCKETS - 1 && nMicros >= RPC_LATENCY_BOUNDS[nBucket])
+        nBucket++;
+
+    LOCK(cs_stats);
+    CRPCMethodStats& stats = mapStats[strMethod];
+    stats.nCalls++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = max(stats.nMaxMicros, nMicros);
+    stats.nLockWaitMicros += nLockWaitMicros;
+    stats.vLatency[nBucket]++;
+}
+
+void CRPCTable::GetStats(std::map<std::string, CRPCMethodStats>& mapStatsRet) const
+{
+    LOCK(cs_stats);
+    mapStatsRet = mapStats;
 }
 
 
@@ -12,11 +12,14 @@
 
 class CBlockIndex;
 
+#include <boost/function.hpp>
+
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
 
 #include "util.h"
+#include "sync.h"
 #include "checkpoints.h"
 
 // HTTP status codes
@@ -67,6 +70,7 @@ enum RPCErrorCode
 };
 
 json_spirit::Object JSONRPCError(int code, const std::string& message);
+std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
@@ -90,13 +94,82 @@ void RPCTypeCheck(const json_spirit::Object& o,
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 
+/** Writes JSON to a stream as it is produced, so large results need not
+ *  be built as one Value first */
+class CJSONStreamWriter
+{
+private:
+    std::ostream& os;
+    std::vector<bool> vEmpty; // open containers, true while nothing is in them
+    bool fAfterKey;
+
+    void BeginValue();
+
+public:
+    CJSONStreamWriter(std::ostream& osIn) : os(osIn), fAfterKey(false) { }
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+
+    /** Writes the pairs of obj into the object being written */
+    void WritePairs(const json_spirit::Object& obj);
+};
+
+// Streamed commands write their result as it is produced. They are run
+// without the dispatcher locks and take them around each part of the
+// result they build, so a slow client never holds cs_main or cs_wallet.
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, CJSONStreamWriter& writer);
+
+/** Writes the reply to a streamed call to stream as HTTP/1.1 chunks while
+ *  fnResult writes the result. Returns false if the connection has to be
+ *  closed after an error. */
+bool StreamRPCReply(std::ostream& stream, const std::string& strMethod, boost::function<void (CJSONStreamWriter&)> fnResult,
+                    const json_spirit::Value& id, bool fKeepAlive);
+
+/** Locks the dispatcher takes around a command */
+enum RPCLock
+{
+    RPC_LOCK_NONE,      // takes whatever locks it needs itself
+    RPC_LOCK_MAIN,      // reads the chain or the mempool, under cs_main
+    RPC_LOCK_WALLET,    // uses the wallet, under cs_main and cs_wallet
+};
+
 class CRPCCommand
 {
 public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool unlocked;
+    RPCLock lock;
+    rpcstreamfn_type streamActor; // optional
+};
+
+// upper bounds of the latency histogram buckets in microseconds, the
+// last bucket counts anything slower
+static const int RPC_LATENCY_BUCKETS = 6;
+static const int64_t RPC_LATENCY_BOUNDS[RPC_LATENCY_BUCKETS - 1] = { 1000, 10000, 100000, 1000000, 10000000 };
+
+/** Calls of one RPC method since startup */
+class CRPCMethodStats
+{
+public:
+    int64_t nCalls;
+    int64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    int64_t nLockWaitMicros;
+    int64_t vLatency[RPC_LATENCY_BUCKETS];
+
+    CRPCMethodStats()
+    {
+        nCalls = nErrors = nTotalMicros = nMaxMicros = nLockWaitMicros = 0;
+        for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            vLatency[i] = 0;
+    }
 };
 
 /**
@@ -106,6 +179,12 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+
+    mutable CCriticalSection cs_stats;
+    mutable std::map<std::string, CRPCMethodStats> mapStats;
+
+    void RecordCall(const std::string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, bool fError) const;
+    const CRPCCommand* Lookup(const std::string& strMethod) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -119,6 +198,18 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /** True if method can write its result with executeStream */
+    bool IsStreamed(const std::string &method) const;
+
+    /**
+     * Execute a streamed method, writing its result to writer.
+     * @throws an exception (json_spirit::Value) when an error happens.
+     */
+    void executeStream(const std::string &method, const json_spirit::Array &params, CJSONStreamWriter& writer) const;
+
+    /** Per method call counts and latencies */
+    void GetStats(std::map<std::string, CRPCMethodStats>& mapStatsRet) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -184,11 +275,13 @@ extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions_stream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddressbalancebyblock(const json_spirit::Array& params, bool fHelp);
+extern void getaddressbalancebyblock_stream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value getfirstturboblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getturbo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmyturboaddresses(const json_spirit::Array& params, bool fHelp);
@@ -212,6 +305,7 @@ extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fH
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent_stream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
@@ -225,8 +319,14 @@ extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp)
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock_stream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
+extern void getblockbynumber_stream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getsigcacheinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getcoincacheinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnewstealthaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value liststealthaddresses(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importstealthaddress(const json_spirit::Array& params, bool fHelp);
@@ -0,0 +1,75 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "main.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// block files are kept under 2GB, more than a 32-bit process can spare
+bool fMapBlockFiles = sizeof(void*) >= 8;
+
+CBlockFileMaps blockFileMaps;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pBegin, nSize);
+#endif
+}
+
+boost::shared_ptr<CMappedBlockFile> CBlockFileMaps::Get(unsigned int nFile, uint64_t nNeed)
+{
+#ifdef WIN32
+    return boost::shared_ptr<CMappedBlockFile>();
+#else
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return boost::shared_ptr<CMappedBlockFile>();
+
+    LOCK(cs);
+    map<unsigned int, boost::shared_ptr<CMappedBlockFile> >::iterator mi = mapFile.find(nFile);
+    if (mi != mapFile.end())
+    {
+        if (mi->second->nSize >= nNeed)
+            return mi->second;
+        mapFile.erase(mi);
+    }
+
+    string strPath = BlockFilePath(nFile).string();
+    int fd = open(strPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return boost::shared_ptr<CMappedBlockFile>();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size < nNeed)
+    {
+        close(fd);
+        return boost::shared_ptr<CMappedBlockFile>();
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        printf("CBlockFileMaps::Get() : mmap of %s failed: %s\n", strPath.c_str(), strerror(errno));
+        return boost::shared_ptr<CMappedBlockFile>();
+    }
+
+    boost::shared_ptr<CMappedBlockFile> file(new CMappedBlockFile((const char*)p, st.st_size));
+    mapFile[nFile] = file;
+    return file;
+#endif
+}
+
+void CBlockFileMaps::Clear()
+{
+    LOCK(cs);
+    mapFile.clear();
+}
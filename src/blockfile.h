@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SYNERGY_BLOCKFILE_H
+#define SYNERGY_BLOCKFILE_H
+
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+
+/** Deserializes in place from a range of memory */
+class CMemoryReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+    bool fEndOfData;
+
+    CMemoryReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn), fEndOfData(false) { }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+        {
+            fEndOfData = true;
+            throw std::ios_base::failure("CMemoryReader::read : end of data");
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** A read-only map of a whole block file, unmapped with the last reader */
+class CMappedBlockFile
+{
+public:
+    const char* pBegin;
+    size_t nSize;
+
+    CMappedBlockFile(const char* pBeginIn, size_t nSizeIn) : pBegin(pBeginIn), nSize(nSizeIn) { }
+    ~CMappedBlockFile();
+};
+
+/** Maps of the block files shared by every reader.
+ *
+ * A file is mapped on its first read and mapped again when a read goes past
+ * the end of its map, as happens to the file blocks are being appended to.
+ * Readers hold on to the map they read from, so a remap never pulls it out
+ * from under them. Blocks are still written with AppendBlockFile.
+ */
+class CBlockFileMaps
+{
+private:
+    CCriticalSection cs;
+    std::map<unsigned int, boost::shared_ptr<CMappedBlockFile> > mapFile;
+
+public:
+    /** Map of nFile holding at least nNeed bytes, empty if it can not be mapped */
+    boost::shared_ptr<CMappedBlockFile> Get(unsigned int nFile, uint64_t nNeed);
+
+    /** Drops every map; readers still holding one keep it until they are done */
+    void Clear();
+};
+
+extern bool fMapBlockFiles;
+extern CBlockFileMaps blockFileMaps;
+
+/** Reads obj from position nPos of block file nFile. Returns false if the
+ *  file is not mapped, so the caller reads it with OpenBlockFile instead.
+ *  Throws like CAutoFile if obj does not deserialize. */
+template<typename T>
+bool ReadFromMappedBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType, int nVersion)
+{
+    if (!fMapBlockFiles)
+        return false;
+
+    uint64_t nNeed = (uint64_t)nPos + 1;
+    while (true)
+    {
+        boost::shared_ptr<CMappedBlockFile> file = blockFileMaps.Get(nFile, nNeed);
+        if (!file)
+            return false;
+
+        CMemoryReader reader(file->pBegin + nPos, file->pBegin + file->nSize, nType, nVersion);
+        try {
+            reader >> obj;
+            return true;
+        }
+        catch (std::ios_base::failure& e) {
+            // the object may have been appended after the file was mapped,
+            // if the file has not grown since Get gives up on it
+            if (!reader.fEndOfData)
+                throw;
+            nNeed = (uint64_t)file->nSize + 1;
+        }
+    }
+}
+
+#endif // SYNERGY_BLOCKFILE_H
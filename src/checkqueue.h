@@ -7,6 +7,7 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/foreach.hpp>
 
 #include <vector>
 #include <algorithm>
@@ -146,6 +147,15 @@ public:
             condWorker.notify_all();
     }
 
+    // Shut the worker threads down once the remaining work is done
+    void Quit() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        // No need to wake the master, as he will quit automatically when all jobs are
+        // done.
+        condWorker.notify_all();
+    }
+
     ~CCheckQueue() {
     }
 
@@ -0,0 +1,135 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coincache.h"
+
+using namespace std;
+
+// map and list nodes of an entry besides what the transaction holds
+static const int64_t COIN_CACHE_ENTRY_OVERHEAD = sizeof(CCoinCacheEntry) + 128;
+
+CCoinCache coinCache(32 * 1024 * 1024);
+
+static bool IsFullySpent(const CTxIndex& txindex)
+{
+    BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+        if (pos.IsNull())
+            return false;
+    return true;
+}
+
+static int64_t EntryBytes(const CTxIndex& txindex, const CTransaction& tx)
+{
+    return COIN_CACHE_ENTRY_OVERHEAD + ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) +
+           txindex.vSpent.size() * sizeof(CDiskTxPos);
+}
+
+CCoinCache::CCoinCache(int64_t nMaxBytesIn)
+{
+    nBytes = 0;
+    nMaxBytes = nMaxBytesIn;
+    nHits = 0;
+    nMisses = 0;
+}
+
+void CCoinCache::SetMaxBytes(int64_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+void CCoinCache::Erase(map<uint256, CCoinCacheEntry>::iterator mi)
+{
+    nBytes -= mi->second.nBytes;
+    lruEntry.erase(mi->second.itLRU);
+    mapEntry.erase(mi);
+}
+
+void CCoinCache::Trim()
+{
+    while (nBytes > nMaxBytes && !lruEntry.empty())
+        Erase(mapEntry.find(lruEntry.back()));
+}
+
+bool CCoinCache::Get(const uint256& hash, CTxIndex& txindex, CTransaction& tx)
+{
+    LOCK(cs);
+    map<uint256, CCoinCacheEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+    {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    lruEntry.splice(lruEntry.begin(), lruEntry, mi->second.itLRU);
+    txindex = mi->second.txindex;
+    tx = mi->second.tx;
+    return true;
+}
+
+void CCoinCache::Put(const uint256& hash, const CTxIndex& txindex, const CTransaction& tx)
+{
+    if (IsFullySpent(txindex))
+        return;
+
+    int64_t nEntryBytes = EntryBytes(txindex, tx);
+    LOCK(cs);
+    if (nEntryBytes > nMaxBytes)
+        return;
+
+    map<uint256, CCoinCacheEntry>::iterator mi = mapEntry.find(hash);
+    if (mi != mapEntry.end())
+        Erase(mi);
+
+    lruEntry.push_front(hash);
+    CCoinCacheEntry& entry = mapEntry[hash];
+    entry.txindex = txindex;
+    entry.tx = tx;
+    entry.nBytes = nEntryBytes;
+    entry.itLRU = lruEntry.begin();
+    nBytes += nEntryBytes;
+    Trim();
+}
+
+void CCoinCache::Update(const uint256& hash, const CTxIndex& txindex)
+{
+    LOCK(cs);
+    map<uint256, CCoinCacheEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    if (IsFullySpent(txindex) || txindex.vSpent.size() != mi->second.txindex.vSpent.size())
+    {
+        Erase(mi);
+        return;
+    }
+    mi->second.txindex = txindex;
+}
+
+void CCoinCache::Erase(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, CCoinCacheEntry>::iterator mi = mapEntry.find(hash);
+    if (mi != mapEntry.end())
+        Erase(mi);
+}
+
+void CCoinCache::Clear()
+{
+    LOCK(cs);
+    mapEntry.clear();
+    lruEntry.clear();
+    nBytes = 0;
+}
+
+void CCoinCache::GetStats(uint64_t& nEntriesRet, int64_t& nBytesRet, int64_t& nMaxBytesRet,
+                          uint64_t& nHitsRet, uint64_t& nMissesRet) const
+{
+    LOCK(cs);
+    nEntriesRet = mapEntry.size();
+    nBytesRet = nBytes;
+    nMaxBytesRet = nMaxBytes;
+    nHitsRet = nHits;
+    nMissesRet = nMisses;
+}
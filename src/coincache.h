@@ -0,0 +1,65 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SYNERGY_COINCACHE_H
+#define SYNERGY_COINCACHE_H
+
+#include <list>
+#include <map>
+
+#include "main.h"
+#include "sync.h"
+
+/** A previous transaction with its index entry */
+class CCoinCacheEntry
+{
+public:
+    CTxIndex txindex;
+    CTransaction tx;
+    int64_t nBytes;
+    std::list<uint256>::iterator itLRU;
+};
+
+/** Previous transactions that FetchInputs looks up, with their index entries.
+ *
+ * ConnectBlock fills it with the transactions it connects and FetchInputs
+ * with those it reads from disk. CTxDB keeps the index entries current as it
+ * writes them, and drops everything if a database transaction is abandoned,
+ * so the cache never answers with what is not committed. Fully spent
+ * transactions are dropped, and the least recently used ones once the cache
+ * is over its size.
+ */
+class CCoinCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<uint256, CCoinCacheEntry> mapEntry;
+    std::list<uint256> lruEntry; // most recently used first
+    int64_t nBytes;
+    int64_t nMaxBytes;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    void Erase(std::map<uint256, CCoinCacheEntry>::iterator mi);
+    void Trim();
+
+public:
+    CCoinCache(int64_t nMaxBytesIn);
+
+    void SetMaxBytes(int64_t nMaxBytesIn);
+
+    bool Get(const uint256& hash, CTxIndex& txindex, CTransaction& tx);
+    void Put(const uint256& hash, const CTxIndex& txindex, const CTransaction& tx);
+
+    /** Replaces the index entry of hash if it is cached */
+    void Update(const uint256& hash, const CTxIndex& txindex);
+    void Erase(const uint256& hash);
+    void Clear();
+
+    void GetStats(uint64_t& nEntriesRet, int64_t& nBytesRet, int64_t& nMaxBytesRet,
+                  uint64_t& nHitsRet, uint64_t& nMissesRet) const;
+};
+
+extern CCoinCache coinCache;
+
+#endif // SYNERGY_COINCACHE_H
@@ -10,6 +10,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "kernel.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -19,6 +20,7 @@
 
 #ifndef WIN32
 #include <signal.h>
+#include <sys/resource.h>
 #endif
 
 unsigned short onion_port = TOR_PORT;
@@ -236,7 +238,17 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbwritebuffer=<n>     " + _("Set block index database write buffer size in megabytes (default: 4)") + "\n" +
+        "  -dbmaxopenfiles=<n>    " + _("Set the number of files the block index database keeps open (default: 1000)") + "\n" +
+        "  -dbblocksize=<n>       " + _("Set block index database block size in kilobytes (default: 4)") + "\n" +
+        "  -dbcompression         " + _("Compress the block index database (default: 1)") + "\n" +
+        "  -rawblockcache=<n>     " + _("Keep up to <n> megabytes of blocks recently sent to peers in memory (default: 8)") + "\n" +
+        "  -coincache=<n>         " + _("Keep up to <n> megabytes of previous transactions of inputs in memory (default: 32)") + "\n" +
+        "  -mapblockfiles         " + _("Read blocks and transactions from memory-mapped block files (default: 1 on 64-bit systems)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Set the valid signature cache size in megabytes (0 = off, default: 16)") + "\n" +
+        "  -smsgthreads=<n>       " + _("Set the number of secure messaging worker threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -245,6 +257,7 @@ std::string HelpMessage()
         "  -port=<port>           " + _("Listen for connections on <port> (default: 40698 or testnet: 50698)") + "\n" +
         "  -torport=<port>        " + _("Connect to Tor through <torport> (default: 38155)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of peer message handler threads (up to 8, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -256,6 +269,7 @@ std::string HelpMessage()
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
+        "  -stakethreads=<n>      " + _("Set the number of stake kernel search threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
@@ -292,6 +306,7 @@ std::string HelpMessage()
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 50542 or testnet: 60542)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
@@ -304,6 +319,7 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the transactions of every address, used by getaddressbalancebyblock and getturboredemption (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
@@ -365,12 +381,21 @@ bool AppInit2()
     sigemptyset(&sa_hup.sa_mask);
     sa_hup.sa_flags = 0;
     sigaction(SIGHUP, &sa_hup, NULL);
+
+    // Peer sockets share the descriptor limit with the database files
+    struct rlimit limitFiles;
+    if (getrlimit(RLIMIT_NOFILE, &limitFiles) == 0 && limitFiles.rlim_cur < limitFiles.rlim_max)
+    {
+        limitFiles.rlim_cur = limitFiles.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limitFiles);
+    }
 #endif
 
     // ********************************************************* Step 2: parameter interactions
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fAddressIndex = GetBoolArg("-addressindex", false);
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -438,6 +463,36 @@ bool AppInit2()
 
     fDebug = GetBoolArg("-debug");
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    InitSignatureCache(GetArg("-sigcachesize", 16) * 1024 * 1024);
+
+    // -stakethreads works like -par for the stake kernel search
+    nStakeKernelThreads = GetArg("-stakethreads", 0);
+    if (nStakeKernelThreads <= 0)
+        nStakeKernelThreads += boost::thread::hardware_concurrency();
+    if (nStakeKernelThreads <= 1 || !GetBoolArg("-staking", true))
+        nStakeKernelThreads = 0;
+    else if (nStakeKernelThreads > MAX_STAKE_KERNEL_THREADS)
+        nStakeKernelThreads = MAX_STAKE_KERNEL_THREADS;
+
+    // -msgthreads=0 means autodetect, at least one handler always runs
+    nMessageHandlerThreads = GetArg("-msgthreads", 0);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads += min(boost::thread::hardware_concurrency(), (unsigned int)4);
+    nMessageHandlerThreads = max(1, min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+
+    nRawBlockCacheSize = max((int64_t)0, GetArg("-rawblockcache", 8)) * 1024 * 1024;
+    fMapBlockFiles = GetBoolArg("-mapblockfiles", fMapBlockFiles);
+    coinCache.SetMaxBytes(max((int64_t)0, GetArg("-coincache", 32)) * 1024 * 1024);
+
     // -debug implies fDebug*
     if (fDebug)
     {
@@ -549,6 +604,12 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "synergy server starting\n");
 
+    if (nScriptCheckThreads) {
+        printf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            NewThread(ThreadScriptCheck, NULL);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -743,6 +804,11 @@ bool AppInit2()
     }
     printf(" block index %15"PRId64"ms\n", GetTimeMillis() - nStart);
 
+    if (fAddressIndex)
+        uiInterface.InitMessage(_("Building address index..."));
+    if (!BuildAddressIndex())
+        return InitError(_("Error building address index"));
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -753,7 +819,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -845,6 +911,15 @@ bool AppInit2()
         CBlockLocator locator;
         if (walletdb.ReadBestBlock(locator))
             pindexRescan = locator.GetBlockIndex();
+
+        // pick up a rescan that was interrupted
+        CBlockLocator locatorRescan;
+        if (walletdb.ReadRescanBlock(locatorRescan))
+        {
+            CBlockIndex* pindexResume = locatorRescan.GetBlockIndex();
+            if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight)
+                pindexRescan = pindexResume->pnext ? pindexResume->pnext : pindexResume;
+        }
     }
     if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
@@ -882,11 +957,11 @@ bool AppInit2()
         }
     }
 
-    int nStatusFMTA = FillMapTurboAddress();
-    if (nStatusFMTA) {
-          printf("Problem filling mapTurboAddress: error %d\n", nStatusFMTA);
+    int nStatusFTSS = FillTurboStakeSigners();
+    if (nStatusFTSS) {
+          printf("Problem filling turbo stake signers: error %d\n", nStatusFTSS);
     } else {
-          printf("Filled mapTurboAddress successfully.\n");
+          printf("Filled turbo stake signers successfully.\n");
     }
  
 
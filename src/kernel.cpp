@@ -4,6 +4,7 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include "checkqueue.h"
 #include "kernel.h"
 #include "txdb.h"
 
@@ -227,7 +228,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, const CBlockIndex** ppindexModifier = NULL)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom)) {
@@ -260,6 +261,8 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    if (ppindexModifier)
+        *ppindexModifier = pindex;
     return true;
 }
 
@@ -345,6 +348,294 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Kernel hash input as serialized by CheckStakeKernelHash, less the trailing nTimeTx
+static const unsigned int KERNEL_DATA_SIZE = 28;
+
+static void GetStakeKernelData(const CStakeKernel& kernel, unsigned char* pch)
+{
+    memcpy(pch, &kernel.nStakeModifier, 8);
+    memcpy(pch + 8, &kernel.nTimeBlockFrom, 4);
+    memcpy(pch + 12, &kernel.nTxPrevOffset, 4);
+    memcpy(pch + 16, &kernel.nTimeTxPrev, 4);
+    memcpy(pch + 20, &kernel.prevout.n, 4);
+}
+
+static CBigNum GetStakeKernelTarget(const CBigNum& bnTargetPerCoinDay, const CStakeKernel& kernel, unsigned int nTimeTx)
+{
+    CBigNum bnCoinDayWeight = CBigNum(kernel.nValueIn) * GetWeight((int64_t)kernel.nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    return bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+// Kernel inputs already looked up, with the time they were last asked for
+static map<COutPoint, pair<CStakeKernel, int64_t> > mapStakeKernelCache;
+static CCriticalSection cs_mapStakeKernelCache;
+
+bool GetStakeKernel(CTxDB& txdb, const CTransaction& txPrev, unsigned int nOut, CStakeKernel& kernel)
+{
+    kernel.SetNull();
+    COutPoint prevout(txPrev.GetHash(), nOut);
+    int64_t nNow = GetTime();
+
+    {
+        LOCK(cs_mapStakeKernelCache);
+        map<COutPoint, pair<CStakeKernel, int64_t> >::iterator mi = mapStakeKernelCache.find(prevout);
+        if (mi != mapStakeKernelCache.end())
+        {
+            if (mi->second.first.pindexFrom->IsInMainChain())
+                kernel = mi->second.first;
+            else
+                mapStakeKernelCache.erase(mi);
+        }
+    }
+
+    if (kernel.IsNull())
+    {
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(prevout.hash, txindex))
+            return false;
+
+        // Read block header
+        CBlock block;
+        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            return false;
+        BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+        if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+            return false;
+
+        kernel.prevout = prevout;
+        kernel.nValueIn = txPrev.vout[nOut].nValue;
+        kernel.nTimeBlockFrom = block.GetBlockTime();
+        kernel.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+        kernel.nTimeTxPrev = txPrev.nTime;
+        kernel.pindexFrom = mi->second;
+    }
+
+    // The modifier is only known once the chain has grown a selection
+    // interval past the coin, and changes if those blocks are reorganized
+    if (kernel.pindexModifier == NULL || !kernel.pindexModifier->IsInMainChain())
+    {
+        int nStakeModifierHeight = 0;
+        int64_t nStakeModifierTime = 0;
+        kernel.pindexModifier = NULL;
+        if (!GetKernelStakeModifier(kernel.pindexFrom->GetBlockHash(), kernel.nStakeModifier, nStakeModifierHeight,
+                                    nStakeModifierTime, false, &kernel.pindexModifier))
+            kernel.pindexModifier = NULL;
+    }
+
+    {
+        LOCK(cs_mapStakeKernelCache);
+        mapStakeKernelCache[prevout] = make_pair(kernel, nNow);
+
+        // Forget coins that have not been staked with for an hour
+        static int64_t nLastExpire = nNow;
+        if (nNow - nLastExpire > 10 * 60)
+        {
+            nLastExpire = nNow;
+            map<COutPoint, pair<CStakeKernel, int64_t> >::iterator mi = mapStakeKernelCache.begin();
+            while (mi != mapStakeKernelCache.end())
+            {
+                if (nNow - mi->second.second > 60 * 60)
+                    mapStakeKernelCache.erase(mi++);
+                else
+                    ++mi;
+            }
+        }
+    }
+    return true;
+}
+
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (kernel.pindexModifier == NULL)
+        return false;
+    if (nTimeTx < kernel.nTimeTxPrev)  // Transaction timestamp violation
+        return false;
+    if (kernel.nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnTarget = GetStakeKernelTarget(bnTargetPerCoinDay, kernel, nTimeTx);
+    targetProofOfStake = bnTarget.getuint256();
+
+    unsigned char pchData[KERNEL_DATA_SIZE];
+    GetStakeKernelData(kernel, pchData);
+    memcpy(pchData + 24, &nTimeTx, 4);
+    hashProofOfStake = Hash(pchData, pchData + KERNEL_DATA_SIZE);
+
+    return (CBigNum(hashProofOfStake) <= bnTarget);
+}
+
+int nStakeKernelThreads = 0;
+double dKernelsPerSec = 0;
+
+/** Outcome of a kernel search shared by the checks running it */
+class CStakeKernelSearch
+{
+public:
+    CCriticalSection cs;
+    bool fFound;
+    unsigned int nKernel;
+    unsigned int nTimeKernel;
+    uint64_t nTried;
+
+    CStakeKernelSearch() : fFound(false), nKernel(0), nTimeKernel(0), nTried(0) { }
+
+    bool IsFound()
+    {
+        LOCK(cs);
+        return fFound;
+    }
+};
+
+/** A range of coins to search over every timestamp, newest first.
+ *  Returns false on finding a kernel so that the queue stops handing out
+ *  the remaining ranges.
+ */
+class CStakeKernelCheck
+{
+private:
+    const std::vector<CStakeKernel>* pvKernel;
+    unsigned int nBegin;
+    unsigned int nEnd;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    const CBlockIndex* pindexPrev;
+    CStakeKernelSearch* psearch;
+
+public:
+    CStakeKernelCheck() : pvKernel(NULL), nBegin(0), nEnd(0), nBits(0), nTimeTx(0), nSearchInterval(0), pindexPrev(NULL), psearch(NULL) { }
+    CStakeKernelCheck(const std::vector<CStakeKernel>& vKernel, unsigned int nBeginIn, unsigned int nEndIn, unsigned int nBitsIn,
+                      unsigned int nTimeTxIn, unsigned int nSearchIntervalIn, const CBlockIndex* pindexPrevIn, CStakeKernelSearch& search) :
+        pvKernel(&vKernel), nBegin(nBeginIn), nEnd(nEndIn), nBits(nBitsIn), nTimeTx(nTimeTxIn),
+        nSearchInterval(nSearchIntervalIn), pindexPrev(pindexPrevIn), psearch(&search) { }
+
+    bool operator()() const;
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pvKernel, check.pvKernel);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(nBits, check.nBits);
+        std::swap(nTimeTx, check.nTimeTx);
+        std::swap(nSearchInterval, check.nSearchInterval);
+        std::swap(pindexPrev, check.pindexPrev);
+        std::swap(psearch, check.psearch);
+    }
+};
+
+bool CStakeKernelCheck::operator()() const
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    uint64_t nTried = 0;
+
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        if (fShutdown || pindexPrev != pindexBest || psearch->IsFound())
+            break;
+
+        const CStakeKernel& kernel = (*pvKernel)[i];
+        if (kernel.pindexModifier == NULL)
+            continue;
+
+        // Coin weight only grows with time, so the target at the newest
+        // timestamp bounds all the others and rejects most hashes cheaply
+        CBigNum bnTargetMax = GetStakeKernelTarget(bnTargetPerCoinDay, kernel, nTimeTx);
+        if (bnTargetMax <= 0)
+            continue;
+        bool fTargetMax = (BN_num_bits(&bnTargetMax) <= 256);
+        uint256 targetMax = fTargetMax ? bnTargetMax.getuint256() : 0;
+
+        unsigned char pchData[KERNEL_DATA_SIZE];
+        GetStakeKernelData(kernel, pchData);
+
+        for (unsigned int n = 0; n < nSearchInterval; n++)
+        {
+            unsigned int nTimeKernel = nTimeTx - n;
+            if (nTimeKernel < kernel.nTimeTxPrev || kernel.nTimeBlockFrom + nStakeMinAge > nTimeKernel)
+                break;
+
+            memcpy(pchData + 24, &nTimeKernel, 4);
+            uint256 hashProofOfStake = Hash(pchData, pchData + KERNEL_DATA_SIZE);
+            nTried++;
+            if (fTargetMax && hashProofOfStake > targetMax)
+                continue;
+            if (CBigNum(hashProofOfStake) > GetStakeKernelTarget(bnTargetPerCoinDay, kernel, nTimeKernel))
+                continue;
+
+            LOCK(psearch->cs);
+            psearch->nTried += nTried;
+            if (!psearch->fFound)
+            {
+                psearch->fFound = true;
+                psearch->nKernel = i;
+                psearch->nTimeKernel = nTimeKernel;
+            }
+            return false;
+        }
+    }
+
+    LOCK(psearch->cs);
+    psearch->nTried += nTried;
+    return true;
+}
+
+static CCheckQueue<CStakeKernelCheck> stakekernelqueue(4);
+
+void ThreadStakeKernel(void*)
+{
+    vnThreadsRunning[THREAD_STAKE_KERNEL]++;
+    RenameThread("synergy-kernel");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    stakekernelqueue.Thread();
+    vnThreadsRunning[THREAD_STAKE_KERNEL]--;
+}
+
+void ThreadStakeKernelQuit()
+{
+    stakekernelqueue.Quit();
+}
+
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernel>& vKernel, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     const CBlockIndex* pindexPrev, unsigned int& nKernel, unsigned int& nTimeKernel)
+{
+    static const unsigned int nKernelsPerCheck = 16;
+
+    int64_t nStart = GetTimeMicros();
+    CStakeKernelSearch search;
+    {
+        CCheckQueueControl<CStakeKernelCheck> control(nStakeKernelThreads ? &stakekernelqueue : NULL);
+        std::vector<CStakeKernelCheck> vChecks;
+        for (unsigned int i = 0; i < vKernel.size(); i += nKernelsPerCheck)
+        {
+            CStakeKernelCheck check(vKernel, i, min(i + nKernelsPerCheck, (unsigned int)vKernel.size()),
+                                    nBits, nTimeTx, nSearchInterval, pindexPrev, search);
+            if (nStakeKernelThreads)
+            {
+                vChecks.push_back(CStakeKernelCheck());
+                check.swap(vChecks.back());
+            }
+            else if (!check())
+                break;
+        }
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    if (nElapsed > 0)
+        dKernelsPerSec = 1000000.0 * search.nTried / nElapsed;
+
+    if (!search.fFound)
+        return false;
+    nKernel = search.nKernel;
+    nTimeKernel = search.nTimeKernel;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -20,6 +20,67 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+/** Kernel inputs of a staking coin that stay fixed while timestamps are searched */
+class CStakeKernel
+{
+public:
+    COutPoint prevout;
+    int64_t nValueIn;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    uint64_t nStakeModifier;
+    const CBlockIndex* pindexFrom;      // block holding the coin
+    const CBlockIndex* pindexModifier;  // block the stake modifier came from, NULL until known
+
+    CStakeKernel()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        prevout.SetNull();
+        nValueIn = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nStakeModifier = 0;
+        pindexFrom = NULL;
+        pindexModifier = NULL;
+    }
+
+    bool IsNull() const
+    {
+        return (pindexFrom == NULL);
+    }
+};
+
+/** Maximum number of kernel search threads */
+static const int MAX_STAKE_KERNEL_THREADS = 16;
+
+extern int nStakeKernelThreads;
+extern double dKernelsPerSec;
+
+// Get the kernel inputs of output nOut of txPrev, reusing those cached by
+// earlier searches while their blocks stay in the main chain
+bool GetStakeKernel(CTxDB& txdb, const CTransaction& txPrev, unsigned int nOut, CStakeKernel& kernel);
+
+// Check whether cached kernel inputs meet hash target at nTimeTx
+bool CheckStakeKernelHash(unsigned int nBits, const CStakeKernel& kernel, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Search nTimeTx and the nSearchInterval-1 seconds before it for a kernel
+// among vKernel, spread over the kernel search threads
+// Sets nKernel and nTimeKernel on success return
+bool FindStakeKernel(unsigned int nBits, const std::vector<CStakeKernel>& vKernel, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     const CBlockIndex* pindexPrev, unsigned int& nKernel, unsigned int& nTimeKernel);
+
+// Run an instance of the kernel search thread
+void ThreadStakeKernel(void* parg);
+
+// Stop the kernel search threads
+void ThreadStakeKernelQuit();
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -9,6 +9,17 @@
 
 #include "key.h"
 
+#ifdef USE_SECP256K1
+#include <secp256k1_recovery.h>
+
+const secp256k1_context* GetSecp256k1Context()
+{
+    // created on first use and never modified after that, so threads can share it
+    static secp256k1_context* ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+    return ctx;
+}
+#endif
+
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
@@ -468,6 +479,60 @@ bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
+{
+    if (vchPubKey.empty() || vchSig.empty())
+        return false;
+#ifdef USE_SECP256K1
+    // Keys and encodings libsecp256k1 refuses are left to OpenSSL below,
+    // so both backends accept the same signatures
+    const secp256k1_context* ctx = GetSecp256k1Context();
+    secp256k1_pubkey pubkey;
+    secp256k1_ecdsa_signature sig;
+    if (secp256k1_ec_pubkey_parse(ctx, &pubkey, &vchPubKey[0], vchPubKey.size()) &&
+        secp256k1_ecdsa_signature_parse_der(ctx, &sig, &vchSig[0], vchSig.size()))
+    {
+        // OpenSSL also accepts the high S form
+        secp256k1_ecdsa_signature_normalize(ctx, &sig, &sig);
+        return secp256k1_ecdsa_verify(ctx, &sig, (const unsigned char*)&hash, &pubkey) == 1;
+    }
+#endif
+    CKey key;
+    if (!key.SetPubKey(*this))
+        return false;
+    return key.Verify(hash, vchSig);
+}
+
+bool CPubKey::RecoverCompact(const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    if (vchSig.size() != 65)
+        return false;
+    int nV = vchSig[0];
+    if (nV<27 || nV>=35)
+        return false;
+#ifdef USE_SECP256K1
+    const secp256k1_context* ctx = GetSecp256k1Context();
+    bool fCompressed = (nV >= 31);
+    secp256k1_ecdsa_recoverable_signature sig;
+    secp256k1_pubkey pubkey;
+    if (!secp256k1_ecdsa_recoverable_signature_parse_compact(ctx, &sig, &vchSig[1], (nV - 27) & 3))
+        return false;
+    if (!secp256k1_ecdsa_recover(ctx, &pubkey, &sig, (const unsigned char*)&hash))
+        return false;
+    unsigned char pch[65];
+    size_t nSize = sizeof(pch);
+    secp256k1_ec_pubkey_serialize(ctx, pch, &nSize, &pubkey, fCompressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED);
+    vchPubKey.assign(pch, pch + nSize);
+    return true;
+#else
+    CKey key;
+    if (!key.SetCompactSignature(hash, vchSig))
+        return false;
+    *this = key.GetPubKey();
+    return true;
+#endif
+}
+
 bool CKey::IsValid()
 {
     if (!fSet)
@@ -489,6 +554,11 @@ bool ECC_InitSanityCheck() {
         return false;
     EC_KEY_free(pkey);
 
+#ifdef USE_SECP256K1
+    if (GetSecp256k1Context() == NULL)
+        return false;
+#endif
+
     // TODO Is there more EC functionality that could be missing?
     return true;
 }
@@ -15,6 +15,13 @@
 
 #include <openssl/ec.h> // for EC_KEY definition
 
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+
+// Shared libsecp256k1 context for verification and public key derivation
+const secp256k1_context* GetSecp256k1Context();
+#endif
+
 // secp160k1
 // const unsigned int PRIVATE_KEY_SIZE = 192;
 // const unsigned int PUBLIC_KEY_SIZE  = 41;
@@ -96,6 +103,12 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Verify a DER signature, with libsecp256k1 if built with USE_SECP256K1
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+
+    // Set to the public key that made a compact signature, see CKey::SignCompact
+    bool RecoverCompact(const uint256& hash, const std::vector<unsigned char>& vchSig);
 };
 
 
@@ -5,13 +5,16 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
+#include "coincache.h"
 #include "net.h"
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
 #include "stealth.h"
+#include "turbo.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -35,11 +38,9 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-// caches signing addresses map to the block hash (only for turbo period)
-map<uint256, CBitcoinAddress> mapTurboAddress;
 
 // PoW starting diff: 0.00001526
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 16);
@@ -81,8 +82,11 @@ int64_t nTurboStartTime = 1432793442;
 
 // set when known
 // int nLastTurboHeight = 0;
-// set when known
-CBlockIndex *pindexLastTurbo = NULL;
+// set once the coinstake signers of the turbo period are all in the block index
+bool fTurboStakeSignersLoaded = false;
+
+// active chain through the turbo period (allowing for block time drift)
+CTurboIndex turboIndex(nTargetSpacing - 2, nTargetSpacing2 - 2, FutureDrift(nTurboEndTime));
 
 int nCoinbaseMaturity = 120; // 120 blocks (4 hr)
 // Maximum age of a coin (not "coin-age") 8 days
@@ -95,6 +99,8 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CActiveChain chainActive;
+CBlockIndexArena blockIndexArena;
 int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
@@ -115,6 +121,9 @@ const string strMessageMagic = "Synergy Signed Message:\n";
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nScriptCheckThreads = 0;
+bool fAddressIndex = false;
+int64_t nRawBlockCacheSize = 8 * 1024 * 1024;
 
 extern enum Checkpoints::CPMode CheckpointsMode;
 
@@ -502,7 +511,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -907,7 +916,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -999,7 +1008,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1045,22 +1054,89 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+CBlockIndexHasher::CBlockIndexHasher()
+{
+    nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+CBlockIndexArena::CBlockIndexArena()
+{
+    nUsed = CHUNK_ENTRIES;
+}
+
+void* CBlockIndexArena::Alloc()
+{
+    LOCK(cs);
+    if (nUsed == CHUNK_ENTRIES)
+    {
+        vChunk.push_back((char*)::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES));
+        nUsed = 0;
+    }
+    return vChunk.back() + sizeof(CBlockIndex) * nUsed++;
+}
+
+CBlockIndex* CBlockIndexArena::New()
+{
+    return new (Alloc()) CBlockIndex();
+}
+
+CBlockIndex* CBlockIndexArena::New(unsigned int nFile, unsigned int nBlockPos, CBlock& block)
+{
+    return new (Alloc()) CBlockIndex(nFile, nBlockPos, block);
+}
+
+void CActiveChain::SetTip(CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        vMaxTime.clear();
+        return;
+    }
+
+    // only the heights above the fork with the old chain change
+    vChain.resize(pindex->nHeight + 1);
+    vMaxTime.resize(vChain.size());
+    int nFork = vChain.size();
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        nFork = pindex->nHeight;
+        pindex = pindex->pprev;
+    }
+    for (unsigned int nHeight = nFork; nHeight < vChain.size(); nHeight++)
+        vMaxTime[nHeight] = max(nHeight > 0 ? vMaxTime[nHeight - 1] : 0, vChain[nHeight]->nTime);
+}
+
+CBlockIndex* CActiveChain::operator[](int nHeight) const
+{
+    LOCK(cs);
+    if (nHeight < 0 || nHeight >= (int)vChain.size())
+        return NULL;
+    return vChain[nHeight];
+}
+
+bool CActiveChain::Contains(const CBlockIndex* pindex) const
+{
+    return (*this)[pindex->nHeight] == pindex;
+}
+
+int CActiveChain::Height() const
+{
+    LOCK(cs);
+    return (int)vChain.size() - 1;
+}
+
+int CActiveChain::FindHeightByTime(unsigned int nTime) const
+{
+    LOCK(cs);
+    return lower_bound(vMaxTime.begin(), vMaxTime.end(), nTime) - vMaxTime.begin();
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1123,6 +1199,15 @@ int64_t GetProofOfWorkReward(int nHeight, int64_t nFees)
 
 const int DAILY_BLOCKCOUNT =  720;
 
+// fills in the coinstake signer of a block indexed by an older client
+static bool ReadStakeSigner(CBlockIndex* pindex)
+{
+    CBlock block;
+    if (!block.ReadFromDisk(pindex, true))
+        return false;
+    return block.GetStakeSigner(pindex->keyStakeSigner);
+}
+
 // returns negative if something goes wrong
 // returns 0 if block does not honor target spacing
 //    -> 0 rewards, but thanks for securing the net,
@@ -1166,65 +1251,57 @@ int GetTurboStakeMultiplier(CBitcoinAddress address, int64_t txTime, CBlockIndex
 
   int64_t time_last = txTime;
 
-  CBlockIndex* pindexPrev = pindex;
-
-  while (pindexPrev->pprev != NULL) {
-    if (pindexPrev->nTime < lookbackTime) {
-      break;
-    }
-    block_count++;
-    if (pindexPrev->IsProofOfStake()) {
-      CBitcoinAddress blockAddress; // signing address as CBitcoinAddress
-      // use the map cache to save lots of disk access
-      uint256 blockHash = *pindexPrev->phashBlock;
-      map<uint256, CBitcoinAddress>::iterator it = mapTurboAddress.find(blockHash);
-      if (it != mapTurboAddress.end())
-      {
-           // printf("GetTurboStakeMultiplier: found block in cache: %s\n", it->first.ToString().c_str());
-           blockAddress = it->second;
+  // signers are kept in the block index as key ids, so compare against that
+  CKeyID keyID;
+  if (!address.GetKeyID(keyID))
+    keyID = CKeyID();
+
+  bool fTooClose = false;
+  if (turboIndex.GetWindow(keyID, txTime, lookbackTime, pindex, pindex->nTime >= nSpacing2Time,
+                           turbo_count, block_count, fTooClose))
+  {
+    if (fTooClose) {
+      if (fDebug) {
+            printf("GetTurboStakeMultiplier: Penalized for not honoring target spacing.\n");
       }
-      else
-      {
-           CBlock block;  // current block within lookback
-           block.ReadFromDisk(pindexPrev, true);
-           // vtx[1].vout[0] is empty for PoS
-           // set to output of first CTransaction of block
-           CTxOut txout = block.vtx[1].vout[1];
-           CTxDestination sigaddr; // signing address of block as CTxDestination if PoS
-           if (ExtractDestination(txout.scriptPubKey, sigaddr))
-           {
-                blockAddress = CBitcoinAddress(sigaddr);
-                mapTurboAddress[blockHash] = blockAddress;
-                // if (fDebug) {
-                //      printf("GetTurboStakeMultiplier: mapTurboAddress[%s]=%s\n",
-                //                blockHash.ToString().c_str(), blockAddress.ToString().c_str());
-                // }
-           }
-           else
-           {
-                if (fDebug) {
-                     printf("GetTurboStakeMultiplier: Could not extract destination.\n");
-                }
-                return -5;
-           }
+      return 0;
+    }
+  }
+  else
+  {
+    // pindex is not on the indexed active chain, so walk back through it
+    CBlockIndex* pindexPrev = pindex;
+
+    while (pindexPrev->pprev != NULL) {
+      if (pindexPrev->nTime < lookbackTime) {
+        break;
       }
-      if (blockAddress == address) {
-          if ((time_last - pindexPrev->nTime) < allowedSpacing) {
-            if (fDebug) {
-                  printf("GetTurboStakeMultiplier: Penalized for not honoring target spacing.\n");
+      block_count++;
+      if (pindexPrev->IsProofOfStake()) {
+        if ((pindexPrev->keyStakeSigner == 0) && !ReadStakeSigner(pindexPrev)) {
+             if (fDebug) {
+                  printf("GetTurboStakeMultiplier: Could not extract destination.\n");
+             }
+             return -5;
+        }
+        if (pindexPrev->keyStakeSigner == keyID) {
+            if ((time_last - pindexPrev->nTime) < allowedSpacing) {
+              if (fDebug) {
+                    printf("GetTurboStakeMultiplier: Penalized for not honoring target spacing.\n");
+              }
+              return 0;
             }
-            return 0;
-          }
-          else {
-            turbo_count++;
-            time_last = pindexPrev->nTime;
-          }
+            else {
+              turbo_count++;
+              time_last = pindexPrev->nTime;
+            }
+        }
+      }
+      pindexPrev = pindexPrev->pprev;
+      if (pindexPrev == NULL) {
+        printf("GetTurboStakeMultiplier: prev index unexpectedly null\n");
+        return -6;
       }
-    }
-    pindexPrev = pindexPrev->pprev;
-    if (pindexPrev == NULL) {
-      printf("GetTurboStakeMultiplier: prev index unexpectedly null\n");
-      return -6;
     }
   }
   if (fDebug) {
@@ -1300,96 +1377,242 @@ int64_t GetProofOfStakeReward(int64_t nCoinAge, CBitcoinAddress address,
     return nSubsidy;
 }
 
-// fills mapTurboAddress from highest possible block
+// appends a block of the new best chain to the turbo index
+static bool ConnectTurboIndex(CBlockIndex* pindex)
+{
+    if (!turboIndex.Accepts(pindex))
+        return false;
+
+    int nMultiplier = 0;
+    if (pindex->IsProofOfStake())
+    {
+        if ((pindex->keyStakeSigner == 0) && !ReadStakeSigner(pindex))
+            return false;
+        nMultiplier = GetTurboStakeMultiplier(CBitcoinAddress(pindex->keyStakeSigner),
+                                              pindex->nStakeTime, pindex->pprev);
+    }
+    return turboIndex.Connect(pindex, nMultiplier);
+}
+
+// builds the turbo index from the best chain, reading the coinstake signer of
+// blocks indexed by older clients once and writing it back to the block index
 // returns 1 if pindexBest is NULL
 // returns 2 if pindexBest is genesis block
-// returns 3 if can't find a previous turbo block
-// returns 4 if can't get destination from previous turbo block
-int FillMapTurboAddress()
+// returns 3 if can't find a turbo block
+// returns 4 if can't get destination from a turbo block
+// returns 5 if the block index can't be written
+int FillTurboStakeSigners()
 {
-    CBlockIndex *pindex;
+    fTurboStakeSignersLoaded = false;
+    turboIndex.SetNull();
 
-    if (pindexLastTurbo != NULL)
+    if (pindexBest == NULL)
     {
-         pindex = pindexLastTurbo;
+         if (fDebug) {
+              printf("FillTurboStakeSigners: best block is is null.\n");
+         }
+         return 1;
     }
-    else
+
+    CTxDB txdb;
+    int nFilled = 0;
+    int nTurboStakes = 0;
+
+    for (CBlockIndex *pindex = pindexGenesisBlock; pindex != NULL; pindex = pindex->pnext)
     {
-         pindex = pindexBest;
+        if (!turboIndex.Accepts(pindex))
+            break;
+
+        if (pindex->IsProofOfStake())
+        {
+            if (pindex->keyStakeSigner == 0)
+            {
+                if (!ReadStakeSigner(pindex))
+                {
+                     if (fDebug) {
+                           printf("FillTurboStakeSigners: Could not extract destination.\n");
+                     }
+                     return 4;
+                }
+                if (!txdb.WriteBlockIndex(CDiskBlockIndex(pindex)))
+                     return 5;
+                nFilled++;
+            }
+            if (pindex->nTime <= nTurboEndTime)
+                nTurboStakes++;
+        }
+
+        if (!ConnectTurboIndex(pindex))
+            break;
     }
-        
-    if (pindex == NULL)
+
+    if (nFilled > 0)
     {
-         if (fDebug) {
-              printf("FillMapTurboAddress: best block is is null.\n");
-         }
-         return 1;
+         printf("FillTurboStakeSigners: wrote %d coinstake signers to the block index\n", nFilled);
     }
 
-    if (pindex->pprev == NULL)
+    fTurboStakeSignersLoaded = true;
+
+    if (pindexBest->pprev == NULL)
     {
          if (fDebug) {
-              printf("FillMapTurboAddress: best block is genesis block.\n");
+              printf("FillTurboStakeSigners: best block is genesis block.\n");
          }
          return 2;
     }
 
-    // [TODO] refactor (?) find previous turbo block
-    if ((pindex->nTime > nTurboEndTime) || !pindex->IsProofOfStake())
+    if (nTurboStakes == 0)
     {
-         while (pindex->pprev != NULL)
-         {
-            if ((pindex->nTime <= nTurboEndTime) &&  pindex->IsProofOfStake())
-            {
-                  break;
-            }
-            pindex = pindex->pprev;
+         if (fDebug) {
+              printf("FillTurboStakeSigners: unable to find turbo block.\n");
          }
+         return 3;
     }
 
-    if (pindex->pprev == NULL)
+    return 0;
+}
+
+// signing address of a turbo period coinstake
+bool GetTurboStakeSigner(CBlockIndex* pindex, CBitcoinAddress& address)
+{
+    if (!pindex->IsProofOfStake() || (pindex->nTime > nTurboEndTime))
+        return false;
+    if ((pindex->keyStakeSigner == 0) && !ReadStakeSigner(pindex))
+        return false;
+    address = CBitcoinAddress(pindex->keyStakeSigner);
+    return true;
+}
+
+
+bool GetAddressIndexHash(const CTxDestination& dest, unsigned char& nType, uint160& hashBytes)
+{
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
     {
-         if (fDebug) {
-              printf("FillMapTurboAddress: unable to find turbo block.\n");
-         }
-         return 3;
+        nType = 1;
+        hashBytes = *pkeyID;
+        return true;
     }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+    {
+        nType = 2;
+        hashBytes = *pscriptID;
+        return true;
+    }
+    return false;
+}
 
-    while (pindex->pprev != NULL)
+// -addressindex records of transaction nTx of a block at nHeight, given the
+// outputs its inputs spend (empty for a coinbase)
+static void AddAddressIndex(const CTransaction& tx, int nTx, int nHeight, const vector<CTxOut>& vPrevOut, AddressIndexVector& vIndex)
+{
+    uint256 hashTx = tx.GetHash();
+    bool fCoinStake = tx.IsCoinStake();
+    unsigned char nType;
+    uint160 hashBytes;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
-        if (pindex->IsProofOfStake())
+        CTxDestination dest;
+        if (!ExtractDestination(tx.vout[i].scriptPubKey, dest) || !GetAddressIndexHash(dest, nType, hashBytes))
+            continue;
+        vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, false),
+                                   CAddressIndexValue(tx.vout[i].nValue, nTx, fCoinStake)));
+    }
+    for (unsigned int i = 0; i < vPrevOut.size(); i++)
+    {
+        CTxDestination dest;
+        if (!ExtractDestination(vPrevOut[i].scriptPubKey, dest) || !GetAddressIndexHash(dest, nType, hashBytes))
+            continue;
+        vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, true),
+                                   CAddressIndexValue(-vPrevOut[i].nValue, nTx, fCoinStake)));
+    }
+}
+
+// -addressindex records of a block, reading the spent outputs from the block
+// itself or the tx index
+static bool GetBlockAddressIndex(CTxDB& txdb, const CBlock& block, int nHeight, AddressIndexVector& vIndex)
+{
+    map<uint256, const CTransaction*> mapBlockTx;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        mapBlockTx[tx.GetHash()] = &tx;
+
+    for (unsigned int nTx = 0; nTx < block.vtx.size(); nTx++)
+    {
+        const CTransaction& tx = block.vtx[nTx];
+        vector<CTxOut> vPrevOut;
+        if (!tx.IsCoinBase())
         {
-            map<uint256, CBitcoinAddress>::iterator it = mapTurboAddress.find(*pindex->phashBlock);
-            if (it == mapTurboAddress.end())
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
-                // [TODO] refactor this code block (see GetTurboStakeMultiplier)
-                CBitcoinAddress blockAddress;
-                CTxOut txout;
-                {
-                    CBlock block;
-                    block.ReadFromDisk(pindex, true);
-                    txout = block.vtx[1].vout[1];
-                    CTxDestination sigaddr; // signing address of block as CTxDestination if PoS
-                    if (ExtractDestination(txout.scriptPubKey, sigaddr))
-                    {
-                         blockAddress = CBitcoinAddress(sigaddr);
-                    }
-                    else
-                    {
-                         if (fDebug) {
-                               printf("FillMapTurboAddress: Could not extract destination.\n");
-                         }
-                         return 4;
-                    }
-                }
-                mapTurboAddress[*pindex->phashBlock] = blockAddress;
+                CTransaction txPrev;
+                map<uint256, const CTransaction*>::iterator mi = mapBlockTx.find(txin.prevout.hash);
+                if (mi != mapBlockTx.end())
+                    txPrev = *mi->second;
+                else if (!txdb.ReadDiskTx(txin.prevout.hash, txPrev))
+                    return error("GetBlockAddressIndex() : prev tx %s not found", txin.prevout.hash.ToString().substr(0,10).c_str());
+                if (txin.prevout.n >= txPrev.vout.size())
+                    return error("GetBlockAddressIndex() : prevout %s:%u out of range", txin.prevout.hash.ToString().substr(0,10).c_str(), txin.prevout.n);
+                vPrevOut.push_back(txPrev.vout[txin.prevout.n]);
             }
         }
-        pindex = pindex->pprev;
-   }
-   return 0;
+        AddAddressIndex(tx, nTx, nHeight, vPrevOut, vIndex);
+    }
+    return true;
 }
 
+// (re)builds the -addressindex records of the best chain when the index was
+// just enabled, and forgets a built index when it is disabled since it then
+// goes stale
+bool BuildAddressIndex()
+{
+    LOCK(cs_main);
+    CTxDB txdb;
+
+    bool fIndexed = false;
+    txdb.ReadAddressIndexed(fIndexed);
+    if (fIndexed == fAddressIndex)
+        return true;
+    if (fIndexed)
+        return txdb.WriteAddressIndexed(false);
+
+    printf("BuildAddressIndex: indexing the best chain\n");
+    int64_t nStart = GetTimeMillis();
+    if (!txdb.WipeAddressIndex())
+        return false;
+
+    int nRecords = 0;
+    txdb.TxnBegin();
+    // the genesis block is never connected, so it has no records
+    for (CBlockIndex* pindex = pindexGenesisBlock ? pindexGenesisBlock->pnext : NULL; pindex != NULL; pindex = pindex->pnext)
+    {
+        if (fRequestShutdown)
+        {
+            txdb.TxnAbort();
+            return false;
+        }
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("BuildAddressIndex() : ReadFromDisk failed at height %d", pindex->nHeight);
+        AddressIndexVector vIndex;
+        if (!GetBlockAddressIndex(txdb, block, pindex->nHeight, vIndex) || !txdb.WriteAddressIndex(vIndex))
+            return error("BuildAddressIndex() : indexing failed at height %d", pindex->nHeight);
+        nRecords += vIndex.size();
+
+        if (pindex->nHeight % 1000 == 0)
+        {
+            if (!txdb.TxnCommit())
+                return false;
+            txdb.TxnBegin();
+            if (pindex->nHeight % 10000 == 0)
+                printf("BuildAddressIndex: height %d\n", pindex->nHeight);
+        }
+    }
+    if (!txdb.WriteAddressIndexed(true) || !txdb.TxnCommit())
+        return false;
+
+    printf("BuildAddressIndex: %d records in %"PRId64"ms\n", nRecords, GetTimeMillis() - nStart);
+    return true;
+}
 
 static const int64_t nTargetTimespan = 20 * 60;  // 10 blocks
 //
@@ -1639,12 +1862,18 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
 
         // Read txindex
         CTxIndex& txindex = inputsRet[prevout.hash].first;
+        CTransaction& txPrev = inputsRet[prevout.hash].second;
         bool fFound = true;
+        bool fCached = false;
         if ((fBlock || fMiner) && mapTestPool.count(prevout.hash))
         {
             // Get txindex from current proposed changes
             txindex = mapTestPool.find(prevout.hash)->second;
         }
+        else if (coinCache.Get(prevout.hash, txindex, txPrev))
+        {
+            fCached = true;
+        }
         else
         {
             // Read txindex from txdb
@@ -1654,7 +1883,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
 
         // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
+        if (fCached)
+            continue;
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
@@ -1675,6 +1905,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             // Get prev tx from disk
             if (!txPrev.ReadFromDisk(txindex.pos))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            if (!mapTestPool.count(prevout.hash))
+                coinCache.Put(prevout.hash, txindex, txPrev);
         }
     }
 
@@ -1739,8 +1971,15 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1798,7 +2037,14 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                if (pvChecks)
+                {
+                    // Defer to the caller's check queue; txPrev is only needed for its scriptPubKey
+                    pvChecks->push_back(CScriptCheck());
+                    CScriptCheck check(txPrev, *this, i, 0);
+                    check.swap(pvChecks->back());
+                }
+                else if (!VerifySignature(txPrev, *this, i, 0))
                 {
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed",
                                          GetHash().ToString().substr(0,10).c_str()));
@@ -1890,6 +2136,11 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Gather the address records while the spent transactions are still indexed
+    AddressIndexVector vAddressIndex;
+    if (fAddressIndex && !GetBlockAddressIndex(txdb, *this, pindex->nHeight, vAddressIndex))
+        return error("DisconnectBlock() : GetBlockAddressIndex failed");
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1905,6 +2156,9 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
             return error("DisconnectBlock() : WriteBlockIndex failed");
     }
 
+    if (fAddressIndex && !txdb.EraseAddressIndex(vAddressIndex))
+        return error("DisconnectBlock() : EraseAddressIndex failed");
+
     // ppcoin: clean up wallet after disconnecting coinstake
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, false, false);
@@ -1912,8 +2166,23 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void*) {
+    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+    RenameThread("synergy-scriptch");
+    scriptcheckqueue.Thread();
+    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+}
+
+void ThreadScriptCheckQuit() {
+    scriptcheckqueue.Quit();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
+    AssertLockHeld(cs_main);
+
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
         return false;
@@ -1927,7 +2196,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks are farmed out to the -par worker pool; the control
+    // object joins them (also on early return) before vtx goes away
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
+    AddressIndexVector vAddressIndex;
+    int nTx = 0;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1989,10 +2264,24 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
+        if (fAddressIndex && !fJustCheck)
+        {
+            vector<CTxOut> vPrevOut;
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    vPrevOut.push_back(mapInputs[txin.prevout.hash].second.vout[txin.prevout.n]);
+            }
+            AddAddressIndex(tx, nTx, pindex->nHeight, vPrevOut, vAddressIndex);
+        }
+        nTx++;
+
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
@@ -2017,12 +2306,20 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         ExtractDestination(vtx[1].vout[1].scriptPubKey, dAddr);
         CBitcoinAddress sigaddr(dAddr);
 
+        // index entries written by older clients lack the signer
+        if (pindex->keyStakeSigner == 0)
+            GetStakeSigner(pindex->keyStakeSigner);
+
         int64_t nCalculatedStakeReward = GetProofOfStakeReward(nCoinAge, sigaddr, vtx[1].nTime, pindex->pprev);
 
         if (nStakeReward > nCalculatedStakeReward)
             return DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%"PRId64" vs calculated=%"PRId64")", nStakeReward, nCalculatedStakeReward));
     }
 
+    // Join the script checks before anything is written
+    if (!control.Wait())
+        return DoS(100, false);
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -2039,6 +2336,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // The outputs this block creates are the ones spent soonest
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (tx.IsCoinBase() || tx.IsCoinStake())
+            continue;
+        uint256 hashTx = tx.GetHash();
+        coinCache.Put(hashTx, mapQueuedChanges[hashTx], tx);
+    }
+
+    if (fAddressIndex && !txdb.WriteAddressIndex(vAddressIndex))
+        return error("ConnectBlock() : WriteAddressIndex failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -2135,13 +2444,19 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+    {
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+        turboIndex.Disconnect(pindex);
+    }
 
     // Connect longer branch
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+    {
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+        ConnectTurboIndex(pindex);
+    }
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -2176,6 +2491,7 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    ConnectTurboIndex(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -2197,6 +2513,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        ConnectTurboIndex(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2260,12 +2577,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
+    if (!fIsInitialDownload)
+        WakeStakeMiner();
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
     printf("SetBestChain: new best=%s  height=%d  trust=%s  blocktrust=%"PRId64"  date=%s\n",
@@ -2381,11 +2701,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.New(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2413,7 +2731,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%08"PRIx32, pindexNew->nHeight, pindexNew->nStakeModifierChecksum);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2544,7 +2862,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2768,6 +3086,34 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fIsBootstrap)
     return true;
 }
 
+// Search the wallet for a coinstake on the current best block, covering the
+// timestamps not searched yet. A new best block changes the target and the
+// earliest acceptable timestamp, so the search then goes back to that timestamp.
+bool SearchCoinStake(CWallet& wallet, unsigned int nBits, int64_t nFees, CTransaction& txCoinStake, CKey& key)
+{
+    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    static uint256 hashLastCoinStakeSearchBest = 0;
+
+    int64_t nPastLimit = max(pindexBest->GetPastTimeLimit()+1, PastDrift(pindexBest->GetBlockTime()));
+    int64_t nSearchTime = txCoinStake.nTime; // search to current time
+
+    if (hashBestChain != hashLastCoinStakeSearchBest)
+    {
+        hashLastCoinStakeSearchBest = hashBestChain;
+        nLastCoinStakeSearchTime = min(nLastCoinStakeSearchTime, nPastLimit - 1);
+    }
+
+    if (nSearchTime <= nLastCoinStakeSearchTime)
+        return false;
+
+    bool fFound = wallet.CreateCoinStake(wallet, nBits, nSearchTime-nLastCoinStakeSearchTime, nFees, txCoinStake, key) &&
+                  txCoinStake.nTime >= nPastLimit;
+
+    nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+    nLastCoinStakeSearchTime = nSearchTime;
+    return fFound;
+}
+
 // novacoin: attempt to generate suitable proof-of-stake
 bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
 {
@@ -2781,42 +3127,38 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
     if (IsProofOfStake())
         return true;
 
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
-
     CKey key;
     CTransaction txCoinStake;
-    int64_t nSearchTime = txCoinStake.nTime; // search to current time
+    if (!SearchCoinStake(wallet, nBits, nFees, txCoinStake, key))
+        return false;
 
+    return SignBlock(txCoinStake, key);
+}
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
-    {
-        if (wallet.CreateCoinStake(wallet, nBits, nSearchTime-nLastCoinStakeSearchTime, nFees, txCoinStake, key))
-        {
-            if (txCoinStake.nTime >= max(pindexBest->GetPastTimeLimit()+1, PastDrift(pindexBest->GetBlockTime())))
-            {
-                // make sure coinstake would meet timestamp protocol
-                //    as it would be the same as the block timestamp
-                vtx[0].nTime = nTime = txCoinStake.nTime;
-                nTime = max(pindexBest->GetPastTimeLimit()+1, GetMaxTransactionTime());
-                nTime = max(GetBlockTime(), PastDrift(pindexBest->GetBlockTime()));
-
-                // we have to make sure that we have no future timestamps in
-                //    our transactions set
-                for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
-                    if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
-
-                vtx.insert(vtx.begin() + 1, txCoinStake);
-                hashMerkleRoot = BuildMerkleTree();
-
-                // append a signature to our block
-                return key.Sign(GetHash(), vchBlockSig);
-            }
-        }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        nLastCoinStakeSearchTime = nSearchTime;
-    }
+// Turn a proof-of-stake block template into a block staked by txCoinStake
+bool CBlock::SignBlock(const CTransaction& txCoinStake, CKey& key)
+{
+    if (!vtx[0].vout[0].IsEmpty() || IsProofOfStake())
+        return false;
 
-    return false;
+    // make sure coinstake would meet timestamp protocol
+    //    as it would be the same as the block timestamp
+    vtx[0].nTime = nTime = txCoinStake.nTime;
+    vtx[0].InvalidateHash();
+    nTime = max(pindexBest->GetPastTimeLimit()+1, GetMaxTransactionTime());
+    nTime = max(GetBlockTime(), PastDrift(pindexBest->GetBlockTime()));
+
+    // we have to make sure that we have no future timestamps in
+    //    our transactions set
+    for (vector<CTransaction>::iterator it = vtx.begin(); it != vtx.end();)
+        if (it->nTime > nTime) { it = vtx.erase(it); } else { ++it; }
+
+    vtx.insert(vtx.begin() + 1, txCoinStake);
+    hashMerkleRoot = BuildMerkleTree();
+    InvalidateHash();
+
+    // append a signature to our block
+    return key.Sign(GetHash(), vchBlockSig);
 }
 
 bool CBlock::CheckBlockSignature() const
@@ -2835,12 +3177,9 @@ bool CBlock::CheckBlockSignature() const
     if (whichType == TX_PUBKEY)
     {
         valtype& vchPubKey = vSolutions[0];
-        CKey key;
-        if (!key.SetPubKey(vchPubKey))
-            return false;
         if (vchBlockSig.empty())
             return false;
-        return key.Verify(GetHash(), vchBlockSig);
+        return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
     }
 
     return false;
@@ -2864,7 +3203,7 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+filesystem::path BlockFilePath(unsigned int nFile)
 {
     string strBlockFn = strprintf("blk%04u.dat", nFile);
     return GetDataDir() / strBlockFn;
@@ -2911,6 +3250,89 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
+// Blocks recently served to peers, most recently used at the front of lruRawBlock
+static CCriticalSection cs_rawBlockCache;
+static list<uint256> lruRawBlock;
+static map<uint256, pair<vector<char>, list<uint256>::iterator> > mapRawBlock;
+static int64_t nRawBlockCacheBytes = 0;
+
+static void CacheRawBlock(const uint256& hash, const vector<char>& vchBlock)
+{
+    LOCK(cs_rawBlockCache);
+    if ((int64_t)vchBlock.size() > nRawBlockCacheSize || mapRawBlock.count(hash))
+        return;
+
+    lruRawBlock.push_front(hash);
+    pair<vector<char>, list<uint256>::iterator>& entry = mapRawBlock[hash];
+    entry.first = vchBlock;
+    entry.second = lruRawBlock.begin();
+    nRawBlockCacheBytes += vchBlock.size();
+
+    while (nRawBlockCacheBytes > nRawBlockCacheSize)
+    {
+        map<uint256, pair<vector<char>, list<uint256>::iterator> >::iterator mi = mapRawBlock.find(lruRawBlock.back());
+        nRawBlockCacheBytes -= mi->second.first.size();
+        mapRawBlock.erase(mi);
+        lruRawBlock.pop_back();
+    }
+}
+
+// Reads the block as it is serialized in its block file, which is also
+// how it goes over the wire, so it can be sent without being parsed
+bool ReadBlockBytes(const CBlockIndex* pindex, vector<char>& vchBlock)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_rawBlockCache);
+        map<uint256, pair<vector<char>, list<uint256>::iterator> >::iterator mi = mapRawBlock.find(hash);
+        if (mi != mapRawBlock.end())
+        {
+            lruRawBlock.splice(lruRawBlock.begin(), lruRawBlock, mi->second.second);
+            vchBlock = mi->second.first;
+            return true;
+        }
+    }
+
+    // Index records from older clients lack the size, so read it from the
+    // message start and size that WriteToDisk puts before every block
+    unsigned int nSize = pindex->nBlockSize;
+    unsigned int nPrefix = nSize ? 0 : sizeof(pchMessageStart) + sizeof(nSize);
+    if (pindex->nBlockPos < nPrefix)
+        return error("ReadBlockBytes() : bad block position %u", pindex->nBlockPos);
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - nPrefix, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadBlockBytes() : OpenBlockFile failed");
+
+    CBlock header;
+    try {
+        if (nPrefix)
+        {
+            unsigned char pchStart[sizeof(pchMessageStart)];
+            filein >> FLATDATA(pchStart) >> nSize;
+            if (memcmp(pchStart, pchMessageStart, sizeof(pchStart)) != 0)
+                return error("ReadBlockBytes() : no message start before block %s", hash.ToString().substr(0,20).c_str());
+        }
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadBlockBytes() : bad size %u of block %s", nSize, hash.ToString().substr(0,20).c_str());
+        vchBlock.resize(nSize);
+        filein.read(&vchBlock[0], nSize);
+
+        CDataStream ssHeader(&vchBlock[0], &vchBlock[0] + nSize, SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
+        ssHeader >> header;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Make sure the position still holds this block
+    if (header.hashMerkleRoot != pindex->hashMerkleRoot || header.nTime != pindex->nTime || header.nNonce != pindex->nNonce)
+        return error("ReadBlockBytes() : block %s not found at %u:%u", hash.ToString().substr(0,20).c_str(), pindex->nFile, pindex->nBlockPos);
+
+    CacheRawBlock(hash, vchBlock);
+    return true;
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
     LOCK(cs_main);
@@ -3036,7 +3458,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3414,7 +3836,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3557,12 +3979,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // The block goes out as the bytes in the block file,
+                    // parsing it only if those cannot be read
+                    vector<char> vchBlock;
+                    if (ReadBlockBytes((*mi).second, vchBlock))
+                        pfrom->PushRawMessage("block", vchBlock);
+                    else
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3668,7 +4098,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3935,12 +4365,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
-    //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
-
     //
     // Message format
     //  (4) message start
@@ -3949,77 +4373,55 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread frames messages and checks the header as bytes
+    // arrive, so only whole messages are taken off vRecvMsg here.
+    //
 
     while (true)
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
         CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
+        bool fChecksumValid;
+        CDataStream vMsg(SER_NETWORK, PROTOCOL_VERSION);
         {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
+            LOCK(pfrom->cs_vRecv);
+            if (pfrom->vRecvMsg.empty() || !pfrom->vRecvMsg.front().Complete())
+                break;
+
+            // Take the payload without copying it
+            CNetMessage& msg = pfrom->vRecvMsg.front();
+            hdr = msg.hdr;
+            fChecksumValid = msg.fChecksumValid;
+            vMsg.swap(msg.vRecv);
+            pfrom->nRecvSize -= msg.Size();
+            pfrom->vRecvMsg.pop_front();
         }
         string strCommand = hdr.GetCommand();
-
-        // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (!fChecksumValid)
         {
+            uint256 hash = Hash(vMsg.begin(), vMsg.end());
+            unsigned int nChecksum = 0;
+            memcpy(&nChecksum, &hash, sizeof(nChecksum));
             printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
         try
         {
+            int64_t nStart = GetTimeMicros();
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             }
+            pfrom->RecordCommand(strCommand, false, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nStart);
             if (fShutdown)
                 return true;
         }
@@ -4050,7 +4452,6 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
-    vRecv.Compact();
     return true;
 }
 
@@ -4065,7 +4466,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64_t nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -14,9 +14,12 @@
 #include "prodtypeids.h"
 #include "base58.h"
 #include "alert.h"
+#include "blockfile.h"
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -27,6 +30,25 @@ class COutPoint;
 class CAddress;
 class CInv;
 class CRequestTracker;
+
+/** Hashes the keys of mapBlockIndex. Block hashes are spread evenly already,
+ * so two of their words mixed with a salt picked at startup will do.
+ */
+class CBlockIndexHasher
+{
+private:
+    uint64_t nSalt;
+
+public:
+    CBlockIndexHasher();
+
+    size_t operator()(const uint256& hash) const
+    {
+        return (hash.Get64(0) ^ nSalt) + hash.Get64(1) * (nSalt | 1);
+    }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, CBlockIndexHasher> BlockMap;
 class CNode;
 
 static const int LAST_POW_BLOCK = 4320;
@@ -71,6 +93,9 @@ static const int64_t OP_RET_FEE_PER_CHAR = 15000;    // 0.00015
 
 static const int64_t MIN_TXOUT_AMOUNT = MIN_TX_FEE;
 
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+
 
 
 #ifdef USE_UPNP
@@ -90,8 +115,7 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; } // up to 1
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
-extern std::map<uint256, CBitcoinAddress> mapTurboAddress;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
@@ -115,7 +139,7 @@ extern std::map<uint256, CBlock*> mapOrphanBlocks;
 
 extern int64_t nTurboStartTime;
 extern int64_t nTurboEndTime;
-extern CBlockIndex *pindexLastTurbo;
+extern bool fTurboStakeSignersLoaded;
 
 // Settings
 extern int64_t nTransactionFee;
@@ -123,6 +147,9 @@ extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
+extern int nScriptCheckThreads;
+extern bool fAddressIndex;
+extern int64_t nRawBlockCacheSize;
 
 extern bool fEnforceCanonical;
 
@@ -133,20 +160,31 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fIsBootstrap=false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
+boost::filesystem::path BlockFilePath(unsigned int nFile);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+bool ReadBlockBytes(const CBlockIndex* pindex, std::vector<char>& vchBlock);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck(void* parg);
+/** Stop the script checking threads */
+void ThreadScriptCheckQuit();
+/** Search the wallet for a coinstake on the best block */
+bool SearchCoinStake(CWallet& wallet, unsigned int nBits, int64_t nFees, CTransaction& txCoinStake, CKey& key);
+/** Wake the staking thread, e.g. on a new best block */
+void WakeStakeMiner();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -155,7 +193,10 @@ int64_t GetPoWSubsidy2(int64_t nHeight);
 int64_t GetProofOfWorkReward(int nHeight, int64_t nFees);
 int GetTurboStakeMultiplier(CBitcoinAddress address, int64_t txTime, CBlockIndex* pindex);
 int64_t GetProofOfStakeReward(int64_t nCoinAge, CBitcoinAddress address, int64_t nTime, CBlockIndex* pindex);
-int FillMapTurboAddress();
+int FillTurboStakeSigners();
+bool GetTurboStakeSigner(CBlockIndex* pindex, CBitcoinAddress& address);
+bool GetAddressIndexHash(const CTxDestination& dest, unsigned char& nType, uint160& hashBytes);
+bool BuildAddressIndex();
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
@@ -496,6 +537,12 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only, the hash of a transaction that was read
+    uint256 hashCached;
+    bool fHashCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -513,6 +560,8 @@ public:
               READWRITE(strTxComment);
               READWRITE(nProdTypeID);
         }
+        if (fRead)
+            const_cast<CTransaction*>(this)->CacheHash();
     )
 
     void SetNull()
@@ -529,6 +578,7 @@ public:
         nDoS = 0;  // Denial-of-service prevention
         strTxComment.clear();
         nProdTypeID = SNRG_NONE;
+        fHashCached = false;
     }
 
 
@@ -537,11 +587,26 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    /** Transactions read from a stream keep their hash, anything that
+        changes one of those in place must call InvalidateHash() */
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    void CacheHash()
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
+    void InvalidateHash()
+    {
+        fHashCached = false;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64_t nBlockTime=0) const
     {
         AssertLockHeld(cs_main);
@@ -655,6 +720,17 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            try {
+                if (ReadFromMappedBlockFile(pos.nFile, pos.nTxPos, *this, SER_DISK, CLIENT_VERSION))
+                    return true;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -766,11 +842,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -784,6 +862,33 @@ protected:
 };
 
 
+/** Closure representing one script verification
+ *  Note that this stores a reference to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -906,6 +1011,106 @@ public:
 };
 
 
+/** An -addressindex record: one output paid to or one input spent from an
+ * address by a transaction of the main chain. nType is 1 for a key hash
+ * and 2 for a script hash.
+ */
+class CAddressIndexKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    int nHeight;
+    uint256 txid;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddressIndexKey(unsigned char nTypeIn, const uint160& hashBytesIn, int nHeightIn, const uint256& txidIn, unsigned int nIndexIn, bool fSpendingIn)
+    {
+        nType = nTypeIn;
+        hashBytes = hashBytesIn;
+        nHeight = nHeightIn;
+        txid = txidIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(nHeight);
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+    )
+
+    void SetNull()
+    {
+        nType = 0;
+        hashBytes = 0;
+        nHeight = 0;
+        txid = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+};
+
+/** Value of an -addressindex record: the change to the address balance
+ * (negative for a spend) and where the transaction sits in its block */
+class CAddressIndexValue
+{
+public:
+    int64_t nValue;
+    int nTx;
+    bool fCoinStake;
+
+    CAddressIndexValue()
+    {
+        nValue = 0;
+        nTx = 0;
+        fCoinStake = false;
+    }
+
+    CAddressIndexValue(int64_t nValueIn, int nTxIn, bool fCoinStakeIn)
+    {
+        nValue = nValueIn;
+        nTx = nTxIn;
+        fCoinStake = fCoinStakeIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nTx);
+        READWRITE(fCoinStake);
+    )
+};
+
+typedef std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > AddressIndexVector;
+
+/** Orders records as the block connected them: by transaction, outputs before inputs */
+struct CAddressIndexBlockOrder
+{
+    bool operator()(const std::pair<CAddressIndexKey, CAddressIndexValue>& a,
+                    const std::pair<CAddressIndexKey, CAddressIndexValue>& b) const
+    {
+        if (a.first.nHeight != b.first.nHeight)
+            return a.first.nHeight < b.first.nHeight;
+        if (a.second.nTx != b.second.nTx)
+            return a.second.nTx < b.second.nTx;
+        if (a.first.fSpending != b.first.fSpending)
+            return !a.first.fSpending;
+        return a.first.nIndex < b.first.nIndex;
+    }
+};
+
+
 /** Nodes collect new transactions into a block, hash them into a hash tree,
  * and scan through nonce values to make the block's hash satisfy proof-of-work
  * requirements.  When they solve the proof-of-work, they broadcast the block
@@ -941,6 +1146,12 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // memory only, the hash of a whole block that was read
+    uint256 hashCached;
+    bool fHashCached;
+
+public:
     CBlock()
     {
         SetNull();
@@ -961,11 +1172,14 @@ public:
         {
             READWRITE(vtx);
             READWRITE(vchBlockSig);
+            if (fRead)
+                const_cast<CBlock*>(this)->CacheHash();
         }
         else if (fRead)
         {
             const_cast<CBlock*>(this)->vtx.clear();
             const_cast<CBlock*>(this)->vchBlockSig.clear();
+            const_cast<CBlock*>(this)->fHashCached = false;
         }
     )
 
@@ -981,6 +1195,7 @@ public:
         vchBlockSig.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -988,8 +1203,13 @@ public:
         return (nBits == 0);
     }
 
+    /** Blocks read whole from a stream keep their hash, anything that
+        changes the header of one of those must call InvalidateHash().
+        Headers read alone are not worth an X11 hash they may not need. */
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         if (this->nTime > LAST_X11_TIME)
         {
              // synergy PoS period: SHA256d
@@ -1002,6 +1222,18 @@ public:
         }
     }
 
+    void CacheHash()
+    {
+        fHashCached = false;
+        hashCached = GetHash();
+        fHashCached = true;
+    }
+
+    void InvalidateHash()
+    {
+        fHashCached = false;
+    }
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -1035,6 +1267,17 @@ public:
         return IsProofOfStake()? std::make_pair(vtx[1].vin[0].prevout, vtx[1].nTime) : std::make_pair(COutPoint(), (unsigned int)0);
     }
 
+    // signing key of the coinstake, paid to by vtx[1].vout[1]
+    bool GetStakeSigner(CKeyID& keyID) const
+    {
+        if (!IsProofOfStake() || vtx[1].vout.size() < 2)
+            return false;
+        CTxDestination dest;
+        if (!ExtractDestination(vtx[1].vout[1].scriptPubKey, dest))
+            return false;
+        return CBitcoinAddress(dest).GetKeyID(keyID);
+    }
+
     // ppcoin: get max transaction timestamp
     int64_t GetMaxTransactionTime() const
     {
@@ -1125,16 +1368,17 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
+        // Read block, from the mapped file when it can be mapped
         try {
-            filein >> *this;
+            int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+            if (!ReadFromMappedBlockFile(nFile, nBlockPos, *this, nType, CLIENT_VERSION))
+            {
+                // Open history file to read
+                CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+                if (!filein)
+                    return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+                filein >> *this;
+            }
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1181,6 +1425,7 @@ public:
     bool AcceptBlock();
     bool GetCoinAge(uint64_t& nCoinAge) const; // ppcoin: calculate total coin age spent in block
     bool SignBlock(CWallet& keystore, int64_t nFees);
+    bool SignBlock(const CTransaction& txCoinStake, CKey& key);
     bool CheckBlockSignature() const;
 
 private:
@@ -1202,17 +1447,12 @@ private:
 class CBlockIndex
 {
 public:
+    // what walks along the chain and the stake modifier read comes first,
+    // to share as few cache lines as possible
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    uint256 nChainTrust; // ppcoin: trust score of block chain
     int nHeight;
-
-    int64_t nMint;
-    int64_t nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
@@ -1220,21 +1460,29 @@ public:
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
-
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
+    unsigned int nTime;
+    unsigned int nBits;
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+
+    int64_t nMint;
+    int64_t nMoneySupply;
+
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    unsigned int nBlockSize; // serialized size in the block file, 0 if not recorded
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
 
     // proof-of-stake specific fields
     COutPoint prevoutStake;
     unsigned int nStakeTime;
+    CKeyID keyStakeSigner; // coinstake signer, saves reading the block for turbo
 
     uint256 hashProof;
 
-    // block header
+    // rest of the block header
     int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
 
     CBlockIndex()
@@ -1244,6 +1492,7 @@ public:
         pnext = NULL;
         nFile = 0;
         nBlockPos = 0;
+        nBlockSize = 0;
         nHeight = 0;
         nChainTrust = 0;
         nMint = 0;
@@ -1254,6 +1503,7 @@ public:
         hashProof = 0;
         prevoutStake.SetNull();
         nStakeTime = 0;
+        keyStakeSigner = CKeyID();
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1269,6 +1519,7 @@ public:
         pnext = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
+        nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         nHeight = 0;
         nChainTrust = 0;
         nMint = 0;
@@ -1282,11 +1533,14 @@ public:
             SetProofOfStake();
             prevoutStake = block.vtx[1].vin[0].prevout;
             nStakeTime = block.vtx[1].nTime;
+            if (!block.GetStakeSigner(keyStakeSigner))
+                keyStakeSigner = CKeyID();
         }
         else
         {
             prevoutStake.SetNull();
             nStakeTime = 0;
+            keyStakeSigner = CKeyID();
         }
 
         nVersion       = block.nVersion;
@@ -1489,6 +1743,16 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
         READWRITE(blockHash);
+
+        // appended so that older clients can still read the record
+        if (IsProofOfStake() && nVersion >= STAKE_SIGNER_VERSION)
+            READWRITE(keyStakeSigner);
+        else if (fRead)
+            const_cast<CDiskBlockIndex*>(this)->keyStakeSigner = CKeyID();
+        if (nVersion >= BLOCK_SIZE_VERSION)
+            READWRITE(nBlockSize);
+        else if (fRead)
+            const_cast<CDiskBlockIndex*>(this)->nBlockSize = 0;
     )
 
     uint256 GetBlockHash() const
@@ -1533,6 +1797,65 @@ public:
 
 
 
+/** Where the block index entries live.
+ *
+ * They are never freed, so they are handed out of large chunks one after
+ * the other, without the overhead of a heap allocation each, and blocks
+ * loaded or connected together end up next to each other in memory.
+ */
+class CBlockIndexArena
+{
+private:
+    CCriticalSection cs;
+    std::vector<char*> vChunk;
+    unsigned int nUsed;
+
+    void* Alloc();
+
+public:
+    static const unsigned int CHUNK_ENTRIES = 4096;
+
+    CBlockIndexArena();
+
+    CBlockIndex* New();
+    CBlockIndex* New(unsigned int nFile, unsigned int nBlockPos, CBlock& block);
+};
+
+extern CBlockIndexArena blockIndexArena;
+
+
+
+/** The blocks of the best chain by height.
+ *
+ * SetBestChain moves the tip, which rewrites only the heights above the fork
+ * with the previous best chain, so looking up a block by height no longer
+ * walks pprev or pnext. Block times are not in order, so the latest time up
+ * to each height is kept as well, which is what a lookup by time searches.
+ */
+class CActiveChain
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CBlockIndex*> vChain;
+    std::vector<unsigned int> vMaxTime;
+
+public:
+    void SetTip(CBlockIndex* pindex);
+
+    /** The block at nHeight, or NULL above the tip */
+    CBlockIndex* operator[](int nHeight) const;
+    bool Contains(const CBlockIndex* pindex) const;
+    int Height() const;
+
+    /** The lowest height with a block at or after nTime, where every block
+     * below it is earlier, or Height() + 1 if no block is that late */
+    int FindHeightByTime(unsigned int nTime) const;
+};
+
+extern CActiveChain chainActive;
+
+
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -1554,7 +1877,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1605,7 +1928,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1624,7 +1947,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1640,7 +1963,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -8,6 +8,8 @@
 #include "miner.h"
 #include "kernel.h"
 
+#include <boost/thread/condition_variable.hpp>
+
 // from main.cpp
 extern unsigned int nTargetSpacing;
 extern unsigned int nTargetSpacing2;
@@ -88,6 +90,19 @@ public:
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
+
+// Staking timings in microseconds: the last coinstake search, the last block
+// assembled around a found coinstake, and the time from a new best block to
+// signing the block staked on it
+int64_t nStakeSearchMicros = 0;
+int64_t nStakeTemplateMicros = 0;
+int64_t nStakeSignMicros = 0;
+
+// StakeMiner waits here between searches until the next timestamp or a new best block
+static boost::mutex csStakeWake;
+static boost::condition_variable condStakeWake;
+static bool fStakeWake = false;
+static int64_t nStakeTipMicros = 0;
  
 // We want to sort transactions by priority and fee, so:
 typedef boost::tuple<double, double, CTransaction*> TxPriority;
@@ -532,6 +547,25 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
     return true;
 }
 
+void WakeStakeMiner()
+{
+    boost::unique_lock<boost::mutex> lock(csStakeWake);
+    nStakeTipMicros = GetTimeMicros();
+    fStakeWake = true;
+    condStakeWake.notify_all();
+}
+
+// Wait up to nMillis for WakeStakeMiner, returns true if it was called
+static bool WaitStakeMiner(int64_t nMillis)
+{
+    boost::unique_lock<boost::mutex> lock(csStakeWake);
+    if (!fStakeWake && nMillis > 0)
+        condStakeWake.timed_wait(lock, boost::posix_time::milliseconds(nMillis));
+    bool fWoken = fStakeWake;
+    fStakeWake = false;
+    return fWoken;
+}
+
 void StakeMiner(CWallet *pwallet)
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -540,6 +574,13 @@ void StakeMiner(CWallet *pwallet)
     RenameThread("synergy-miner");
 
     bool fTryToSync = true;
+    int64_t nHoldOffUntil = 0;
+
+    {
+        boost::unique_lock<boost::mutex> lock(csStakeWake);
+        if (nStakeTipMicros == 0)
+            nStakeTipMicros = GetTimeMicros();
+    }
 
     while (true)
     {
@@ -573,36 +614,64 @@ void StakeMiner(CWallet *pwallet)
             }
         }
 
+        // Give the network a target spacing after our own block
+        if (GetTimeMillis() < nHoldOffUntil)
+        {
+            WaitStakeMiner(min((int64_t)1000, nHoldOffUntil - GetTimeMillis()));
+            continue;
+        }
+
         //
-        // Create new block
+        // Search for a coinstake first, the block is only assembled on a hit
         //
-        int64_t nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, true, &nFees));
-        if (!pblock.get())
-            return;
-
-        // Trying to sign a block
-        if (pblock->SignBlock(*pwallet, nFees))
+        int64_t nTipMicros;
+        {
+            boost::unique_lock<boost::mutex> lock(csStakeWake);
+            nTipMicros = nStakeTipMicros;
+        }
+        CBlockIndex* pindexPrev = pindexBest;
+        unsigned int nBits = GetNextTargetRequired(pindexPrev, true);
+        CKey key;
+        CTransaction txCoinStake;
+        int64_t nStart = GetTimeMicros();
+        bool fFound = SearchCoinStake(*pwallet, nBits, 0, txCoinStake, key);
+        nStakeSearchMicros = GetTimeMicros() - nStart;
+
+        if (fFound)
         {
-            SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            CheckStake(pblock.get(), *pwallet);
-            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+            nStart = GetTimeMicros();
+            int64_t nFees;
+            auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, true, &nFees));
+            if (!pblock.get())
+                return;
+            nStakeTemplateMicros = GetTimeMicros() - nStart;
 
-            unsigned int nTargetSpacing_used;
-            if (pblock->nTime < nSpacing2Time)
+            // the coinstake only stands if the template is on the block it was found for
+            if (pblock->hashPrevBlock == pindexPrev->GetBlockHash() && pblock->nBits == nBits &&
+                pblock->SignBlock(txCoinStake, key))
             {
-                  nTargetSpacing_used = nTargetSpacing;
-            }
-            else
-            {
-                  nTargetSpacing_used = nTargetSpacing2;
-            }
+                nStakeSignMicros = GetTimeMicros() - nTipMicros;
 
-            MilliSleep(nTargetSpacing_used * 1000);
-        }
-        else
-        {
-            MilliSleep(nMinerSleep);
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckStake(pblock.get(), *pwallet);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+                unsigned int nTargetSpacing_used;
+                if (pblock->nTime < nSpacing2Time)
+                {
+                      nTargetSpacing_used = nTargetSpacing;
+                }
+                else
+                {
+                      nTargetSpacing_used = nTargetSpacing2;
+                }
+
+                nHoldOffUntil = GetTimeMillis() + nTargetSpacing_used * 1000;
+                continue;
+            }
         }
+
+        // Sleep until the next timestamp can be searched, or a new best block arrives
+        WaitStakeMiner(max((int64_t)nMinerSleep, 1000 - GetTimeMillis() % 1000));
     }
 }
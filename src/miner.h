@@ -24,6 +24,11 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check mined proof-of-stake block */
 bool CheckStake(CBlock* pblock, CWallet& wallet);
 
+/** Staking timings of the last search, block assembly and tip-to-sign, in microseconds */
+extern int64_t nStakeSearchMicros;
+extern int64_t nStakeTemplateMicros;
+extern int64_t nStakeSignMicros;
+
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
@@ -11,9 +11,17 @@
 #include "addrman.h"
 #include "ui_interface.h"
 #include "onionseed.h"
+#include "kernel.h"
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -33,6 +41,7 @@ extern "C" {
 }
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+static const int SEND_IOV_MAX = 64; // messages per gathered send
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -83,6 +92,33 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 static CSemaphore *semOutbound = NULL;
 
+// Peers with work for the message handler threads, each queued at most
+// once and holding a reference while queued or being handled
+static boost::mutex csMessageHandler;
+static boost::condition_variable condMessageHandler;
+static deque<CNode*> vNodesToHandle;
+static int64_t nLastHandlerSweep = 0;
+static const int MESSAGE_HANDLER_SWEEP_MS = 100;
+int nMessageHandlerThreads = 1;
+
+void WakeMessageHandler(CNode* pnode, bool fTrickle)
+{
+    LOCK(cs_vNodes);
+    boost::unique_lock<boost::mutex> lock(csMessageHandler);
+    if (fTrickle)
+        pnode->fHandlerTrickle = true;
+    if (pnode->fHandlerBusy)
+    {
+        pnode->fHandlerAgain = true;
+        return;
+    }
+    if (pnode->fHandlerQueued)
+        return;
+    pnode->fHandlerQueued = true;
+    vNodesToHandle.push_back(pnode->AddRef());
+    condMessageHandler.notify_one();
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -543,7 +579,14 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
+
+        // in case this fails, the messages are freed with the node
+        TRY_LOCK(cs_vRecv, lockRecv);
+        if (lockRecv)
+        {
+            vRecvMsg.clear();
+            nRecvSize = 0;
+        }
     }
 }
 
@@ -631,9 +674,153 @@ void CNode::copyStats(CNodeStats &stats)
     X(fInbound);
     X(nStartingHeight);
     X(nMisbehavior);
+    {
+        LOCK(cs_mapCommandStats);
+        X(mapCommandStats);
+    }
 }
 #undef X
 
+void CNode::RecordCommand(const std::string& strCommand, bool fSend, unsigned int nBytes, int64_t nMicros)
+{
+    LOCK(cs_mapCommandStats);
+    CCommandStats& cmd = mapCommandStats[strCommand];
+    if (fSend)
+    {
+        cmd.nSendMessages++;
+        cmd.nSendBytes += nBytes;
+    }
+    else
+    {
+        cmd.nRecvMessages++;
+        cmd.nRecvBytes += nBytes;
+        cmd.nRecvMicros += nMicros;
+    }
+}
+
+int CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    int nComplete = 0;
+    while (nBytes > 0)
+    {
+        // start a new message if the last one is done
+        if (vRecvMsg.empty() || vRecvMsg.back().Complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        unsigned int nSizeBefore = msg.Size();
+        unsigned int nSkippedBefore = msg.nSkipped;
+        unsigned int nRead = msg.Read(pch, nBytes);
+        pch += nRead;
+        nBytes -= nRead;
+
+        if (msg.nSkipped > nSkippedBefore)
+            printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND, %u bytes skipped\n\n", msg.nSkipped - nSkippedBefore);
+
+        if (msg.fBadHeader)
+        {
+            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", msg.hdr.GetCommand().c_str());
+            nRecvSize -= nSizeBefore;
+            vRecvMsg.pop_back();
+            continue;
+        }
+
+        // a resync on the message start drops header bytes buffered by an
+        // earlier chunk, so the message can be smaller than before
+        nRecvSize = nRecvSize - nSizeBefore + msg.Size();
+        if (msg.Complete())
+            nComplete++;
+    }
+    return nComplete;
+}
+
+void CNode::SetRecvVersion(int nVersionIn)
+{
+    LOCK(cs_vRecv);
+    nRecvVersion = nVersionIn;
+    BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+        msg.vRecv.SetVersion(nVersionIn);
+}
+
+unsigned int CNetMessage::Read(const char* pch, unsigned int nBytes)
+{
+    if (!fInData)
+        return ReadHeader(pch, nBytes);
+    return ReadData(pch, nBytes);
+}
+
+unsigned int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    unsigned int nRead = 0;
+    while (nRead < nBytes && nHdrPos < CMessageHeader::HEADER_SIZE)
+    {
+        char c = pch[nRead++];
+        // resync on the message start, a byte at a time
+        if (nHdrPos < CMessageHeader::MESSAGE_START_SIZE && c != (char)pchMessageStart[nHdrPos])
+        {
+            nSkipped += nHdrPos;
+            nHdrPos = 0;
+            if (c != (char)pchMessageStart[0])
+            {
+                nSkipped++;
+                continue;
+            }
+        }
+        pchHeader[nHdrPos++] = c;
+    }
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nRead;
+
+    try
+    {
+        CDataStream hdrbuf(pchHeader, pchHeader + CMessageHeader::HEADER_SIZE, SER_NETWORK, vRecv.nVersion);
+        hdrbuf >> hdr;
+    }
+    catch (std::exception&)
+    {
+        fBadHeader = true;
+        return nRead;
+    }
+    if (!hdr.IsValid())
+    {
+        fBadHeader = true;
+        return nRead;
+    }
+
+    fInData = true;
+    SHA256_Init(&ctxHash);
+    if (hdr.nMessageSize == 0)
+        ReadData(NULL, 0);
+    return nRead;
+}
+
+unsigned int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+    if (nCopy > 0)
+    {
+        vRecv.resize(nDataPos + nCopy);
+        memcpy(&vRecv[nDataPos], pch, nCopy);
+        SHA256_Update(&ctxHash, pch, nCopy);
+        nDataPos += nCopy;
+    }
+
+    if (nDataPos == hdr.nMessageSize)
+    {
+        // same double SHA-256 as Hash(), taken incrementally
+        unsigned char hash1[SHA256_DIGEST_LENGTH];
+        unsigned char hash2[SHA256_DIGEST_LENGTH];
+        SHA256_Final(hash1, &ctxHash);
+        SHA256(hash1, sizeof(hash1), hash2);
+        unsigned int nChecksum = 0;
+        memcpy(&nChecksum, hash2, sizeof(nChecksum));
+        fChecksumValid = (nChecksum == hdr.nChecksum);
+    }
+    return nCopy;
+}
+
+
 
 
 
@@ -642,6 +829,9 @@ void CNode::copyStats(CNodeStats &stats)
 
 
 
+#ifdef USE_EPOLL
+static void ShutdownSocketEngine();
+#endif
 
 void ThreadSocketHandler(void* parg)
 {
@@ -661,15 +851,305 @@ void ThreadSocketHandler(void* parg)
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
         throw; // support pthread_cancel()
     }
+#ifdef USE_EPOLL
+    ShutdownSocketEngine();
+#endif
     printf("ThreadSocketHandler exited\n");
 }
 
+// Sends as much of the send queue as the socket takes. The queued messages go
+// out in one gathered send, and a partial send only advances nSendOffset
+// instead of moving the rest of the backlog. Requires cs_vSend.
+void SocketSendData(CNode* pnode)
+{
+    while (!pnode->vSendMsg.empty() && pnode->hSocket != INVALID_SOCKET)
+    {
+#ifdef WIN32
+        CSerializeData& data = pnode->vSendMsg.front();
+        size_t nRequested = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[SEND_IOV_MAX];
+        int nIov = 0;
+        size_t nRequested = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (deque<CSerializeData>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; ++it)
+        {
+            iov[nIov].iov_base = &(*it)[nOffset];
+            iov[nIov].iov_len = it->size() - nOffset;
+            nRequested += iov[nIov].iov_len;
+            nOffset = 0;
+            nIov++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                printf("socket send error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
+            return;
+        }
+        if (nBytes == 0)
+            return;
+
+        pnode->nLastSend = GetTime();
+        pnode->nSendSize -= nBytes;
+
+        // drop the messages that went out completely
+        size_t nSent = nBytes;
+        while (nSent > 0)
+        {
+            size_t nLeft = pnode->vSendMsg.front().size() - pnode->nSendOffset;
+            if (nSent < nLeft)
+            {
+                pnode->nSendOffset += nSent;
+                break;
+            }
+            nSent -= nLeft;
+            pnode->nSendOffset = 0;
+            pnode->vSendMsg.pop_front();
+        }
+
+        // the socket buffer is full
+        if ((size_t)nBytes < nRequested)
+            return;
+    }
+}
+
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+static int hReserveFd = -1; // given up to accept and drop a connection when out of descriptors
+static int64_t nListenRetry = 0; // when to accept again after a failure that left a backlog
+
+// Listen sockets are edge triggered, so every pass accepts until the
+// backlog is empty; peer sockets are level triggered for receive and
+// watched for send only while they have a queue.
+static bool InitSocketEngine()
+{
+    hReserveFd = open("/dev/null", O_RDONLY);
+    hEpoll = epoll_create(1024);
+    if (hEpoll < 0)
+        return error("InitSocketEngine() : epoll_create failed %d", errno);
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) < 0)
+            return error("InitSocketEngine() : epoll_ctl failed for listen socket %d", errno);
+    }
+    return true;
+}
+
+static void ShutdownSocketEngine()
+{
+    if (hEpoll >= 0)
+        close(hEpoll);
+    hEpoll = -1;
+    if (hReserveFd >= 0)
+        close(hReserveFd);
+    hReserveFd = -1;
+}
+
+// Handles an accept that failed other than for an empty backlog. Returns
+// true if the listen socket can be drained further now. When out of
+// descriptors the reserve one is freed to take the pending connection and
+// close it, so the backlog moves on; otherwise the listen sockets are
+// retried after a second, since no new edge may come for what is queued.
+static bool AcceptFailed(SOCKET hListenSocket, int nErr)
+{
+    if (nErr == WSAEINTR || nErr == ECONNABORTED)
+        return true;
+
+    printf("socket error accept failed: %d\n", nErr);
+    if ((nErr == EMFILE || nErr == ENFILE) && hReserveFd >= 0)
+    {
+        close(hReserveFd);
+        SOCKET hSocket = accept(hListenSocket, NULL, NULL);
+        if (hSocket != INVALID_SOCKET)
+            closesocket(hSocket);
+        hReserveFd = open("/dev/null", O_RDONLY);
+        if (hSocket != INVALID_SOCKET)
+            return true;
+    }
+    nListenRetry = GetTimeMillis() + 1000;
+    return false;
+}
+
+static void WatchNodeSocket(CNode* pnode, bool fWantSend)
+{
+    if (pnode->fSocketWatched && pnode->fSocketWatchSend == fWantSend)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (fWantSend)
+        event.events |= EPOLLOUT;
+    event.data.fd = pnode->hSocket;
+    int nOp = pnode->fSocketWatched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(hEpoll, nOp, pnode->hSocket, &event) < 0 &&
+        (nOp != EPOLL_CTL_ADD || errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event) < 0))
+    {
+        printf("socket epoll_ctl error %d\n", errno);
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    pnode->fSocketWatched = true;
+    pnode->fSocketWatchSend = fWantSend;
+}
+#endif
+
+// Waits up to nTimeout milliseconds for socket readiness; sets hold the
+// listen sockets with connections to accept and the peer sockets to service
+static void WaitSocketEvents(int nTimeout, set<SOCKET>& setListen, set<SOCKET>& setRecv, set<SOCKET>& setSend)
+{
+    setListen.clear();
+    setRecv.clear();
+    setSend.clear();
+
+#ifdef USE_EPOLL
+    unsigned int nEvents = vhListenSocket.size();
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                WatchNodeSocket(pnode, !pnode->vSendMsg.empty());
+            else if (!pnode->fSocketWatched)
+                WatchNodeSocket(pnode, true);
+        }
+        nEvents += vNodes.size();
+    }
+
+    vector<struct epoll_event> vEvent(max(nEvents, 1u));
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nReady = epoll_wait(hEpoll, &vEvent[0], vEvent.size(), nTimeout);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (nReady < 0)
+    {
+        if (errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+    if (nListenRetry && GetTimeMillis() >= nListenRetry)
+    {
+        nListenRetry = 0;
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            setListen.insert(hListenSocket);
+    }
+    for (int i = 0; i < nReady; i++)
+    {
+        SOCKET hSocket = vEvent[i].data.fd;
+        if (find(vhListenSocket.begin(), vhListenSocket.end(), hSocket) != vhListenSocket.end())
+        {
+            setListen.insert(hSocket);
+            continue;
+        }
+        if (vEvent[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            setRecv.insert(hSocket);
+        if (vEvent[i].events & EPOLLOUT)
+            setSend.insert(hSocket);
+    }
+#else
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = nTimeout * 1000; // frequency to poll pnode->vSendMsg
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    vector<SOCKET> vSocket;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetRecv);
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            vSocket.push_back(pnode->hSocket);
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty())
+                    FD_SET(pnode->hSocket, &fdsetSend);
+            }
+        }
+    }
+
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            // try every socket, the reads just fail with would-block
+            setListen.insert(vhListenSocket.begin(), vhListenSocket.end());
+            setRecv.insert(vSocket.begin(), vSocket.end());
+        }
+        MilliSleep(nTimeout);
+        return;
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (FD_ISSET(hListenSocket, &fdsetRecv))
+            setListen.insert(hListenSocket);
+    BOOST_FOREACH(SOCKET hSocket, vSocket)
+    {
+        if (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+    }
+#endif
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
 
+#ifdef USE_EPOLL
+    if (!InitSocketEngine())
+    {
+        printf("ThreadSocketHandler : unable to start the socket engine\n");
+        return;
+    }
+#endif
+
     while (true)
     {
         //
@@ -682,7 +1162,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -742,95 +1222,54 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                }
-            }
-        }
-
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        set<SOCKET> setListen, setRecv, setSend;
+        WaitSocketEvents(50, setListen, setRecv, setSend);
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
 
 
         //
-        // Accept new connections
+        // Accept new connections, all that are waiting since the engine
+        // reports a listen socket only when new ones arrive
         //
+        int nInbound = -1;
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        while (hListenSocket != INVALID_SOCKET && setListen.count(hListenSocket))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
             SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
             CAddress addr;
-            int nInbound = 0;
 
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
+            if (hSocket == INVALID_SOCKET)
+            {
+                int nErr = WSAGetLastError();
+                if (nErr == WSAEWOULDBLOCK)
+                    break;
+#ifdef USE_EPOLL
+                if (AcceptFailed(hListenSocket, nErr))
+                    continue;
+#else
+                printf("socket error accept failed: %d\n", nErr);
+#endif
+                break;
+            }
+
+            if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+                printf("Warning: Unknown socket family\n");
 
+            if (nInbound < 0)
             {
+                nInbound = 0;
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                     if (pnode->fInbound)
                         nInbound++;
             }
 
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+            if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
             {
                 closesocket(hSocket);
             }
@@ -848,6 +1287,7 @@ void ThreadSocketHandler2(void* parg)
                     LOCK(cs_vNodes);
                     vNodes.push_back(pnode);
                 }
+                nInbound++;
             }
         }
 
@@ -862,6 +1302,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        vector<CNode*> vNodesWake;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
@@ -872,17 +1313,14 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (setRecv.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
                 if (lockRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
+                    if (pnode->nRecvSize > ReceiveBufferSize()) {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", pnode->nRecvSize);
                         pnode->CloseSocketDisconnect();
                     }
                     else {
@@ -891,9 +1329,10 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
+                            // wake the handler only once a whole message is in
+                            if (pnode->ReceiveMsgBytes(pchBuf, nBytes) > 0)
+                                vNodesWake.push_back(pnode);
                         }
                         else if (nBytes == 0)
                         {
@@ -922,38 +1361,23 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (setSend.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    // ProcessMessages holds back while the send buffer is full
+                    bool fWasFull = pnode->nSendSize >= SendBufferSize();
+                    SocketSendData(pnode);
+                    if (fWasFull && pnode->nSendSize < SendBufferSize())
+                        vNodesWake.push_back(pnode);
                 }
             }
 
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->vSendMsg.empty())
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -976,6 +1400,8 @@ void ThreadSocketHandler2(void* parg)
         }
         {
             LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesWake)
+                WakeMessageHandler(pnode);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
@@ -1558,55 +1984,82 @@ void ThreadMessageHandler2(void* parg)
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
-        vector<CNode*> vNodesCopy;
+        CNode* pnode = NULL;
+        bool fTrickle = false;
+        bool fSweep = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            // Receive messages
+            boost::unique_lock<boost::mutex> lock(csMessageHandler);
+            if (vNodesToHandle.empty())
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
+                // Reduce vnThreadsRunning so StopNode has permission to exit while
+                // we're waiting, but we must always check fShutdown after doing this.
+                vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(MESSAGE_HANDLER_SWEEP_MS));
+                vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
             }
-            if (fShutdown)
-                return;
-
-            // Send messages
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nLastHandlerSweep >= MESSAGE_HANDLER_SWEEP_MS)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                nLastHandlerSweep = nNow;
+                fSweep = true;
+            }
+            if (!vNodesToHandle.empty())
+            {
+                pnode = vNodesToHandle.front();
+                vNodesToHandle.pop_front();
+                pnode->fHandlerQueued = false;
+                pnode->fHandlerBusy = true;
+                fTrickle = pnode->fHandlerTrickle;
+                pnode->fHandlerTrickle = false;
             }
-            if (fShutdown)
-                return;
         }
+        if (fRequestShutdown)
+            StartShutdown();
 
+        // Wake every peer now and then for the timed parts of SendMessages:
+        // trickling, address relay, pings and getdata retries
+        if (fSweep)
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            CNode* pnodeTrickle = NULL;
+            if (!vNodes.empty())
+                pnodeTrickle = vNodes[GetRand(vNodes.size())];
+            BOOST_FOREACH(CNode* pnodeSweep, vNodes)
+                WakeMessageHandler(pnodeSweep, pnodeSweep == pnodeTrickle);
         }
 
-        // Wait and allow messages to bunch up.
-        // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
-        if (fRequestShutdown)
-            StartShutdown();
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
-        if (fShutdown)
-            return;
+        if (pnode == NULL)
+            continue;
+
+        // Only this thread works on pnode until it is released below,
+        // so the messages of a peer are handled in order
+        if (!fShutdown)
+            ProcessMessages(pnode);
+        if (!fShutdown)
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SendMessages(pnode, fTrickle);
+        }
+
+        {
+            LOCK(cs_vNodes);
+            boost::unique_lock<boost::mutex> lock(csMessageHandler);
+            pnode->fHandlerBusy = false;
+            if (pnode->fHandlerAgain && !fShutdown)
+            {
+                // keep the reference for the queue
+                pnode->fHandlerAgain = false;
+                pnode->fHandlerQueued = true;
+                vNodesToHandle.push_back(pnode);
+                condMessageHandler.notify_one();
+            }
+            else
+            {
+                pnode->fHandlerAgain = false;
+                pnode->Release();
+            }
+        }
     }
 }
 
@@ -1810,8 +2263,9 @@ void StartNode(void* parg)
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        if (!NewThread(ThreadMessageHandler, NULL))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
@@ -1826,6 +2280,12 @@ void StartNode(void* parg)
         if (!NewThread(ThreadStakeMiner, pwalletMain)) {
             printf("Error: NewThread(ThreadStakeMiner) failed\n");
         }
+
+        if (nStakeKernelThreads) {
+            printf("Using %u threads for stake kernel search\n", nStakeKernelThreads);
+            for (int i=0; i<nStakeKernelThreads-1; i++)
+                NewThread(ThreadStakeKernel, NULL);
+        }
     }
 }
 
@@ -1838,6 +2298,8 @@ bool StopNode()
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    ThreadScriptCheckQuit();
+    ThreadStakeKernelQuit();
     do
     {
         int nThreadsRunning = 0;
@@ -1861,6 +2323,8 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0) printf("ThreadStakeMiner still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
+    if (vnThreadsRunning[THREAD_STAKE_KERNEL] > 0) printf("ThreadStakeKernel still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         MilliSleep(20);
     MilliSleep(50);
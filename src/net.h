@@ -9,6 +9,7 @@
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
@@ -37,6 +38,8 @@ void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
+void SocketSendData(CNode* pnode);
+void WakeMessageHandler(CNode* pnode, bool fTrickle = false);
 void MapPort();
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
@@ -95,6 +98,8 @@ public:
 };
 
 
+static const int MAX_MESSAGE_HANDLER_THREADS = 8;
+
 /** Thread types */
 enum threadId
 {
@@ -108,6 +113,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_SCRIPTCHECK,
+    THREAD_STAKE_KERNEL,
 
     THREAD_MAX
 };
@@ -119,6 +126,7 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddress addrSeenByPeer;
 extern boost::array<int, THREAD_MAX> vnThreadsRunning;
+extern int nMessageHandlerThreads;
 extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
@@ -131,6 +139,26 @@ extern std::map<CInv, int64_t> mapAlreadyAskedFor;
 
 
 
+/** Traffic and handling time of one message command on a peer */
+class CCommandStats
+{
+public:
+    uint64_t nRecvMessages;
+    uint64_t nRecvBytes;
+    int64_t nRecvMicros;
+    uint64_t nSendMessages;
+    uint64_t nSendBytes;
+
+    CCommandStats()
+    {
+        nRecvMessages = 0;
+        nRecvBytes = 0;
+        nRecvMicros = 0;
+        nSendMessages = 0;
+        nSendBytes = 0;
+    }
+};
+
 class CNodeStats
 {
 public:
@@ -144,12 +172,65 @@ public:
     bool fInbound;
     int nStartingHeight;
     int nMisbehavior;
+    std::map<std::string, CCommandStats> mapCommandStats;
 };
 
 
 
 
 
+/** A message being framed from the bytes a peer sends.
+ *
+ * The header is parsed as soon as its bytes are in and the payload goes
+ * straight into its own stream, hashed as it arrives, so the checksum is
+ * known the moment the last byte is read.
+ */
+class CNetMessage
+{
+public:
+    bool fInData; // header done, reading the payload
+    bool fBadHeader; // header failed IsValid(), the message is dropped
+    bool fChecksumValid;
+    unsigned int nSkipped; // bytes dropped looking for the message start
+
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    unsigned int nHdrPos;
+    CMessageHeader hdr;
+
+    CDataStream vRecv;
+    unsigned int nDataPos;
+    SHA256_CTX ctxHash;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
+    {
+        fInData = false;
+        fBadHeader = false;
+        fChecksumValid = false;
+        nSkipped = 0;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool Complete() const
+    {
+        return fInData && nDataPos == hdr.nMessageSize;
+    }
+
+    // Bytes of the message held in memory
+    unsigned int Size() const
+    {
+        return nHdrPos + nDataPos;
+    }
+
+    // Consumes up to nBytes and returns how many were used
+    unsigned int Read(const char* pch, unsigned int nBytes);
+
+private:
+    unsigned int ReadHeader(const char* pch, unsigned int nBytes);
+    unsigned int ReadData(const char* pch, unsigned int nBytes);
+};
+
+
 /** Information about a peer */
 class CNode
 {
@@ -157,8 +238,13 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream vSend; // the message being built
+    std::deque<CSerializeData> vSendMsg; // finished messages waiting for the socket
+    size_t nSendSize; // bytes in vSendMsg not yet sent
+    size_t nSendOffset; // bytes of vSendMsg.front() already sent
+    std::deque<CNetMessage> vRecvMsg; // framed messages, the last may be partial
+    size_t nRecvSize; // bytes held in vRecvMsg
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64_t nLastSend;
@@ -167,6 +253,7 @@ public:
     int64_t nTimeConnected;
     int nHeaderStart;
     unsigned int nMessageStart;
+    std::string strSendCommand; // command of the message being built
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -178,6 +265,13 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fSocketWatched; // registered with the socket engine
+    bool fSocketWatchSend; // registered for send readiness
+    // message handler scheduling, guarded by the handler queue lock
+    bool fHandlerQueued; // waiting in the handler queue
+    bool fHandlerBusy; // a handler thread is working on this node
+    bool fHandlerAgain; // woken again while busy
+    bool fHandlerTrickle; // next SendMessages may trickle
     CSemaphoreGrant grantOutbound;
     int nRefCount;
 protected:
@@ -209,7 +303,11 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    // traffic by message command
+    std::map<std::string, CCommandStats> mapCommandStats;
+    CCriticalSection cs_mapCommandStats;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -217,6 +315,10 @@ public:
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
+        nSendSize = 0;
+        nSendOffset = 0;
+        nRecvSize = 0;
+        nRecvVersion = MIN_PROTO_VERSION;
         nHeaderStart = -1;
         nMessageStart = -1;
         addr = addrIn;
@@ -229,6 +331,12 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketWatched = false;
+        fSocketWatchSend = false;
+        fHandlerQueued = false;
+        fHandlerBusy = false;
+        fHandlerAgain = false;
+        fHandlerTrickle = false;
         nRefCount = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -308,6 +416,9 @@ public:
             if (!setInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
+        // transactions trickle out anyway, blocks go out right away
+        if (inv.type != MSG_TX)
+            WakeMessageHandler(this);
     }
 
     void AskFor(const CInv& inv)
@@ -340,6 +451,7 @@ public:
         nHeaderStart = vSend.size();
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
+        strSendCommand = pszCommand;
         if (fDebug)
             printf("sending: %s ", pszCommand);
     }
@@ -384,6 +496,14 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
+        // Queue the message; if nothing was waiting try to send it right away
+        vSendMsg.push_back(CSerializeData());
+        vSend.GetAndClear(vSendMsg.back());
+        nSendSize += vSendMsg.back().size();
+        RecordCommand(strSendCommand, true, vSendMsg.back().size(), 0);
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -435,6 +555,23 @@ public:
         }
     }
 
+    // Sends a payload that is already serialized
+    void PushRawMessage(const char* pszCommand, const std::vector<char>& vchPayload)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            if (!vchPayload.empty())
+                vSend.write(&vchPayload[0], vchPayload.size());
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -636,6 +773,14 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+
+    // Adds the bytes and handling time of a message to its command's stats
+    void RecordCommand(const std::string& strCommand, bool fSend, unsigned int nBytes, int64_t nMicros);
+
+    // Frames received bytes into vRecvMsg, returns the number of messages completed
+    int ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+
+    void SetRecvVersion(int nVersionIn);
 };
 
 inline void RelayInventory(const CInv& inv)
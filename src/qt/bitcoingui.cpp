@@ -1201,13 +1201,13 @@ void BitcoinGUI::updateWallet()
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
         pwalletMain->MarkDirty();
-
-        dialog.setValue(30);
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        dialog.setValue(35);
-        pwalletMain->ReacceptWalletTransactions();
     }
 
+    dialog.setValue(30);
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    dialog.setValue(35);
+    pwalletMain->ReacceptWalletTransactions();
+
     dialog.setValue(100);
 }
 
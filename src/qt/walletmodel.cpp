@@ -903,45 +903,14 @@ bool WalletModel::getBlocksInInterval(int64_t start, int64_t end,
           return false;
     }
 
-    bool fStartFound = false;
-    bool fEndFound = false;
-
-    if (start < pindexGenesisBlock->nTime)
-    {
-          blocks.first = pindexGenesisBlock;
-          fStartFound = true;
-    }
-
-    if (end > pindexBest->nTime)
-    {
-          blocks.second = pindexBest;
-          fEndFound = true;
-    }
-
-
-    if (!(fStartFound && fEndFound))
-    {
-          // work our way backwards
-          CBlockIndex* pindex = pindexBest;
-          while (pindex->pprev != NULL)
-          {
-               if (!fEndFound && (pindex->nTime <= end))
-               {
-                      blocks.second = pindex;
-                      fEndFound = true;
-               }
-               if (!fStartFound && (pindex->pprev->nTime < start))
-               {
-                      fStartFound = true;
-                      blocks.first = pindex;
-                      break;
-               }
-               pindex = pindex->pprev;
-          }
-    }
+    // the first block from start on, and the last one before anything later than end
+    int nStartHeight = (start <= pindexGenesisBlock->nTime) ? 0 : chainActive.FindHeightByTime(start);
+    int nEndHeight = (end >= pindexBest->nTime) ? chainActive.Height() : chainActive.FindHeightByTime(end + 1) - 1;
+    blocks.first = chainActive[nStartHeight];
+    blocks.second = chainActive[nEndHeight];
 
     // this should never test true
-    if (!(fStartFound && fEndFound))
+    if (blocks.first == NULL || blocks.second == NULL)
     {
           printf("getBlocksInInterval(): blocks not found\n");
           return false;
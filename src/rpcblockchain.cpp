@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -43,31 +44,46 @@ double GetDifficulty(const CBlockIndex* blockindex)
     return dDiff;
 }
 
+// the average of the work spacing is carried along the chain, so it is only
+// recomputed from genesis after a reorganisation below the block it reached
+static CBlockIndex* pindexPoWMHashPSLast = NULL;
+static CBlockIndex* pindexPoWMHashPSPrevWork = NULL;
+static int64_t nPoWMHashPSTargetSpacingWork = 0;
+
 double GetPoWMHashPS()
 {
     if (pindexBest->nHeight >= LAST_POW_BLOCK)
         return 0;
 
     int nPoWInterval = 72;
-    int64_t nTargetSpacingWorkMin = 30, nTargetSpacingWork = 30;
+    int64_t nTargetSpacingWorkMin = 30;
 
-    CBlockIndex* pindex = pindexGenesisBlock;
-    CBlockIndex* pindexPrevWork = pindexGenesisBlock;
+    LOCK(cs_main);
+    CBlockIndex* pindex;
+    if (pindexPoWMHashPSLast && chainActive.Contains(pindexPoWMHashPSLast))
+    {
+        pindex = chainActive[pindexPoWMHashPSLast->nHeight + 1];
+    }
+    else
+    {
+        pindex = pindexGenesisBlock;
+        pindexPoWMHashPSPrevWork = pindexGenesisBlock;
+        nPoWMHashPSTargetSpacingWork = 30;
+    }
 
-    while (pindex)
+    for (; pindex; pindex = chainActive[pindex->nHeight + 1])
     {
         if (pindex->IsProofOfWork())
         {
-            int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPrevWork->GetBlockTime();
-            nTargetSpacingWork = ((nPoWInterval - 1) * nTargetSpacingWork + nActualSpacingWork + nActualSpacingWork) / (nPoWInterval + 1);
-            nTargetSpacingWork = max(nTargetSpacingWork, nTargetSpacingWorkMin);
-            pindexPrevWork = pindex;
+            int64_t nActualSpacingWork = pindex->GetBlockTime() - pindexPoWMHashPSPrevWork->GetBlockTime();
+            nPoWMHashPSTargetSpacingWork = ((nPoWInterval - 1) * nPoWMHashPSTargetSpacingWork + nActualSpacingWork + nActualSpacingWork) / (nPoWInterval + 1);
+            nPoWMHashPSTargetSpacingWork = max(nPoWMHashPSTargetSpacingWork, nTargetSpacingWorkMin);
+            pindexPoWMHashPSPrevWork = pindex;
         }
-
-        pindex = pindex->pnext;
+        pindexPoWMHashPSLast = pindex;
     }
 
-    return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
+    return GetDifficulty() * 4294.967296 / nPoWMHashPSTargetSpacingWork;
 }
 
 double GetPoSKernelPS()
@@ -95,9 +111,9 @@ double GetPoSKernelPS()
     return nStakesTime ? dStakeKernelsTriedAvg / nStakesTime : 0;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+// the fields of a block that come before its transactions
+static void blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex, Object& result)
 {
-    Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
     CMerkleTx txGen(block.vtx[0]);
     txGen.SetMerkleBranch(&block);
@@ -124,18 +140,27 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016"PRIx64, blockindex->nStakeModifier)));
     result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
+}
+
+static Object txDetailToJSON(const CTransaction& tx)
+{
+    Object entry;
+
+    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+    TxToJSON(tx, 0, entry);
+
+    return entry;
+}
+
+Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+{
+    Object result;
+    blockHeaderToJSON(block, blockindex, result);
     Array txinfo;
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
-        {
-            Object entry;
-
-            entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-            TxToJSON(tx, 0, entry);
-
-            txinfo.push_back(entry);
-        }
+            txinfo.push_back(txDetailToJSON(tx));
         else
             txinfo.push_back(tx.GetHash().GetHex());
     }
@@ -148,6 +173,44 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
     return result;
 }
 
+// Same as above, one transaction at a time. cs_main is only held while
+// the header or a transaction is looked up.
+static void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONStreamWriter& writer)
+{
+    Object header;
+    {
+        LOCK(cs_main);
+        blockHeaderToJSON(block, blockindex, header);
+    }
+    writer.BeginObject();
+    writer.WritePairs(header);
+
+    writer.Key("tx");
+    writer.BeginArray();
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+    {
+        if (fPrintTransactionDetail)
+        {
+            Object entry;
+            {
+                LOCK(cs_main);
+                entry = txDetailToJSON(tx);
+            }
+            writer.Write(entry);
+        }
+        else
+            writer.Write(tx.GetHash().GetHex());
+    }
+    writer.EndArray();
+
+    if (block.IsProofOfStake())
+    {
+        writer.Key("signature");
+        writer.Write(HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
+    }
+    writer.EndObject();
+}
+
 Value getbestblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -229,6 +292,28 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
+// the block getblock asks for, under cs_main
+static CBlockIndex* BlockIndexFromHashParam(const Array& params)
+{
+    std::string strHash = params[0].get_str();
+    uint256 hash(strHash);
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    return mapBlockIndex[hash];
+}
+
+// the block getblockbynumber asks for, under cs_main
+static CBlockIndex* BlockIndexFromNumberParam(const Array& params)
+{
+    int nHeight = params[0].get_int();
+    if (nHeight < 0 || nHeight > nBestHeight)
+        throw runtime_error("Block number out of range.");
+
+    return FindBlockByHeight(nHeight);
+}
+
 Value getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -237,19 +322,29 @@ Value getblock(const Array& params, bool fHelp)
             "txinfo optional to print more detailed tx info\n"
             "Returns details of a block with given block-hash.");
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = BlockIndexFromHashParam(params);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
 
+void getblock_stream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getblock(params, true);
+
+    CBlock block;
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        pblockindex = BlockIndexFromHashParam(params);
+        block.ReadFromDisk(pblockindex, true);
+    }
+
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+}
+
 Value getblockbynumber(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -258,23 +353,29 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "txinfo optional to print more detailed tx info\n"
             "Returns details of a block with given block-number.");
 
-    int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
-        throw runtime_error("Block number out of range.");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = BlockIndexFromNumberParam(params);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
 
+void getblockbynumber_stream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getblockbynumber(params, true);
+
+    CBlock block;
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        pblockindex = BlockIndexFromNumberParam(params);
+        block.ReadFromDisk(pblockindex, true);
+    }
+
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+}
+
 // ppcoin: get information of sync-checkpoint
 Value getcheckpoint(const Array& params, bool fHelp)
 {
@@ -306,3 +407,75 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the size and hit rate of the valid signature cache.");
+
+    uint64_t nEntries, nCapacity, nHits, nMisses;
+    GetSignatureCacheStats(nEntries, nCapacity, nHits, nMisses);
+
+    Object result;
+    result.push_back(Pair("entries",  (boost::uint64_t)nEntries));
+    result.push_back(Pair("capacity", (boost::uint64_t)nCapacity));
+    result.push_back(Pair("hits",     (boost::uint64_t)nHits));
+    result.push_back(Pair("misses",   (boost::uint64_t)nMisses));
+    return result;
+}
+
+Value getcoincacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoincacheinfo\n"
+            "Returns the size and hit rate of the cache of previous transactions of inputs.");
+
+    uint64_t nEntries, nHits, nMisses;
+    int64_t nBytes, nMaxBytes;
+    coinCache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+
+    Object result;
+    result.push_back(Pair("entries",  (boost::uint64_t)nEntries));
+    result.push_back(Pair("bytes",    (boost::int64_t)nBytes));
+    result.push_back(Pair("maxbytes", (boost::int64_t)nMaxBytes));
+    result.push_back(Pair("hits",     (boost::uint64_t)nHits));
+    result.push_back(Pair("misses",   (boost::uint64_t)nMisses));
+    return result;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns the block index database settings and LevelDB statistics.");
+
+    const leveldb::Options& options = CTxDB::GetOpenOptions();
+
+    Object result;
+    result.push_back(Pair("cachesize",      (boost::int64_t)GetArg("-dbcache", 25)));
+    result.push_back(Pair("writebuffer",    (boost::int64_t)options.write_buffer_size));
+    result.push_back(Pair("maxopenfiles",   options.max_open_files));
+    result.push_back(Pair("blocksize",      (boost::int64_t)options.block_size));
+    result.push_back(Pair("compression",    options.compression != leveldb::kNoCompression));
+
+    CTxDB txdb("r");
+    Array files;
+    for (int nLevel = 0; ; nLevel++)
+    {
+        string strFiles;
+        if (!txdb.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strFiles))
+            break;
+        files.push_back(atoi(strFiles.c_str()));
+    }
+    result.push_back(Pair("filesperlevel",  files));
+
+    string strStats;
+    if (txdb.GetProperty("leveldb.stats", strStats))
+        result.push_back(Pair("stats",      strStats));
+
+    return result;
+}
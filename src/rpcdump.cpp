@@ -138,11 +138,11 @@ Value importprivkey(const Array& params, bool fHelp)
 
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
-
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
     }
 
+    pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+    pwalletMain->ReacceptWalletTransactions();
+
     return Value::null;
 }
 
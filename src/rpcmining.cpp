@@ -8,6 +8,7 @@
 #include "txdb.h"
 #include "init.h"
 #include "miner.h"
+#include "kernel.h"
 #include "bitcoinrpc.h"
 #include <boost/lexical_cast.hpp>
 
@@ -136,6 +137,10 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("difficulty", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
+    obj.push_back(Pair("kernelspersecond", (int64_t)dKernelsPerSec));
+    obj.push_back(Pair("searchms", (double)nStakeSearchMicros / 1000));
+    obj.push_back(Pair("templatems", (double)nStakeTemplateMicros / 1000));
+    obj.push_back(Pair("timetosignms", (double)nStakeSignMicros / 1000));
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
@@ -41,7 +41,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getpeerinfo\n"
-            "Returns data about each connected network node.");
+            "Returns data about each connected network node.\n"
+            "\"commands\" holds messages, bytes and handling time (ms) by message command.");
 
     vector<CNodeStats> vstats;
     CopyNodeStats(vstats);
@@ -62,6 +63,20 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
 
+        Object commands;
+        for (map<string, CCommandStats>::const_iterator mi = stats.mapCommandStats.begin(); mi != stats.mapCommandStats.end(); ++mi)
+        {
+            const CCommandStats& cmd = mi->second;
+            Object entry;
+            entry.push_back(Pair("recvmsgs", (boost::uint64_t)cmd.nRecvMessages));
+            entry.push_back(Pair("recvbytes", (boost::uint64_t)cmd.nRecvBytes));
+            entry.push_back(Pair("recvtime", (double)cmd.nRecvMicros / 1000.0));
+            entry.push_back(Pair("sentmsgs", (boost::uint64_t)cmd.nSendMessages));
+            entry.push_back(Pair("sentbytes", (boost::uint64_t)cmd.nSendBytes));
+            commands.push_back(Pair(mi->first, entry));
+        }
+        obj.push_back(Pair("commands", commands));
+
         ret.push_back(obj);
     }
 
@@ -127,7 +127,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -178,28 +178,21 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
-{
-    if (fHelp || params.size() > 3)
-        throw runtime_error(
-            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
-            "Returns array of unspent transaction outputs\n"
-            "with between minconf and maxconf (inclusive) confirmations.\n"
-            "Optionally filtered to only include txouts paid to specified addresses.\n"
-            "Results are an array of Objects, each of which has:\n"
-            "{txid, vout, scriptPubKey, amount, confirmations}");
+// unspent outputs streamed per lock of the wallet
+static const unsigned int LISTUNSPENT_STREAM_SLICE = 100;
 
+static void ParseUnspentParams(const Array& params, int& nMinDepth, int& nMaxDepth, set<CBitcoinAddress>& setAddress)
+{
     RPCTypeCheck(params, list_of(int_type)(int_type)(array_type));
 
-    int nMinDepth = 1;
+    nMinDepth = 1;
     if (params.size() > 0)
         nMinDepth = params[0].get_int();
 
-    int nMaxDepth = 9999999;
+    nMaxDepth = 9999999;
     if (params.size() > 1)
         nMaxDepth = params[1].get_int();
 
-    set<CBitcoinAddress> setAddress;
     if (params.size() > 2)
     {
         Array inputs = params[2].get_array();
@@ -213,8 +206,11 @@ Value listunspent(const Array& params, bool fHelp)
            setAddress.insert(address);
         }
     }
+}
 
-    Array results;
+// the outputs listunspent returns, under cs_wallet
+static void SelectUnspent(int nMinDepth, int nMaxDepth, const set<CBitcoinAddress>& setAddress, vector<COutput>& vOutput)
+{
     vector<COutput> vecOutputs;
     pwalletMain->AvailableCoins(vecOutputs, false);
     BOOST_FOREACH(const COutput& out, vecOutputs)
@@ -232,27 +228,96 @@ Value listunspent(const Array& params, bool fHelp)
                 continue;
         }
 
-        int64_t nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
-        Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-        {
-            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
-        }
-        entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
-        entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        vOutput.push_back(out);
     }
+}
+
+static Object UnspentToJSON(const COutput& out)
+{
+    int64_t nValue = out.tx->vout[out.i].nValue;
+    const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+    Object entry;
+    entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
+    entry.push_back(Pair("vout", out.i));
+    CTxDestination address;
+    if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+    {
+        entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
+        if (pwalletMain->mapAddressBook.count(address))
+            entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+    }
+    entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
+    entry.push_back(Pair("amount",ValueFromAmount(nValue)));
+    entry.push_back(Pair("confirmations",out.nDepth));
+    return entry;
+}
+
+Value listunspent(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
+            "Returns array of unspent transaction outputs\n"
+            "with between minconf and maxconf (inclusive) confirmations.\n"
+            "Optionally filtered to only include txouts paid to specified addresses.\n"
+            "Results are an array of Objects, each of which has:\n"
+            "{txid, vout, scriptPubKey, amount, confirmations}");
+
+    int nMinDepth, nMaxDepth;
+    set<CBitcoinAddress> setAddress;
+    ParseUnspentParams(params, nMinDepth, nMaxDepth, setAddress);
+
+    vector<COutput> vOutput;
+    SelectUnspent(nMinDepth, nMaxDepth, setAddress, vOutput);
+
+    Array results;
+    BOOST_FOREACH(const COutput& out, vOutput)
+        results.push_back(UnspentToJSON(out));
 
     return results;
 }
 
+void listunspent_stream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() > 3)
+        listunspent(params, true);
+
+    int nMinDepth, nMaxDepth;
+    set<CBitcoinAddress> setAddress;
+    ParseUnspentParams(params, nMinDepth, nMaxDepth, setAddress);
+
+    // remember the outputs by hash, the wallet may change between slices
+    vector<pair<uint256, pair<int, int> > > vOutpoint;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        vector<COutput> vOutput;
+        SelectUnspent(nMinDepth, nMaxDepth, setAddress, vOutput);
+        vOutpoint.reserve(vOutput.size());
+        BOOST_FOREACH(const COutput& out, vOutput)
+            vOutpoint.push_back(make_pair(out.tx->GetHash(), make_pair(out.i, out.nDepth)));
+    }
+
+    writer.BeginArray();
+    for (unsigned int nStart = 0; nStart < vOutpoint.size(); nStart += LISTUNSPENT_STREAM_SLICE)
+    {
+        unsigned int nEnd = min((unsigned int)vOutpoint.size(), nStart + LISTUNSPENT_STREAM_SLICE);
+        Array slice;
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            for (unsigned int n = nStart; n < nEnd; n++)
+            {
+                map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(vOutpoint[n].first);
+                if (mi == pwalletMain->mapWallet.end())
+                    continue;
+                slice.push_back(UnspentToJSON(COutput(&mi->second, vOutpoint[n].second.first, vOutpoint[n].second.second)));
+            }
+        }
+        BOOST_FOREACH(const Value& entry, slice)
+            writer.Write(entry);
+    }
+    writer.EndArray();
+}
+
 Value createrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 2)
@@ -533,6 +598,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
         }
         const CScript& prevPubKey = mapPrevOut[txin.prevout];
 
+        mergedTx.InvalidateHash();
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
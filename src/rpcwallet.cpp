@@ -10,6 +10,8 @@
 #include "base58.h"
 #include "stealth.h"
 #include "txdb.h"
+#include "turbo.h"
+#include "smessage.h"
 
 #include <boost/lexical_cast.hpp>
 
@@ -116,6 +118,15 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", (boost::int64_t)nWalletUnlockTime / 1000));
+    if (fSecMsgEnabled)
+    {
+        Object smsg;
+        LOCK(cs_smsg);
+        smsg.push_back(Pair("scanned",         (boost::uint64_t)nSmsgScanned));
+        smsg.push_back(Pair("decryptattempts", (boost::uint64_t)nSmsgDecryptAttempts));
+        smsg.push_back(Pair("matches",         (boost::uint64_t)nSmsgMatches));
+        obj.push_back(Pair("smsg",          smsg));
+    }
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     return obj;
 }
@@ -493,11 +504,11 @@ Value verifymessage(const Array& params, bool fHelp)
     ss << strMessageMagic;
     ss << strMessage;
 
-    CKey key;
-    if (!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+    CPubKey pubkey;
+    if (!pubkey.RecoverCompact(Hash(ss.begin(), ss.end()), vchSig))
         return false;
 
-    return (key.GetPubKey().GetID() == keyID);
+    return (pubkey.GetID() == keyID);
 }
 
 
@@ -1200,20 +1211,15 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+static void ParseListTransactionsParams(const Array& params, string& strAccount, int& nCount, int& nFrom)
 {
-    if (fHelp || params.size() > 3)
-        throw runtime_error(
-            "listtransactions [account] [count=10] [from=0]\n"
-            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].");
-
-    string strAccount = "*";
+    strAccount = "*";
     if (params.size() > 0)
         strAccount = params[0].get_str();
-    int nCount = 10;
+    nCount = 10;
     if (params.size() > 1)
         nCount = params[1].get_int();
-    int nFrom = 0;
+    nFrom = 0;
     if (params.size() > 2)
         nFrom = params[2].get_int();
 
@@ -1221,6 +1227,18 @@ Value listtransactions(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+}
+
+Value listtransactions(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listtransactions [account] [count=10] [from=0]\n"
+            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].");
+
+    string strAccount;
+    int nCount, nFrom;
+    ParseListTransactionsParams(params, strAccount, nCount, nFrom);
 
     Array ret;
 
@@ -1258,6 +1276,84 @@ Value listtransactions(const Array& params, bool fHelp)
     return ret;
 }
 
+// A wallet transaction or accounting entry with entries on a listtransactions
+// page, and which of its entries (counted newest first) are on it
+struct CListPageItem
+{
+    bool fTx;
+    uint256 hash;
+    CAccountingEntry acentry;
+    int nBegin;
+    int nEnd;
+};
+
+void listtransactions_stream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() > 3)
+        listtransactions(params, true);
+
+    string strAccount;
+    int nCount, nFrom;
+    ParseListTransactionsParams(params, strAccount, nCount, nFrom);
+
+    // find the items on the page, newest first, building the entries of
+    // one item at a time to count them
+    vector<CListPageItem> vItem;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        std::list<CAccountingEntry> acentries;
+        CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+
+        int nPos = 0;
+        for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend() && nPos < nFrom + nCount; ++it)
+        {
+            Array entries;
+            CWalletTx *const pwtx = (*it).second.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, entries);
+            CAccountingEntry *const pacentry = (*it).second.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, entries);
+
+            int nSize = entries.size();
+            if (nPos + nSize > nFrom)
+            {
+                CListPageItem item;
+                item.fTx = (pwtx != 0);
+                if (pwtx != 0)
+                    item.hash = pwtx->GetHash();
+                if (pacentry != 0)
+                    item.acentry = *pacentry;
+                item.nBegin = max(nFrom - nPos, 0);
+                item.nEnd = min(nFrom + nCount - nPos, nSize);
+                vItem.push_back(item);
+            }
+            nPos += nSize;
+        }
+    }
+
+    // write them oldest to newest, locking for one item at a time
+    writer.BeginArray();
+    for (vector<CListPageItem>::reverse_iterator it = vItem.rbegin(); it != vItem.rend(); ++it)
+    {
+        Array entries;
+        if (it->fTx)
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(it->hash);
+            if (mi == pwalletMain->mapWallet.end())
+                continue;
+            ListTransactions(mi->second, strAccount, 0, true, entries);
+        }
+        else
+            AcentryToJSON(it->acentry, strAccount, entries);
+
+        for (int n = min(it->nEnd, (int)entries.size()) - 1; n >= it->nBegin; n--)
+            writer.Write(entries[n]);
+    }
+    writer.EndArray();
+}
+
 Value listaccounts(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1421,7 +1517,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -1440,52 +1536,76 @@ Value gettransaction(const Array& params, bool fHelp)
 }
 
 
-CBlockIndex* GetLastTurboIndex() {
-    CBlockIndex *pindex;
-    if (pindexLastTurbo == NULL) {
-          pindex = pindexBest;
-    }
-    else {
-          pindex = pindexLastTurbo;
-    }
-
-    if (IsInitialBlockDownload() || (pindex == NULL) || (pindex->pprev == NULL)) {
+void EnsureTurboIndexReady() {
+    if (IsInitialBlockDownload() || (pindexBest == NULL) || (pindexBest->pprev == NULL)) {
           throw JSONRPCError(RPC_INVALID_REQUEST, "Blockchain not ready");
     }
 
-    if (mapTurboAddress.empty()) {
+    if (!fTurboStakeSignersLoaded) {
           throw JSONRPCError(RPC_INVALID_REQUEST, "Turbo addresses awaiting cache");
     }
-    return pindex;
 }
 
 
 // [TODO] Need to make sure this works for multisigs
-Value getaddressbalancebyblock(const Array& params, bool fHelp)
+// Records a change of balance; heights go to pwriterHeight as they are
+// found instead of vHeight if one is given
+static void PushBalanceChange(int nHeight, int64_t nBalance, vector<int>& vHeight, vector<int64_t>& vBalance, CJSONStreamWriter* pwriterHeight)
 {
-    if  (fHelp || params.size() != 2)
-    {
-        throw runtime_error(
-            "getaddressbalancebyblock <address> <height>\n"
-            "Get per block balance of <address> through block <height>.");
-    }
-
-    CBitcoinAddress address(params[0].get_str());
-    if (!address.IsValid())
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid synergy address");
+    if (pwriterHeight)
+        pwriterHeight->Write(nHeight);
+    else
+        vHeight.push_back(nHeight);
+    vBalance.push_back(nBalance);
+}
 
-    int height = params[1].get_int();
-   
+// Heights at which the balance of address changed through nHeight, and
+// the balance after each. Takes cs_main one block at a time.
+static void AddressBalanceByBlock(const CBitcoinAddress& address, int nHeight, vector<int>& vHeight, vector<int64_t>& vBalance,
+                                  CJSONStreamWriter* pwriterHeight = NULL)
+{
     CTxDB txdb("r");
 
-    CBlockIndex *pindex = pindexGenesisBlock->pnext;
+    if (fAddressIndex)
+    {
+        unsigned char nType;
+        uint160 hashBytes;
+        AddressIndexVector vIndex;
+        if (!GetAddressIndexHash(address.Get(), nType, hashBytes))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address is not indexed");
+        if (!txdb.ReadAddressIndex(nType, hashBytes, vIndex))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Could not read address index");
 
-    Array heights, balances, ret;
+        // net change per block through the requested height
+        std::map<int, int64_t> mapDelta;
+        for (AddressIndexVector::const_iterator it = vIndex.begin(); it != vIndex.end(); ++it)
+            if (it->first.nHeight <= nHeight)
+                mapDelta[it->first.nHeight] += it->second.nValue;
+
+        int64_t balance = 0;
+        for (std::map<int, int64_t>::const_iterator it = mapDelta.begin(); it != mapDelta.end(); ++it)
+        {
+            if (it->second == 0)
+                continue;
+            balance += it->second;
+            PushBalanceChange(it->first, balance, vHeight, vBalance, pwriterHeight);
+        }
+        return;
+    }
+
+    CBlockIndex *pindex;
+    {
+        LOCK(cs_main);
+        pindex = pindexGenesisBlock->pnext;
+    }
 
     int64_t balance = 0;
     int64_t balance_last = 0;
-    while ((pindex->pnext != NULL) && (pindex->nHeight <= height))
+    while (true)
     {
+        LOCK(cs_main);
+        if (pindex->pnext == NULL || pindex->nHeight > nHeight)
+            break;
         CBlock block;
         block.ReadFromDisk(pindex, true);
         for (std::vector<CTransaction>::iterator ptx = block.vtx.begin();
@@ -1542,17 +1662,67 @@ Value getaddressbalancebyblock(const Array& params, bool fHelp)
         }
         if (balance != balance_last)
         {
-           heights.push_back(pindex->nHeight);
-           balances.push_back(ValueFromAmount(balance));
+           PushBalanceChange(pindex->nHeight, balance, vHeight, vBalance, pwriterHeight);
            balance_last = balance;
         }
         pindex = pindex->pnext;
     }
+}
+
+Value getaddressbalancebyblock(const Array& params, bool fHelp)
+{
+    if  (fHelp || params.size() != 2)
+    {
+        throw runtime_error(
+            "getaddressbalancebyblock <address> <height>\n"
+            "Get per block balance of <address> through block <height>.");
+    }
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid synergy address");
+
+    int height = params[1].get_int();
+
+    vector<int> vHeight;
+    vector<int64_t> vBalance;
+    AddressBalanceByBlock(address, height, vHeight, vBalance);
+
+    Array heights, balances, ret;
+    for (unsigned int i = 0; i < vHeight.size(); i++)
+    {
+        heights.push_back(vHeight[i]);
+        balances.push_back(ValueFromAmount(vBalance[i]));
+    }
     ret.push_back(heights);
     ret.push_back(balances);
     return ret;
 }
 
+void getaddressbalancebyblock_stream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() != 2)
+        getaddressbalancebyblock(params, true);
+
+    CBitcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid synergy address");
+
+    // heights are written as the blocks are scanned, only the balances
+    // are held until the scan is done
+    vector<int> vHeight;
+    vector<int64_t> vBalance;
+    writer.BeginArray();
+    writer.BeginArray();
+    AddressBalanceByBlock(address, params[1].get_int(), vHeight, vBalance, &writer);
+    writer.EndArray();
+    writer.BeginArray();
+    BOOST_FOREACH(int64_t nBalance, vBalance)
+        writer.Write(ValueFromAmount(nBalance));
+    writer.EndArray();
+    writer.EndArray();
+}
+
 
 Value getmyturboaddresses(const Array& params, bool fHelp)
 {
@@ -1564,40 +1734,16 @@ Value getmyturboaddresses(const Array& params, bool fHelp)
     }
     Object myTurbos;
 
-    CBlockIndex *pindex = GetLastTurboIndex();
+    EnsureTurboIndexReady();
 
-    while (pindex->pprev != NULL)
+    vector<CTurboStake> vStake;
+    turboIndex.GetLastStakes(nTurboEndTime, vStake);
+    BOOST_FOREACH(const CTurboStake& stake, vStake)
     {
-        if (pindex->IsProofOfStake())
+        if (IsMine(*pwalletMain, stake.keyID))
         {
-            CBitcoinAddress address;
-            map<uint256, CBitcoinAddress>::iterator it = mapTurboAddress.find(*pindex->phashBlock);
-            if (it != mapTurboAddress.end())
-            {
-                address = it->second;
-                CTxDestination dest = address.Get();
-                if (IsMine(*pwalletMain, dest))
-                {
-                     string sAddress = address.ToString();
-                     Object::iterator oit = myTurbos.begin();
-                     while (true)
-                     {
-                        if (oit == myTurbos.end())
-                        {
-                             int m = GetTurboStakeMultiplier(address, pindex->nStakeTime, pindex->pprev);
-                             myTurbos.push_back(Pair(sAddress, m));
-                             break;
-                        }
-                        if (oit->name_ == sAddress)
-                        {
-                             break;
-                        }
-                        ++oit;
-                     }
-                }
-            }
+             myTurbos.push_back(Pair(CBitcoinAddress(stake.keyID).ToString(), stake.nMultiplier));
         }
-        pindex = pindex->pprev;
     }
     return myTurbos;
 }
@@ -1621,44 +1767,121 @@ Value getallturboaddresses(const Array& params, bool fHelp)
     }
     Object allTurbos;
 
-    CBlockIndex *pindex = GetLastTurboIndex();
+    EnsureTurboIndexReady();
 
-    while (pindex->pprev != NULL)
+    vector<CTurboStake> vStake;
+    turboIndex.GetLastStakes(nTurboEndTime, vStake);
+    BOOST_FOREACH(const CTurboStake& stake, vStake)
     {
-        if (pindex->IsProofOfStake())
-        {
-            CBitcoinAddress address;
-            map<uint256, CBitcoinAddress>::iterator it = mapTurboAddress.find(*pindex->phashBlock);
-            if (it != mapTurboAddress.end())
-            {
-                address = it->second;
-                {
-                     string sAddress = address.ToString();
-                     Object::iterator oit = allTurbos.begin();
-                     while (true)
-                     {
-                        if (oit == allTurbos.end())
-                        {
-                             int m = GetTurboStakeMultiplier(address, pindex->nStakeTime, pindex->pprev);
-                             allTurbos.push_back(Pair(sAddress, m));
-                             break;
-                        }
-                        if (oit->name_ == sAddress)
-                        {
-                             break;
-                        }
-                        ++oit;
-                     }
-                }
-            }
-        }
-        pindex = pindex->pprev;
+        allTurbos.push_back(Pair(CBitcoinAddress(stake.keyID).ToString(), stake.nMultiplier));
     }
     std::sort (allTurbos.begin(), allTurbos.end(), turboSorter);
     return allTurbos;
 }
 
 
+// an output paid to or an input spent from a turbo address
+struct CTurboAddressEvent
+{
+    CBitcoinAddress address;
+    int64_t nValue;
+    bool fSpending;
+    bool fCoinStake;
+    uint256 hashTx;
+};
+
+static CBitcoinAddress AddressFromIndexKey(const CAddressIndexKey& key)
+{
+    if (key.nType == 2)
+        return CBitcoinAddress(CScriptID(key.hashBytes));
+    return CBitcoinAddress(CKeyID(key.hashBytes));
+}
+
+// events of the addresses in setAddress in the block of pindex, in block
+// order with the outputs of a transaction before its inputs; taken from
+// mapIndexed when -addressindex is on, otherwise read from disk
+static void GetTurboAddressEvents(CTxDB& txdb, CBlockIndex* pindex, const std::set<CBitcoinAddress>& setAddress,
+                                  const std::map<int, std::vector<CTurboAddressEvent> >* pmapIndexed,
+                                  std::vector<CTurboAddressEvent>& vEvent)
+{
+    vEvent.clear();
+    if (pmapIndexed)
+    {
+        std::map<int, std::vector<CTurboAddressEvent> >::const_iterator mi = pmapIndexed->find(pindex->nHeight);
+        if (mi != pmapIndexed->end())
+            vEvent = mi->second;
+        return;
+    }
+
+    CBlock block;
+    block.ReadFromDisk(pindex, true);
+    for (std::vector<CTransaction>::iterator ptx = block.vtx.begin();
+                                                         ptx != block.vtx.end(); ++ptx)
+    {
+         CTurboAddressEvent event;
+         event.fCoinStake = ptx->IsCoinStake();
+         event.hashTx = ptx->GetHash();
+
+         // outputs
+         event.fSpending = false;
+         for (std::vector<CTxOut>::iterator pout = ptx->vout.begin();
+                                                         pout != ptx->vout.end(); ++pout)
+         {
+              CTxDestination destaddr;
+              if (!ExtractDestination(pout->scriptPubKey, destaddr))
+              {
+                    if (fDebug)
+                    {
+                        printf("getturboguarantees: could not extract address for output\n");
+                    }
+                    continue;
+              }
+              event.address = CBitcoinAddress(destaddr);
+              if (!setAddress.count(event.address))
+              {
+                     // address never staked turbo
+                     continue;
+              }
+              event.nValue = pout->nValue;
+              vEvent.push_back(event);
+         }
+
+         // inputs
+         event.fSpending = true;
+         for (std::vector<CTxIn>::iterator pin = ptx->vin.begin();
+                                                         pin != ptx->vin.end(); ++pin)
+         {
+              CTransaction txPrev;
+              CTxIndex txindex;
+              if (!txPrev.ReadFromDisk(txdb, pin->prevout, txindex))
+              {
+                    if (fDebug)
+                    {
+                        printf("getturboguarantees: could not read txin from disk\n");
+                    }
+                    continue;  // previous transaction not in main chain?
+              }
+              CTxDestination destaddr;
+              if (!ExtractDestination(txPrev.vout[pin->prevout.n].scriptPubKey, destaddr))
+              {
+                    if (fDebug)
+                    {
+                        printf("getturboguarantees: could not extract address for prev out\n");
+                    }
+                    continue;
+              }
+              event.address = CBitcoinAddress(destaddr);
+              if (!setAddress.count(event.address))
+              {
+                     // address never staked turbo
+                     continue;
+              }
+              event.nValue = txPrev.vout[pin->prevout.n].nValue;
+              vEvent.push_back(event);
+         }
+    }
+}
+
 Value getturboredemption(const Array& params, bool fHelp)
 {
     if  (fHelp || params.size() != 0)
@@ -1675,12 +1898,41 @@ Value getturboredemption(const Array& params, bool fHelp)
 
     Object allTurbos = getallturboaddresses(Array(), false).get_obj();
 
-    std::list<CBitcoinAddress> listTurboAddress;
+    std::set<CBitcoinAddress> setTurboAddress;
 
     for (Object::iterator it = allTurbos.begin(); it != allTurbos.end(); ++it)
     {
-           listTurboAddress.push_back(CBitcoinAddress(it->name_));
+           setTurboAddress.insert(CBitcoinAddress(it->name_));
+    }
+
+    // with -addressindex the events of every block come from the index
+    std::map<int, std::vector<CTurboAddressEvent> > mapIndexed;
+    if (fAddressIndex)
+    {
+        AddressIndexVector vIndex;
+        BOOST_FOREACH(const CBitcoinAddress& address, setTurboAddress)
+        {
+            unsigned char nType;
+            uint160 hashBytes;
+            AddressIndexVector vAddressIndex;
+            if (!GetAddressIndexHash(address.Get(), nType, hashBytes) ||
+                !txdb.ReadAddressIndex(nType, hashBytes, vAddressIndex))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Could not read address index");
+            vIndex.insert(vIndex.end(), vAddressIndex.begin(), vAddressIndex.end());
+        }
+        std::sort(vIndex.begin(), vIndex.end(), CAddressIndexBlockOrder());
+        for (AddressIndexVector::const_iterator it = vIndex.begin(); it != vIndex.end(); ++it)
+        {
+            CTurboAddressEvent event;
+            event.address = AddressFromIndexKey(it->first);
+            event.nValue = it->first.fSpending ? -it->second.nValue : it->second.nValue;
+            event.fSpending = it->first.fSpending;
+            event.fCoinStake = it->second.fCoinStake;
+            event.hashTx = it->first.txid;
+            mapIndexed[it->first.nHeight].push_back(event);
+        }
     }
+    const std::map<int, std::vector<CTurboAddressEvent> >* pmapIndexed = fAddressIndex ? &mapIndexed : NULL;
 
     std::map<CBitcoinAddress, CBlockIndex*> mapCreationBlock;
     std::map<CBitcoinAddress, int64_t> mapBalance;
@@ -1693,31 +1945,15 @@ Value getturboredemption(const Array& params, bool fHelp)
 
     while (pindex->nTime <= nGuaranteeStartTime)
     {
-        CBlock block;
-        block.ReadFromDisk(pindex, true);
-        for (std::vector<CTransaction>::iterator ptx = block.vtx.begin();
-                                                             ptx != block.vtx.end(); ++ptx)
+        std::vector<CTurboAddressEvent> vEvent;
+        GetTurboAddressEvents(txdb, pindex, setTurboAddress, pmapIndexed, vEvent);
+        BOOST_FOREACH(const CTurboAddressEvent& event, vEvent)
         {
+             const CBitcoinAddress& address = event.address;
+
              // outputs
-             for (std::vector<CTxOut>::iterator pout = ptx->vout.begin();
-                                                             pout != ptx->vout.end(); ++pout)
+             if (!event.fSpending)
              {
-                  CTxDestination destaddr;
-                  if (!ExtractDestination(pout->scriptPubKey, destaddr))
-                  {
-                        if (fDebug)
-                        {
-                            printf("getturboguarantees: could not extract address for output\n");
-                        }
-                        continue;
-                  }
-                  CBitcoinAddress address = CBitcoinAddress(destaddr);
-                  if (std::find(listTurboAddress.begin(), listTurboAddress.end(), address) ==
-                                                                                 listTurboAddress.end())
-                  {
-                         // address never staked turbo
-                         continue;
-                  }
                   if ((mapBalanceLastBlock.find(address) != mapBalanceLastBlock.end()) &&
                       (mapStartingBalance.find(address) == mapStartingBalance.end()) &&
                       (pindex->nHeight > LAST_POW_BLOCK))
@@ -1727,64 +1963,32 @@ Value getturboredemption(const Array& params, bool fHelp)
                   }
                   if (mapBalance.find(address) != mapBalance.end())
                   {
-                        mapBalance[address] = mapBalance[address] + pout->nValue;
+                        mapBalance[address] = mapBalance[address] + event.nValue;
                   }
                   else
                   {
-                        mapBalance[address] = pout->nValue;
+                        mapBalance[address] = event.nValue;
                         mapCreationBlock[address] = pindex;
                   }
                   // delay starting balance if receiving
-                  if ((!ptx->IsCoinStake()) &&
+                  if ((!event.fCoinStake) &&
                       (mapStartingBalance.find(address) != mapStartingBalance.end()))
                   {
                         mapStartingBalance.erase(address);
                         mapStartingBlock.erase(address);
                   }
-
+                  continue;
              }
 
              // inputs
-             for (std::vector<CTxIn>::iterator pin = ptx->vin.begin();
-                                                             pin != ptx->vin.end(); ++pin)
+             if (mapBalance.find(address) != mapBalance.end())
              {
-                  CTransaction txPrev;
-                  CTxIndex txindex;
-                  if (!txPrev.ReadFromDisk(txdb, pin->prevout, txindex))
+                  mapBalance[address] = mapBalance[address] - event.nValue;
+                  // delay starting balance if sending
+                  if (!event.fCoinStake)
                   {
-                        if (fDebug)
-                        {
-                            printf("getturboguarantees: could not read txin from disk\n");
-                        }
-                        continue;  // previous transaction not in main chain?
-                  }
-                  CTxDestination destaddr;
-                  if (!ExtractDestination(txPrev.vout[pin->prevout.n].scriptPubKey, destaddr))
-                  {
-                        if (fDebug)
-                        {
-                            printf("getturboguarantees: could not extract address for prev out\n");
-                        }
-                        continue;
-                  }
-                  CBitcoinAddress address = CBitcoinAddress(destaddr);
-                  if (std::find(listTurboAddress.begin(), listTurboAddress.end(), address) ==
-                                                                                 listTurboAddress.end())
-                  {
-                         // address never staked turbo
-                         continue;
-                  }
-                  if (mapBalance.find(address) != mapBalance.end())
-                  {
-                        int64_t nValueIn = txPrev.vout[pin->prevout.n].nValue;
-                        mapBalance[address] = mapBalance[address] - nValueIn;
-                        // delay starting balance if sending
-                        if ((!ptx->IsCoinStake()) &&
-                            (mapStartingBalance.find(address) != mapBalance.end()))
-                        {
-                               mapStartingBalance.erase(address);
-                               mapStartingBlock.erase(address);
-                        }
+                        mapStartingBalance.erase(address);
+                        mapStartingBlock.erase(address);
                   }
              }
         }
@@ -1815,53 +2019,32 @@ Value getturboredemption(const Array& params, bool fHelp)
     // test to make sure turbo hasn't ended yet (maybe not synced, etc)
     while ((pindex->pnext != NULL) && (pindex->nTime <= nTurboEndTime))
     {
-        CBlock block;
-        block.ReadFromDisk(pindex, true);
+        std::vector<CTurboAddressEvent> vEvent;
+        GetTurboAddressEvents(txdb, pindex, setTurboAddress, pmapIndexed, vEvent);
         // disqualify senders
-        for (std::vector<CTransaction>::iterator ptx = block.vtx.begin();
-                                                             ptx != block.vtx.end(); ++ptx)
+        BOOST_FOREACH(const CTurboAddressEvent& event, vEvent)
         {
              // sends will not be subtracted for purposes of the guarantee
-             for (std::vector<CTxIn>::iterator pin = ptx->vin.begin();
-                                                             pin != ptx->vin.end(); ++pin)
+             if (!event.fSpending)
+                  continue;
+             const CBitcoinAddress& address = event.address;
+             if ((mapDisqualified.find(address) == mapDisqualified.end()) &&
+                 (mapStartingBalance.find(address) != mapStartingBalance.end()))
              {
-                  CTransaction txPrev;
-                  CTxIndex txindex;
-                  if (!txPrev.ReadFromDisk(txdb, pin->prevout, txindex))
-                  {
-                        if (fDebug)
-                        {
-                            printf("getturboguarantees: could not read txin from disk\n");
-                        }
-                        continue;  // previous transaction not in main chain?
-                  }
-                  CTxDestination destaddr;
-                  if (!ExtractDestination(txPrev.vout[pin->prevout.n].scriptPubKey, destaddr))
-                  {
-                        if (fDebug)
-                        {
-                            printf("getturboguarantees: could not extract address for prev out\n");
-                        }
-                        continue;
-                  }
-                  CBitcoinAddress address = CBitcoinAddress(destaddr);
-                  if ((mapDisqualified.find(address) == mapDisqualified.end()) &&
-                      (mapStartingBalance.find(address) != mapStartingBalance.end()))
-                  {
-                         if (!ptx->IsCoinStake())
-                         {
-                               if (fDebug)
-                               {
-                                     printf("getturboaddress: %s disqualified at tx %s\n",
-                                                                   address.ToString().c_str(),
-                                                                   ptx->GetHash().ToString().c_str());
-                               }
-                               mapDisqualified[address] = ptx->GetHash();
-                         }
-                  }
+                    if (!event.fCoinStake)
+                    {
+                          if (fDebug)
+                          {
+                                printf("getturboaddress: %s disqualified at tx %s\n",
+                                                              address.ToString().c_str(),
+                                                              event.hashTx.ToString().c_str());
+                          }
+                          mapDisqualified[address] = event.hashTx;
+                    }
              }
         }
-        CBitcoinAddress address = mapTurboAddress[*pindex->phashBlock];
+        CBitcoinAddress address;
+        GetTurboStakeSigner(pindex, address);
         // keep track of disqualified addresses
         mapBalance[address] += pindex->nMint;
         pindex = pindex->pnext;
@@ -1949,16 +2132,18 @@ Value getturbo(const Array& params, bool fHelp)
     Array heights;
     Array turbos;
 
-    CBlockIndex *pindex = GetLastTurboIndex();
+    EnsureTurboIndexReady();
 
-    while (pindex->pprev != NULL)
+    CKeyID keyID;
+    if (address.GetKeyID(keyID))
     {
-        map<uint256, CBitcoinAddress>::iterator it = mapTurboAddress.find(*pindex->phashBlock);
-        if ((it != mapTurboAddress.end()) && (it->second == address)) {
-             heights.insert(heights.begin(), pindex->nHeight);
-             turbos.insert(turbos.begin(), GetTurboStakeMultiplier(address, pindex->nStakeTime, pindex->pprev));
+        vector<CTurboStake> vStake;
+        turboIndex.GetStakes(keyID, nTurboEndTime, vStake);
+        BOOST_FOREACH(const CTurboStake& stake, vStake)
+        {
+             heights.push_back(stake.nHeight);
+             turbos.push_back(stake.nMultiplier);
         }
-        pindex = pindex->pprev;
     }
 
     ret.push_back(heights);
@@ -2251,6 +2436,8 @@ Value validateaddress(const Array& params, bool fHelp)
     ret.push_back(Pair("isvalid", isValid));
     if (isValid)
     {
+        // dispatched without cs_main, only the wallet is looked at
+        LOCK(pwalletMain->cs_wallet);
         CTxDestination dest = address.Get();
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
@@ -2799,6 +2986,7 @@ Value scanforalltxns(const Array& params, bool fHelp)
 
     if (nFromHeight > 0)
     {
+        LOCK(cs_main);
         pindex = mapBlockIndex[hashBestChain];
         while (pindex->nHeight > nFromHeight
             && pindex->pprev)
@@ -2813,13 +3001,14 @@ Value scanforalltxns(const Array& params, bool fHelp)
 
         printf("scanforalltxns(): 1. marking dirty\n");
         pwalletMain->MarkDirty();
-
-        printf("scanforalltxns(): 2. scanning for wallet transactions\n");
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        printf("scanforalltxns(): 3. reaccepting wallet transactions\n");
-        pwalletMain->ReacceptWalletTransactions();
     }
 
+    // -- the scan takes the locks a batch of blocks at a time
+    printf("scanforalltxns(): 2. scanning for wallet transactions\n");
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    printf("scanforalltxns(): 3. reaccepting wallet transactions\n");
+    pwalletMain->ReacceptWalletTransactions();
+
     result.push_back(Pair("result", "Scan complete."));
 
     return result;
@@ -2833,8 +3022,6 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
             "Scan blockchain for owned stealth transactions.");
 
     Object result;
-    uint32_t nBlocks = 0;
-    uint32_t nTransactions = 0;
     int32_t nFromHeight = 0;
 
     CBlockIndex *pindex = pindexGenesisBlock;
@@ -2846,6 +3033,7 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
 
     if (nFromHeight > 0)
     {
+        LOCK(cs_main);
         pindex = mapBlockIndex[hashBestChain];
         while (pindex->nHeight > nFromHeight
             && pindex->pprev)
@@ -2855,37 +3043,35 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
 
-    // -- locks in AddToWalletIfInvolvingMe
+    // -- locks in ScanForWalletTransactions
 
     bool fUpdate = true; // todo: option?
 
-    pwalletMain->nStealth = 0;
-    pwalletMain->nFoundStealth = 0;
-
-    while (pindex)
+    uint32_t nBlocks;
     {
-        nBlocks++;
-        CBlock block;
-        block.ReadFromDisk(pindex, true);
-
-        BOOST_FOREACH(CTransaction& tx, block.vtx)
-        {
-            if (!tx.IsStandard())
-                continue; // leave out coinbase and others
-            nTransactions++;
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->nStealth = 0;
+        pwalletMain->nFoundStealth = 0;
+        nBlocks = nBestHeight - pindex->nHeight + 1;
+    }
 
-            pwalletMain->AddToWalletIfInvolvingMe(tx, &block, fUpdate);
-        };
+    // imported stealth addresses do not move the wallet birthday, so
+    // blocks older than the first key are scanned as well
+    pwalletMain->ScanForWalletTransactions(pindex, fUpdate, NULL, false);
 
-        pindex = pindex->pnext;
-    };
+    uint32_t nStealth, nFoundStealth;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        nStealth = pwalletMain->nStealth;
+        nFoundStealth = pwalletMain->nFoundStealth;
+    }
 
-    printf("Scanned %u blocks, %u transactions\n", nBlocks, nTransactions);
-    printf("Found %u stealth transactions in blockchain.\n", pwalletMain->nStealth);
-    printf("Found %u new owned stealth transactions.\n", pwalletMain->nFoundStealth);
+    printf("Scanned %u blocks\n", nBlocks);
+    printf("Found %u stealth transactions in blockchain.\n", nStealth);
+    printf("Found %u new owned stealth transactions.\n", nFoundStealth);
 
     char cbuf[256];
-    snprintf(cbuf, sizeof(cbuf), "%u new stealth transactions.", pwalletMain->nFoundStealth);
+    snprintf(cbuf, sizeof(cbuf), "%u new stealth transactions.", nFoundStealth);
 
     result.push_back(Pair("result", "Scan complete."));
     result.push_back(Pair("found", std::string(cbuf)));
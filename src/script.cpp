@@ -4,8 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -1196,64 +1196,175 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted hashes of (signature hash, signature, public key) in a
+// table of fixed size. An entry lives in one of two buckets of WAYS slots,
+// picked from its hash, and each bucket is guarded by one of STRIPES locks,
+// so script check threads rarely wait on each other.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    enum { WAYS = 4, STRIPES = 64 };
 
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    struct CStripe
     {
-        LOCK(cs_sigcache);
+        CCriticalSection cs;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEntries;
+    };
+
+    unsigned char pchSalt[32];
+    std::vector<uint256> vEntry; // 0 = empty slot
+    unsigned int nBuckets;
+    CStripe stripes[STRIPES];
+
+    uint256 GetEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+    {
+        // lengths go in too, so moving bytes between signature and key changes the entry
+        unsigned int nSigSize = vchSig.size();
+        unsigned int nKeySize = pubKey.size();
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, pchSalt, sizeof(pchSalt));
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+        if (nSigSize)
+            SHA256_Update(&ctx, &vchSig[0], nSigSize);
+        SHA256_Update(&ctx, &nKeySize, sizeof(nKeySize));
+        if (nKeySize)
+            SHA256_Update(&ctx, &pubKey[0], nKeySize);
+        uint256 entry;
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        if (entry == 0)
+            entry = 1;
+        return entry;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    bool Contains(unsigned int nBucket, const uint256& entry)
+    {
+        for (unsigned int i = nBucket * WAYS; i < (nBucket + 1) * WAYS; i++)
+            if (vEntry[i] == entry)
+                return true;
+        return false;
+    }
+
+    // Stores entry in an empty slot of the bucket, returns false if it is full
+    bool Insert(unsigned int nBucket, const uint256& entry)
+    {
+        for (unsigned int i = nBucket * WAYS; i < (nBucket + 1) * WAYS; i++)
+        {
+            if (vEntry[i] == entry)
+                return true;
+            if (vEntry[i] == 0)
+            {
+                vEntry[i] = entry;
+                stripes[nBucket % STRIPES].nEntries++;
+                return true;
+            }
+        }
         return false;
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+public:
+    CSignatureCache()
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        nBuckets = 0;
+        for (int i = 0; i < STRIPES; i++)
+            stripes[i].nHits = stripes[i].nMisses = stripes[i].nEntries = 0;
+    }
 
-        LOCK(cs_sigcache);
+    // Not thread safe, call before any signatures are checked
+    void Setup(int64_t nBytes)
+    {
+        RAND_bytes(pchSalt, sizeof(pchSalt));
+        nBuckets = std::max((int64_t)0, nBytes) / (sizeof(uint256) * WAYS);
+        vEntry.assign(nBuckets * WAYS, 0);
+        for (int i = 0; i < STRIPES; i++)
+            stripes[i].nEntries = 0;
+    }
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    {
+        if (nBuckets == 0)
+            return false;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket1 = entry.Get64(0) % nBuckets;
+        unsigned int nBucket2 = entry.Get64(1) % nBuckets;
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            CStripe& stripe = stripes[nBucket1 % STRIPES];
+            LOCK(stripe.cs);
+            if (Contains(nBucket1, entry))
+            {
+                stripe.nHits++;
+                return true;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        CStripe& stripe = stripes[nBucket2 % STRIPES];
+        LOCK(stripe.cs);
+        bool fFound = Contains(nBucket2, entry);
+        if (fFound)
+            stripe.nHits++;
+        else
+            stripe.nMisses++;
+        return fFound;
+    }
+
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    {
+        if (nBuckets == 0)
+            return;
+
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int nBucket1 = entry.Get64(0) % nBuckets;
+        unsigned int nBucket2 = entry.Get64(1) % nBuckets;
+        {
+            LOCK(stripes[nBucket1 % STRIPES].cs);
+            if (Insert(nBucket1, entry))
+                return;
+        }
+
+        // Both buckets full: overwrite a slot of the second one. The slot
+        // comes from the salted entry, which helps foil would-be DoS
+        // attackers who might try to pre-generate and re-use a set of
+        // valid signatures just-slightly-greater than our cache size.
+        LOCK(stripes[nBucket2 % STRIPES].cs);
+        if (!Insert(nBucket2, entry))
+            vEntry[nBucket2 * WAYS + entry.Get64(2) % WAYS] = entry;
+    }
+
+    void GetStats(uint64_t& nEntries, uint64_t& nCapacity, uint64_t& nHits, uint64_t& nMisses)
+    {
+        nEntries = nHits = nMisses = 0;
+        nCapacity = vEntry.size();
+        for (int i = 0; i < STRIPES; i++)
+        {
+            LOCK(stripes[i].cs);
+            nEntries += stripes[i].nEntries;
+            nHits += stripes[i].nHits;
+            nMisses += stripes[i].nMisses;
+        }
     }
 };
 
+static CSignatureCache signatureCache;
+
+void InitSignatureCache(int64_t nBytes)
+{
+    signatureCache.Setup(nBytes);
+}
+
+void GetSignatureCacheStats(uint64_t& nEntries, uint64_t& nCapacity, uint64_t& nHits, uint64_t& nMisses)
+{
+    signatureCache.GetStats(nEntries, nCapacity, nHits, nMisses);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1268,11 +1379,7 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(vchPubKey).Verify(sighash, vchSig))
         return false;
 
     signatureCache.Set(sighash, vchSig, vchPubKey);
@@ -1753,6 +1860,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
+    txTo.InvalidateHash();
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
         return false;
 
@@ -612,6 +612,10 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+// Sizes the valid signature cache, call once at startup
+void InitSignatureCache(int64_t nBytes);
+void GetSignatureCacheStats(uint64_t& nEntries, uint64_t& nCapacity, uint64_t& nHits, uint64_t& nMisses);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -705,6 +705,8 @@ struct ser_streamplaceholder
 
 
 
+typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -791,6 +793,27 @@ public:
         return (std::string(begin(), end()));
     }
 
+    // Exchanges contents and state with b without copying the data
+    void swap(CDataStream& b)
+    {
+        vch.swap(b.vch);
+        std::swap(nReadPos, b.nReadPos);
+        std::swap(state, b.state);
+        std::swap(exceptmask, b.exceptmask);
+        std::swap(nType, b.nType);
+        std::swap(nVersion, b.nVersion);
+    }
+
+    // Moves the unread data into data and leaves the stream empty
+    void GetAndClear(CSerializeData& data)
+    {
+        if (nReadPos > 0)
+            vch.erase(vch.begin(), vch.begin() + nReadPos);
+        nReadPos = 0;
+        data.clear();
+        vch.swap(data);
+    }
+
 
     //
     // Vector subset
@@ -11,6 +11,7 @@ Notes:
         -nosmsg             Disable secure messaging (fNoSmsg)
         -debugsmsg          Show extra debug messages (fDebugSmsg)
         -smsgscanchain      Scan the block chain for public key addresses on startup
+        -smsgthreads        Threads for proof of work and recipient matching (0 = one per core)
     
     
     Wallet Locked
@@ -19,6 +20,13 @@ Notes:
         When the wallet is unlocked all the messages in wl files are scanned.
     
     
+    Bucket Files
+        Messages of a bucket are appended to time_01.dat, continuing in time_02.dat... past SMSG_MAX_FILE_BYTES
+        Each bucket file has a time_nn.idx sidecar of (timestamp, sample, offset, size) records,
+        startup loads the token sets from these and only rescans a bucket file whose index does not cover it
+        Messages requested by peers are copied out of a read only mapping of the bucket file
+    
+    
     Address Whitelist
         Owned Addresses are stored in smsgAddresses vector
         Saved to smsg.ini
@@ -44,6 +52,12 @@ Notes:
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 
@@ -79,6 +93,10 @@ boost::signals2::signal<void ()> NotifySecMsgWalletUnlocked;
 
 bool fSecMsgEnabled = false;
 
+uint64_t nSmsgScanned = 0;
+uint64_t nSmsgDecryptAttempts = 0;
+uint64_t nSmsgMatches = 0;
+
 std::map<int64_t, SecMsgBucket> smsgBuckets;
 std::vector<SecMsgAddress>      smsgAddresses;
 SecMsgOptions                   smsgOptions;
@@ -95,6 +113,73 @@ leveldb::DB *smsgDB = NULL;
 
 namespace fs = boost::filesystem;
 
+static int SecureMsgThreads()
+{
+    // -- -smsgthreads=0 means autodetect, <0 leaves that many cores free
+    int nThreads = GetArg("-smsgthreads", 0);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    return std::max(1, std::min(nThreads, SMSG_MAX_THREADS));
+};
+
+class SecMsgRecvKey
+{
+// -- private key of a receiving address, cached while the wallet is unlocked
+public:
+    std::string     sAddress;
+    bool            fReceiveAnon;
+    CKey            key;
+};
+
+// -- under cs_smsg, cleared when smsgAddresses changes or the wallet locks
+static std::vector<SecMsgRecvKey> smsgRecvKeys;
+static bool fSmsgRecvKeysLoaded = false;
+
+static void SecureMsgClearRecvKeys()
+{
+    LOCK(cs_smsg);
+    smsgRecvKeys.clear();
+    fSmsgRecvKeysLoaded = false;
+};
+
+static bool SecureMsgLoadRecvKeys()
+{
+    // -- cs_smsg must be held
+    if (fSmsgRecvKeysLoaded)
+        return true;
+    
+    if (pwalletMain->IsLocked())
+        return false;
+    
+    smsgRecvKeys.clear();
+    smsgRecvKeys.reserve(smsgAddresses.size());
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
+        
+        CBitcoinAddress coinAddress(it->sAddress);
+        CKeyID ckid;
+        CKey key;
+        if (!coinAddress.GetKeyID(ckid)
+            || !pwalletMain->GetKey(ckid, key))
+            continue;
+        
+        smsgRecvKeys.push_back(SecMsgRecvKey());
+        SecMsgRecvKey& recvKey = smsgRecvKeys.back();
+        recvKey.sAddress = coinAddress.ToString();
+        recvKey.fReceiveAnon = it->fReceiveAnon;
+        recvKey.key = key;
+        ECDH_set_method(recvKey.key.GetECKey(), ECDH_OpenSSL());
+    };
+    
+    if (fDebugSmsg)
+        printf("Cached %"PRIszu" receiving keys.\n", smsgRecvKeys.size());
+    
+    fSmsgRecvKeysLoaded = true;
+    return true;
+};
+
 bool SecMsgCrypter::SetKey(const std::vector<unsigned char>& vchNewKey, unsigned char* chNewIV)
 {
     
@@ -196,6 +281,250 @@ void SecMsgBucket::hashBucket()
 };
 
 
+static fs::path SecureMsgBucketPath(int64_t bucket, uint32_t nFile, const char* pszExt)
+{
+    return GetDataDir() / "smsgStore" / strprintf("%"PRId64"_%02u%s", bucket, nFile, pszExt);
+};
+
+static bool SecureMsgReadIndex(const fs::path& pathIdx, uint64_t nFileSize, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    /*  Read the index of a bucket file.
+        
+        The index is only used if its records run back to back from the
+        start of the bucket file to its end, otherwise the caller rescans.
+    */
+    vRecords.clear();
+    
+    if (!fs::exists(pathIdx))
+        return false;
+    
+    uint64_t nIdxSize = fs::file_size(pathIdx);
+    if (nIdxSize % sizeof(SecMsgIndexRecord) != 0)
+        return false;
+    
+    FILE *fp;
+    if (!(fp = fopen(pathIdx.string().c_str(), "rb")))
+        return false;
+    
+    vRecords.resize(nIdxSize / sizeof(SecMsgIndexRecord));
+    if (vRecords.size() > 0
+        && fread(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+    {
+        fclose(fp);
+        vRecords.clear();
+        return false;
+    };
+    fclose(fp);
+    
+    uint64_t nNext = 0;
+    std::vector<SecMsgIndexRecord>::iterator it;
+    for (it = vRecords.begin(); it != vRecords.end(); ++it)
+    {
+        if ((uint64_t)it->offset != nNext)
+            break;
+        nNext += SMSG_HDR_LEN + it->nPayload;
+    };
+    
+    if (it != vRecords.end()
+        || nNext != nFileSize)
+    {
+        vRecords.clear();
+        return false;
+    };
+    
+    return true;
+};
+
+static bool SecureMsgWriteIndex(const fs::path& pathIdx, const std::vector<SecMsgIndexRecord>& vRecords)
+{
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathIdx.string().c_str(), "wb")))
+    {
+        printf("Error opening index file: %s\n", strerror(errno));
+        return false;
+    };
+    
+    if (vRecords.size() > 0
+        && fwrite(&vRecords[0], sizeof(SecMsgIndexRecord), vRecords.size(), fp) != vRecords.size())
+    {
+        printf("fwrite index failed: %s\n", strerror(errno));
+        fclose(fp);
+        return false;
+    };
+    
+    fclose(fp);
+    return true;
+};
+
+static bool SecureMsgScanBucketFile(const fs::path& pathDat, std::vector<SecMsgIndexRecord>& vRecords)
+{
+    // -- walk a bucket file message by message, for a missing or stale index
+    vRecords.clear();
+    
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(pathDat.string().c_str(), "rb")))
+    {
+        printf("Error opening file: %s\n", strerror(errno));
+        return false;
+    };
+    
+    SecureMessage smsg;
+    for (;;)
+    {
+        SecMsgIndexRecord record;
+        record.offset = ftell(fp);
+        errno = 0;
+        if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
+        {
+            if (errno != 0)
+                printf("fread header failed: %s\n", strerror(errno));
+            break;
+        };
+        record.timestamp = smsg.timestamp;
+        record.nPayload = smsg.nPayload;
+        
+        memset(record.sample, 0, 8);
+        uint32_t nSkip = smsg.nPayload;
+        if (smsg.nPayload >= 8)
+        {
+            if (fread(record.sample, sizeof(unsigned char), 8, fp) != 8)
+            {
+                printf("fread data failed: %s\n", strerror(errno));
+                break;
+            };
+            nSkip -= 8;
+        };
+        
+        if (fseek(fp, nSkip, SEEK_CUR) != 0)
+        {
+            printf("fseek, strerror: %s.\n", strerror(errno));
+            break;
+        };
+        
+        vRecords.push_back(record);
+    };
+    
+    fclose(fp);
+    return true;
+};
+
+static void SecureMsgRemoveBucketFile(const fs::path& pathDat)
+{
+    // -- remove a bucket file and its index
+    fs::path pathIdx = pathDat;
+    pathIdx.replace_extension(".idx");
+    try {
+        if (fs::exists(pathDat))
+            fs::remove(pathDat);
+        if (fs::exists(pathIdx))
+            fs::remove(pathIdx);
+    } catch (const fs::filesystem_error& ex)
+    {
+        printf("Error removing bucket file %s.\n", ex.what());
+    };
+};
+
+class SecMsgMappedFile
+{
+// -- read only mapping of a bucket file, mapped again once the file has grown past it
+public:
+    SecMsgMappedFile()
+    {
+        pBegin = NULL;
+        nSize = 0;
+    };
+    
+    unsigned char*  pBegin;
+    size_t          nSize;
+};
+
+// -- under cs_smsg, by bucket and file number
+static std::map<std::pair<int64_t, uint32_t>, SecMsgMappedFile> smsgMappedFiles;
+
+static void SecureMsgUnmapFile(SecMsgMappedFile& mapped)
+{
+#ifndef WIN32
+    if (mapped.pBegin)
+        munmap(mapped.pBegin, mapped.nSize);
+#endif
+    mapped.pBegin = NULL;
+    mapped.nSize = 0;
+};
+
+static void SecureMsgUnmapBucket(int64_t bucket)
+{
+    // -- cs_smsg must be held
+    std::map<std::pair<int64_t, uint32_t>, SecMsgMappedFile>::iterator it;
+    it = smsgMappedFiles.lower_bound(std::make_pair(bucket, (uint32_t)0));
+    while (it != smsgMappedFiles.end() && it->first.first == bucket)
+    {
+        SecureMsgUnmapFile(it->second);
+        smsgMappedFiles.erase(it++);
+    };
+};
+
+void SecureMsgUnmapBuckets()
+{
+    LOCK(cs_smsg);
+    std::map<std::pair<int64_t, uint32_t>, SecMsgMappedFile>::iterator it;
+    for (it = smsgMappedFiles.begin(); it != smsgMappedFiles.end(); ++it)
+        SecureMsgUnmapFile(it->second);
+    smsgMappedFiles.clear();
+};
+
+static const unsigned char* SecureMsgMapBucketFile(int64_t bucket, uint32_t nFile, uint64_t nNeed)
+{
+    /*  Map a bucket file, making sure the first nNeed bytes are in the mapping.
+        
+        cs_smsg must be held, the pointer is only valid while it is.
+        returns NULL if the file can not be mapped, the caller falls back to reading it.
+    */
+#ifdef WIN32
+    return NULL;
+#else
+    std::pair<int64_t, uint32_t> key = std::make_pair(bucket, nFile);
+    SecMsgMappedFile& mapped = smsgMappedFiles[key];
+    if (mapped.pBegin && mapped.nSize >= nNeed)
+        return mapped.pBegin;
+    
+    SecureMsgUnmapFile(mapped);
+    
+    fs::path fullpath = SecureMsgBucketPath(bucket, nFile, ".dat");
+    int fd = open(fullpath.string().c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        smsgMappedFiles.erase(key);
+        return NULL;
+    };
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || st.st_size == 0
+        || (uint64_t)st.st_size < nNeed)
+    {
+        close(fd);
+        smsgMappedFiles.erase(key);
+        return NULL;
+    };
+    
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        printf("mmap of %s failed: %s\n", fullpath.string().c_str(), strerror(errno));
+        smsgMappedFiles.erase(key);
+        return NULL;
+    };
+    
+    mapped.pBegin = (unsigned char*) p;
+    mapped.nSize = st.st_size;
+    return mapped.pBegin;
+#endif
+};
+
+
 bool SecMsgDB::Open(const char* pszMode)
 {
     if (smsgDB)
@@ -628,22 +957,13 @@ void ThreadSecureMsg(void* parg)
                 {
                     if (fDebugSmsg)
                         printf("Removing bucket %"PRId64" \n", it->first);
-                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01.dat";
-                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
-                    if (fs::exists(fullPath))
-                    {
-                        try {
-                            fs::remove(fullPath);
-                        } catch (const fs::filesystem_error& ex)
-                        {
-                            printf("Error removing bucket file %s.\n", ex.what());
-                        };
-                    } else
-                        printf("Path %s does not exist \n", fullPath.string().c_str());
+                    SecureMsgUnmapBucket(it->first);
+                    for (uint32_t nFile = 1; nFile <= it->second.nFileLast; nFile++)
+                        SecureMsgRemoveBucketFile(SecureMsgBucketPath(it->first, nFile, ".dat"));
                     
                     // -- look for a wl file, it stores incoming messages when wallet is locked
-                    fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
-                    fullPath = GetDataDir() / "smsgStore" / fileName;
+                    std::string fileName = boost::lexical_cast<std::string>(it->first) + "_01_wl.dat";
+                    fs::path fullPath = GetDataDir() / "smsgStore" / fileName;
                     if (fs::exists(fullPath))
                     {
                         try {
@@ -861,7 +1181,6 @@ int SecureMsgBuildBucketSet()
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
         // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
@@ -874,12 +1193,7 @@ int SecureMsgBuildBucketSet()
         if (fileTime < now - SMSG_RETENTION)
         {
             printf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
+            SecureMsgRemoveBucketFile((*itd).path());
             continue;
         };
         
@@ -891,57 +1205,45 @@ int SecureMsgBuildBucketSet()
         };
         
         
-        SecureMessage smsg;
+        uint32_t nFile = 1;
+        size_t sepExt = fileName.find_first_of("._", sep + 1);
+        if (sepExt != std::string::npos)
+            nFile = atoi(fileName.substr(sep + 1, sepExt - sep - 1).c_str());
+        if (nFile < 1)
+            continue;
+        
+        // -- load the index, rebuild it if it does not cover the file
+        std::vector<SecMsgIndexRecord> vRecords;
+        fs::path pathIdx = (*itd).path();
+        pathIdx.replace_extension(".idx");
+        if (!SecureMsgReadIndex(pathIdx, fs::file_size((*itd).path()), vRecords))
+        {
+            if (fDebugSmsg)
+                printf("Rebuilding index of %s.\n", fileName.c_str());
+            if (!SecureMsgScanBucketFile((*itd).path(), vRecords))
+                continue;
+            SecureMsgWriteIndex(pathIdx, vRecords);
+        };
+        
         std::set<SecMsgToken>& tokenSet = smsgBuckets[fileTime].setTokens;
         
         {
             LOCK(cs_smsg);
-            FILE *fp;
-            
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                printf("Error opening file: %s\n", strerror(errno));
-                continue;
-            };
-            
-            for (;;)
+            for (std::vector<SecMsgIndexRecord>::iterator it = vRecords.begin(); it != vRecords.end(); ++it)
             {
-                long int ofs = ftell(fp);
-                SecMsgToken token;
-                token.offset = ofs;
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        printf("fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //printf("End of file.\n");
-                    };
-                    break;
-                };
-                token.timestamp = smsg.timestamp;
-                
-                if (smsg.nPayload < 8)
+                if (it->nPayload < 8)
                     continue;
                 
-                if (fread(token.sample, sizeof(unsigned char), 8, fp) != 8)
-                {
-                    printf("fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-                
-                if (fseek(fp, smsg.nPayload-8, SEEK_CUR) != 0)
-                {
-                    printf("fseek, strerror: %s.\n", strerror(errno));
-                    break;
-                };
-                
+                SecMsgToken token;
+                token.timestamp = it->timestamp;
+                memcpy(token.sample, it->sample, 8);
+                token.offset = it->offset;
+                token.nFile = nFile;
                 tokenSet.insert(token);
             };
             
-            fclose(fp);
+            if (nFile > smsgBuckets[fileTime].nFileLast)
+                smsgBuckets[fileTime].nFileLast = nFile;
         };
         smsgBuckets[fileTime].hashBucket();
         
@@ -998,6 +1300,9 @@ int SecureMsgAddWalletAddresses()
     if (fDebugSmsg)
         printf("Added %u addresses to whitelist.\n", nAdded);
     
+    if (nAdded > 0)
+        SecureMsgClearRecvKeys();
+    
     return 0;
 };
 
@@ -1066,6 +1371,7 @@ int SecureMsgReadIni()
     };
     
     printf("Loaded %"PRIszu" addresses.\n", smsgAddresses.size());
+    SecureMsgClearRecvKeys();
     
     fclose(fp);
     
@@ -1197,6 +1503,8 @@ bool SecureMsgShutdown()
     
     fSecMsgEnabled = false;
     
+    SecureMsgUnmapBuckets();
+    
     if (smsgDB)
     {
         LOCK(cs_smsgDB);
@@ -1288,6 +1596,7 @@ bool SecureMsgDisable()
             it->second.setTokens.clear();
         };
         smsgBuckets.clear();
+        SecureMsgUnmapBuckets();
         
         // -- tell each smsg enabled peer that this node is disabling
         {
@@ -1306,6 +1615,7 @@ bool SecureMsgDisable()
             printf("Failed to save smsg.ini\n");
         
         smsgAddresses.clear();
+        SecureMsgClearRecvKeys();
         
     }; // LOCK(cs_smsg);
     
@@ -2217,7 +2527,6 @@ bool SecureMsgScanBuckets()
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
         // time_noFile.dat
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
@@ -2230,12 +2539,7 @@ bool SecureMsgScanBuckets()
         if (fileTime < now - SMSG_RETENTION)
         {
             printf("Dropping file %s, expired.\n", fileName.c_str());
-            try {
-                fs::remove((*itd).path());
-            } catch (const fs::filesystem_error& ex)
-            {
-                printf("Error removing bucket file %s, %s.\n", fileName.c_str(), ex.what());
-            };
+            SecureMsgRemoveBucketFile((*itd).path());
             continue;
         };
         
@@ -2371,8 +2675,7 @@ int SecureMsgWalletUnlocked()
         
         nFiles++;
         
-        // TODO files must be split if > 2GB
-        // time_noFile_wl.dat
+        // time_noFile_wl.dat, read front to back so no offsets are kept
         size_t sep = fileName.find_first_of("_");
         if (sep == std::string::npos)
             continue;
@@ -2472,6 +2775,14 @@ int SecureMsgWalletUnlocked()
 
 #endif
 
+void SecureMsgWalletLocked()
+{
+    /*
+    Drop the cached receiving keys, the next scan after unlocking loads them again.
+    */
+    SecureMsgClearRecvKeys();
+};
+
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode)
 {
     if (!fSecMsgEnabled)
@@ -2501,6 +2812,7 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
             default:
                 break;
         }
+        SecureMsgClearRecvKeys();
         
     }; // LOCK(cs_smsg);
     
@@ -2510,6 +2822,85 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
 
 #ifdef SECURE_MESSAGING
 
+static bool SecureMsgMatchKey(CKey& keyDest, const EC_POINT* pR, SecureMessage* psmsg, unsigned char *pPayload, uint32_t nPayload)
+{
+    /*  The MAC check of SecureMsgDecrypt without the decrypt:
+        only the recipient's key gives the key_m the MAC was made with.
+    */
+    unsigned char P[32];
+    if (ECDH_compute_key(P, 32, pR, keyDest.GetECKey(), NULL) != 32)
+        return false;
+    
+    unsigned char H[64];
+    SHA512(P, 32, H);
+    
+    unsigned char MAC[32];
+    unsigned int nBytes = 32;
+    bool fHmacOk = true;
+    HMAC_CTX ctx;
+    HMAC_CTX_init(&ctx);
+    
+    if (!HMAC_Init_ex(&ctx, &H[32], 32, EVP_sha256(), NULL)
+        || !HMAC_Update(&ctx, (unsigned char*) &psmsg->timestamp, sizeof(psmsg->timestamp))
+        || !HMAC_Update(&ctx, pPayload, nPayload)
+        || !HMAC_Final(&ctx, MAC, &nBytes)
+        || nBytes != 32)
+        fHmacOk = false;
+    
+    HMAC_CTX_cleanup(&ctx);
+    
+    return fHmacOk && memcmp(MAC, psmsg->mac, 32) == 0;
+};
+
+class SecMsgMatchSearch
+{
+// -- recipient search shared by the lanes of SecureMsgScanMessage
+public:
+    SecMsgMatchSearch(const EC_POINT* pRIn, unsigned char *pHeaderIn, unsigned char *pPayloadIn, uint32_t nPayloadIn, int nLanesIn)
+    {
+        pR = pRIn;
+        psmsg = (SecureMessage*) pHeaderIn;
+        pPayload = pPayloadIn;
+        nPayload = nPayloadIn;
+        nLanes = nLanesIn;
+        nMatch = -1;
+        nTried = 0;
+    };
+    
+    const EC_POINT* pR;
+    SecureMessage* psmsg;
+    unsigned char* pPayload;
+    uint32_t nPayload;
+    int nLanes;
+    
+    CCriticalSection cs;
+    volatile int nMatch;
+    uint64_t nTried;
+};
+
+static void SecureMsgMatchLane(SecMsgMatchSearch* psearch, int nLane)
+{
+    // -- lane n tries cached keys n, n + nLanes... , cs_smsg is held by the caller
+    uint64_t nTried = 0;
+    for (unsigned int i = nLane; i < smsgRecvKeys.size(); i += psearch->nLanes)
+    {
+        if (psearch->nMatch >= 0)
+            break;
+        
+        nTried++;
+        if (SecureMsgMatchKey(smsgRecvKeys[i].key, psearch->pR, psearch->psmsg, psearch->pPayload, psearch->nPayload))
+        {
+            LOCK(psearch->cs);
+            if (psearch->nMatch < 0 || (int)i < psearch->nMatch)
+                psearch->nMatch = i;
+            break;
+        };
+    };
+    
+    LOCK(psearch->cs);
+    psearch->nTried += nTried;
+};
+
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui)
 {
     /* 
@@ -2545,39 +2936,70 @@ int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32
     MessageData msg; // placeholder
     bool fOwnMessage = false;
     
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    // -- R is the same for every owned key, decode it once
+    SecureMessage* psmsgIn = (SecureMessage*) pHeader;
+    if (psmsgIn->version[0] != 1)
+        return 0;
+    
+    CKey keyR;
+    std::vector<unsigned char> vchR(psmsgIn->cpkR, psmsgIn->cpkR+33);
+    CPubKey cpkR(vchR);
+    if (!cpkR.IsValid()
+        || !keyR.SetPubKey(cpkR))
     {
-        if (!it->fReceiveEnabled)
-            continue;
+        if (fDebugSmsg)
+            printf("ScanMessage: Could not set pubkey for R.\n");
+        return 0;
+    };
+    
+    {
+        LOCK(cs_smsg);
         
-        CBitcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
+        if (!SecureMsgLoadRecvKeys())
+        {
+            if (fDebugSmsg)
+                printf("ScanMessage: Could not load receiving keys.\n");
+            return 1;
+        };
         
-        if (!it->fReceiveAnon)
+        // -- a few threads when there are many keys to try
+        int nLanes = std::min(SecureMsgThreads(), (int)(smsgRecvKeys.size() / SMSG_SCAN_LANE_KEYS));
+        nLanes = std::max(1, nLanes);
+        
+        SecMsgMatchSearch search(EC_KEY_get0_public_key(keyR.GetECKey()), pHeader, pPayload, nPayload, nLanes);
+        
+        boost::thread_group lanes;
+        for (int i = 1; i < nLanes; i++)
+            lanes.create_thread(boost::bind(&SecureMsgMatchLane, &search, i));
+        SecureMsgMatchLane(&search, 0);
+        lanes.join_all();
+        
+        nSmsgScanned++;
+        nSmsgDecryptAttempts += search.nTried;
+        
+        if (search.nMatch >= 0)
         {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+            SecMsgRecvKey& recvKey = smsgRecvKeys[search.nMatch];
+            addressTo = recvKey.sAddress;
+            
+            if (!recvKey.fReceiveAnon)
             {
-                if (fDebugSmsg)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-                
-                if (msg.sFromAddress.compare("anon") != 0)
+                // -- have to do full decrypt to see address from
+                if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0
+                    && msg.sFromAddress.compare("anon") != 0)
                     fOwnMessage = true;
-                break;
-            };
-        } else
-        {
-            
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
+            } else
             {
-                if (fDebugSmsg)
-                    printf("Decrypted message with %s.\n", addressTo.c_str());
-                
                 fOwnMessage = true;
-                break;
             };
-        }
-    };
+            
+            if (fDebugSmsg)
+                printf("Matched message with %s.\n", addressTo.c_str());
+            
+            if (fOwnMessage)
+                nSmsgMatches++;
+        };
+    }; // LOCK(cs_smsg);
     
     if (fOwnMessage)
     {
@@ -2770,16 +3192,32 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData)
     
     // -- has cs_smsg lock from SecureMsgReceiveData
     
-    fs::path pathSmsgDir = GetDataDir() / "smsgStore";
-    
-    //printf("token.offset %"PRId64".\n", token.offset); // DEBUG
     int64_t bucket = token.timestamp - (token.timestamp % SMSG_BUCKET_LEN);
-    std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-    fs::path fullpath = pathSmsgDir / fileName;
     
-    //printf("bucket %"PRId64".\n", bucket);
-    //printf("bucket lld %lld.\n", bucket);
-    //printf("fileName %s.\n", fileName.c_str());
+    // -- copy straight out of the mapped bucket file
+    const unsigned char* pBegin;
+    if ((pBegin = SecureMsgMapBucketFile(bucket, token.nFile, token.offset + SMSG_HDR_LEN)) != NULL)
+    {
+        uint32_t nPayload; // last field of the header
+        memcpy(&nPayload, pBegin + token.offset + SMSG_HDR_LEN - 4, 4);
+        
+        if ((pBegin = SecureMsgMapBucketFile(bucket, token.nFile, token.offset + SMSG_HDR_LEN + nPayload)) == NULL)
+        {
+            printf("SecureMsgRetrieve(): message at %"PRId64" runs past the end of the bucket file.\n", token.offset);
+            return 1;
+        };
+        
+        try {
+            vchData.assign(pBegin + token.offset, pBegin + token.offset + SMSG_HDR_LEN + nPayload);
+        } catch (std::exception& e) {
+            printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+            return 1;
+        };
+        
+        return 0;
+    };
+    
+    fs::path fullpath = SecureMsgBucketPath(bucket, token.nFile, ".dat");
     
     FILE *fp;
     errno = 0;
@@ -2810,6 +3248,7 @@ int SecureMsgRetrieve(SecMsgToken &token, std::vector<unsigned char>& vchData)
         vchData.resize(SMSG_HDR_LEN + smsg.nPayload);
     } catch (std::exception& e) {
         printf("SecureMsgRetrieve(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + smsg.nPayload, e.what());
+        fclose(fp);
         return 1;
     };
     
@@ -3078,28 +3517,43 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
             return 1;
         };
         
-        std::string fileName = boost::lexical_cast<std::string>(bucket) + "_01.dat";
-        fs::path fullpath = pathSmsgDir / fileName;
+        SecMsgBucket& smsgBucket = smsgBuckets[bucket];
+        uint32_t nFile = smsgBucket.nFileLast;
         
         FILE *fp;
-        errno = 0;
-        if (!(fp = fopen(fullpath.string().c_str(), "ab")))
-        {
-            printf("Error opening file: %s\n", strerror(errno));
-            return 1;
-        };
-        
-        // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
-        errno = 0;
-        if (fseek(fp, 0, SEEK_END) != 0)
+        for (;;)
         {
-            printf("Error fseek failed: %s\n", strerror(errno));
-            return 1;
+            fs::path fullpath = SecureMsgBucketPath(bucket, nFile, ".dat");
+            
+            errno = 0;
+            if (!(fp = fopen(fullpath.string().c_str(), "ab")))
+            {
+                printf("Error opening file: %s\n", strerror(errno));
+                return 1;
+            };
+            
+            // -- on windows ftell will always return 0 after fopen(ab), call fseek to set.
+            errno = 0;
+            if (fseek(fp, 0, SEEK_END) != 0)
+            {
+                printf("Error fseek failed: %s\n", strerror(errno));
+                fclose(fp);
+                return 1;
+            };
+            
+            ofs = ftell(fp);
+            
+            // -- keep offsets well inside a long, continue in the next file
+            if (ofs > 0
+                && (uint64_t)ofs + SMSG_HDR_LEN + nPayload > SMSG_MAX_FILE_BYTES)
+            {
+                fclose(fp);
+                smsgBucket.nFileLast = ++nFile;
+                continue;
+            };
+            break;
         };
         
-        
-        ofs = ftell(fp);
-        
         if (fwrite(pHeader, sizeof(unsigned char), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN
             || fwrite(pPayload, sizeof(unsigned char), nPayload, fp) != nPayload)
         {
@@ -3111,6 +3565,26 @@ int SecureMsgStore(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPa
         fclose(fp);
         
         token.offset = ofs;
+        token.nFile = nFile;
+        
+        // -- a failed append leaves the index short, it is rebuilt on the next start
+        SecMsgIndexRecord record;
+        record.timestamp = token.timestamp;
+        memcpy(record.sample, token.sample, 8);
+        record.offset = ofs;
+        record.nPayload = nPayload;
+        
+        fs::path pathIdx = SecureMsgBucketPath(bucket, nFile, ".idx");
+        errno = 0;
+        if (!(fp = fopen(pathIdx.string().c_str(), "ab")))
+        {
+            printf("Error opening index file: %s\n", strerror(errno));
+        } else
+        {
+            if (fwrite(&record, sizeof(record), 1, fp) != 1)
+                printf("fwrite index failed: %s\n", strerror(errno));
+            fclose(fp);
+        };
         
         //printf("token.offset: %"PRId64"\n", token.offset); // DEBUG
         tokenSet.insert(token);
@@ -3129,6 +3603,47 @@ int SecureMsgStore(SecureMessage& smsg, bool fUpdateBucket)
     return SecureMsgStore(&smsg.hash[0], smsg.pPayload, smsg.nPayload, fUpdateBucket);
 };
   
+static void SecureMsgPowHash(const unsigned char *pHeader, const unsigned char *pPayload, uint32_t nPayload, unsigned char *sha256Hash)
+{
+    /*  HMAC-SHA256 of the header after the hash and the payload twice,
+        keyed with the nonse repeated to 32 bytes.
+        
+        The key changes with every nonse, so there is no midstate to carry
+        over, but building the pads here skips the EVP setup HMAC_Init_ex
+        does per call.
+    */
+    const SecureMessage* psmsg = (const SecureMessage*) pHeader;
+    
+    unsigned char pad[64];
+    for (int i = 0; i < 32; i++)
+        pad[i] = psmsg->nonse[i % 4] ^ 0x36;
+    memset(pad + 32, 0x36, 32);
+    
+    unsigned char innerHash[32];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, pad, 64);
+    SHA256_Update(&ctx, pHeader+4, SMSG_HDR_LEN-4);
+    SHA256_Update(&ctx, pPayload, nPayload);
+    SHA256_Update(&ctx, pPayload, nPayload);
+    SHA256_Final(innerHash, &ctx);
+    
+    for (int i = 0; i < 64; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, pad, 64);
+    SHA256_Update(&ctx, innerHash, 32);
+    SHA256_Final(sha256Hash, &ctx);
+};
+
+static bool SecureMsgPowMeetsTarget(const unsigned char *sha256Hash)
+{
+    return sha256Hash[31] == 0
+        && sha256Hash[30] == 0
+        && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) );
+};
+
 int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     /*
@@ -3148,61 +3663,107 @@ int SecureMsgValidate(unsigned char *pHeader, unsigned char *pPayload, uint32_t
     if (nPayload > SMSG_MAX_MSG_WORST)
         return 5;
     
-    unsigned char civ[32];
     unsigned char sha256Hash[32];
     int rv = 2; // invalid
     
-    uint32_t nonse;
-    memcpy(&nonse, &psmsg->nonse[0], 4);
-    
     if (fDebugSmsg)
+    {
+        uint32_t nonse;
+        memcpy(&nonse, &psmsg->nonse[0], 4);
         printf("SecureMsgValidate() nonse %u.\n", nonse);
+    };
     
-    for (int i = 0; i < 32; i+=4)
-        memcpy(civ+i, &nonse, 4);
-    
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
+    SecureMsgPowHash(pHeader, pPayload, nPayload, sha256Hash);
     
-    unsigned int nBytes;
-    if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (unsigned char*) pHeader+4, SMSG_HDR_LEN-4)
-        || !HMAC_Update(&ctx, (unsigned char*) pPayload, nPayload)
-        || !HMAC_Update(&ctx, pPayload, nPayload)
-        || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-        || nBytes != 32)
+    if (SecureMsgPowMeetsTarget(sha256Hash))
     {
         if (fDebugSmsg)
-            printf("HMAC error.\n");
-        rv = 1; // error
-    } else
+            printf("Hash Valid.\n");
+        rv = 0; // smsg is valid
+    };
+    
+    if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
     {
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) ))
-        {
-            if (fDebugSmsg)
-                printf("Hash Valid.\n");
-            rv = 0; // smsg is valid
-        };
-        
-        if (memcmp(psmsg->hash, sha256Hash, 4) != 0)
-        {
-             if (fDebugSmsg)
-                printf("Checksum mismatch.\n");
-            rv = 3; // checksum mismatch
-        }
+         if (fDebugSmsg)
+            printf("Checksum mismatch.\n");
+        rv = 3; // checksum mismatch
     }
-    HMAC_CTX_cleanup(&ctx);
     
     return rv;
 };
 
+class SecMsgPowSearch
+{
+// -- nonse search shared by the lanes of SecureMsgSetHash
+public:
+    SecMsgPowSearch(const unsigned char *pHeaderIn, const unsigned char *pPayloadIn, uint32_t nPayloadIn, int nLanesIn)
+    {
+        pHeader = pHeaderIn;
+        pPayload = pPayloadIn;
+        nPayload = nPayloadIn;
+        nLanes = nLanesIn;
+        fFound = false;
+        nonse = 0;
+        nTried = 0;
+    };
+    
+    const unsigned char* pHeader;
+    const unsigned char* pPayload;
+    uint32_t nPayload;
+    int nLanes;
+    
+    CCriticalSection cs;
+    volatile bool fFound;
+    uint32_t nonse;
+    unsigned char hash[4];
+    uint64_t nTried;
+};
+
+static void SecureMsgPowLane(SecMsgPowSearch* psearch, int nLane)
+{
+    // -- lane n tries nonse n, n + nLanes, n + 2 * nLanes...
+    unsigned char header[SMSG_HDR_LEN];
+    memcpy(header, psearch->pHeader, SMSG_HDR_LEN);
+    SecureMessage* psmsg = (SecureMessage*) header;
+    
+    unsigned char sha256Hash[32];
+    uint64_t nTried = 0;
+    
+    for (uint64_t n = nLane; n <= 4294967295U; n += psearch->nLanes)
+    {
+        if (psearch->fFound || !fSecMsgEnabled)
+            break;
+        
+        uint32_t nonse = (uint32_t) n;
+        memcpy(&psmsg->nonse[0], &nonse, 4);
+        
+        SecureMsgPowHash(header, psearch->pPayload, psearch->nPayload, sha256Hash);
+        nTried++;
+        
+        if (SecureMsgPowMeetsTarget(sha256Hash))
+        {
+            LOCK(psearch->cs);
+            // -- keep the smallest nonse of the lanes that hit together
+            if (!psearch->fFound || nonse < psearch->nonse)
+            {
+                psearch->nonse = nonse;
+                memcpy(psearch->hash, sha256Hash, 4);
+            };
+            psearch->fFound = true;
+            break;
+        };
+    };
+    
+    LOCK(psearch->cs);
+    psearch->nTried += nTried;
+};
+
 int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload)
 {
     /*  proof of work and checksum
         
         May run in a thread, if shutdown detected, return.
+        The nonse space is split over -smsgthreads lanes, each on its own thread.
         
         returns:
             0 success
@@ -3214,77 +3775,16 @@ int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t n
     SecureMessage* psmsg = (SecureMessage*) pHeader;
     
     int64_t nStart = GetTimeMillis();
-    unsigned char civ[32];
-    unsigned char sha256Hash[32];
     
-    //std::vector<unsigned char> vchHash;
-    //vchHash.resize(32);
+    int nLanes = SecureMsgThreads();
     
-    bool found = false;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
+    SecMsgPowSearch search(pHeader, pPayload, nPayload, nLanes);
     
-    uint32_t nonse = 0;
-    
-    //CBigNum bnTarget(2);
-    //bnTarget = bnTarget.pow(256 - 40);
-    
-    // -- break for HMAC_CTX_cleanup
-    for (;;)
-    {
-        if (!fSecMsgEnabled)
-           break;
-        
-        //psmsg->timestamp = GetTime();
-        //memcpy(&psmsg->timestamp, &now, 8);
-        memcpy(&psmsg->nonse[0], &nonse, 4);
-        
-        for (int i = 0; i < 32; i+=4)
-            memcpy(civ+i, &nonse, 4);
-        
-        unsigned int nBytes;
-        if (!HMAC_Init_ex(&ctx, &civ[0], 32, EVP_sha256(), NULL)
-            || !HMAC_Update(&ctx, (unsigned char*) pHeader+4, SMSG_HDR_LEN-4)
-            || !HMAC_Update(&ctx, (unsigned char*) pPayload, nPayload)
-            || !HMAC_Update(&ctx, pPayload, nPayload)
-            || !HMAC_Final(&ctx, sha256Hash, &nBytes)
-            //|| !HMAC_Final(&ctx, &vchHash[0], &nBytes)
-            || nBytes != 32)
-            break;
-        
-        /*
-        if (CBigNum(vchHash) <= bnTarget)
-        {
-            found = true;
-            if (fDebugSmsg)
-                printf("Match %u\n", nonse);
-            break;
-        };
-        */
-        
-        if (sha256Hash[31] == 0
-            && sha256Hash[30] == 0
-            && (~(sha256Hash[29]) & ((1<<0) || (1<<1) || (1<<2)) ))
-        //    && sha256Hash[29] == 0)
-        {
-            found = true;
-            //if (fDebugSmsg)
-            //    printf("Match %u\n", nonse);
-            break;
-        }
-        
-        //if (nonse >= UINT32_MAX)
-        if (nonse >= 4294967295U)
-        {
-            if (fDebugSmsg)
-                printf("No match %u\n", nonse);
-            break;
-            //return 1; 
-        }    
-        nonse++;
-    };
-    
-    HMAC_CTX_cleanup(&ctx);
+    boost::thread_group lanes;
+    for (int i = 1; i < nLanes; i++)
+        lanes.create_thread(boost::bind(&SecureMsgPowLane, &search, i));
+    SecureMsgPowLane(&search, 0);
+    lanes.join_all();
     
     if (!fSecMsgEnabled)
     {
@@ -3293,18 +3793,19 @@ int SecureMsgSetHash(unsigned char *pHeader, unsigned char *pPayload, uint32_t n
         return 2;
     };
     
-    if (!found)
+    if (!search.fFound)
     {
         if (fDebugSmsg)
-            printf("SecureMsgSetHash() failed, took %"PRId64" ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+            printf("SecureMsgSetHash() failed, took %"PRId64" ms, tried %"PRIu64"\n", GetTimeMillis() - nStart, search.nTried);
         return 1;
     };
     
-    memcpy(psmsg->hash, sha256Hash, 4);
-    //memcpy(psmsg->hash, &vchHash[0], 4);
+    memcpy(&psmsg->nonse[0], &search.nonse, 4);
+    memcpy(psmsg->hash, search.hash, 4);
     
     if (fDebugSmsg)
-        printf("SecureMsgSetHash() took %"PRId64" ms, nonse %u\n", GetTimeMillis() - nStart, nonse);
+        printf("SecureMsgSetHash() took %"PRId64" ms, nonse %u, tried %"PRIu64" on %d threads\n",
+            GetTimeMillis() - nStart, search.nonse, search.nTried, nLanes);
     
     return 0;
 };
@@ -3974,10 +4475,9 @@ int SecureMsgDecrypt(bool fTestOnly, std::string& address, unsigned char *pHeade
         
         memcpy(&vchSig[0], &vchPayload[1+20], 65);
         
-        CKey keyFrom;
-        keyFrom.SetCompactSignature(Hash(msg.vchMessage.begin(), msg.vchMessage.end()-1), vchSig);
-        CPubKey cpkFromSig = keyFrom.GetPubKey();
-        if (!cpkFromSig.IsValid())
+        CPubKey cpkFromSig;
+        if (!cpkFromSig.RecoverCompact(Hash(msg.vchMessage.begin(), msg.vchMessage.end()-1), vchSig)
+            || !cpkFromSig.IsValid())
         {
             printf("Signature validation failed.\n");
             return 1;
@@ -3993,8 +4493,6 @@ int SecureMsgDecrypt(bool fTestOnly, std::string& address, unsigned char *pHeade
             return 1;
         };
         
-        cpkFromSig = keyFrom.GetPubKey();
-        
         int rv = 5;
         try {
             rv = SecureMsgInsertAddress(ckidFrom, cpkFromSig);
@@ -27,6 +27,11 @@ const unsigned int SMSG_TIME_IGNORE     = 90;                // seconds that a p
 
 const unsigned int SMSG_MAX_MSG_BYTES   = 4096;              // the user input part
 
+const unsigned int SMSG_MAX_FILE_BYTES  = 1 << 30;           // a bucket continues in a new file past this size
+
+const int SMSG_MAX_THREADS              = 16;                // -smsgthreads limit
+const unsigned int SMSG_SCAN_LANE_KEYS = 64;                // owned keys per thread when matching recipients
+
 // max size of payload worst case compression
 const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMSG_PL_HDR_LEN);
 
@@ -38,6 +43,11 @@ const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMS
 
 extern bool fSecMsgEnabled;
 
+// Recipient matching counters, under cs_smsg
+extern uint64_t nSmsgScanned;
+extern uint64_t nSmsgDecryptAttempts;
+extern uint64_t nSmsgMatches;
+
 class SecMsgStored;
 
 // Inbox db changed, called with lock cs_smsgDB held.
@@ -118,9 +128,13 @@ public:
         else
             memcpy(sample, p, 8);
         offset = o;
+        nFile = 1;
     };
     
-    SecMsgToken() {};
+    SecMsgToken()
+    {
+        nFile = 1;
+    };
     
     ~SecMsgToken() {};
     
@@ -135,10 +149,24 @@ public:
     int64_t                     timestamp;    // doesn't need to be full 64 bytes?
     unsigned char               sample[8];    // first 8 bytes of payload - a hash
     int64_t                     offset;       // offset
+    uint32_t                    nFile;        // bucket file the message is in, time_nFile.dat
     
 };
 
 
+#pragma pack(push, 1)
+class SecMsgIndexRecord
+{
+// -- entry of a bucket file's .idx sidecar, one per message in file order
+public:
+    int64_t                     timestamp;
+    unsigned char               sample[8];
+    int64_t                     offset;
+    uint32_t                    nPayload;
+};
+#pragma pack(pop)
+
+
 class SecMsgBucket
 {
 public:
@@ -148,6 +176,7 @@ public:
         hash            = 0;
         nLockCount      = 0;
         nLockPeerId     = 0;
+        nFileLast       = 1;
     };
     ~SecMsgBucket() {};
     
@@ -157,6 +186,7 @@ public:
     uint32_t                    hash;           // token set should get ordered the same on each node
     uint32_t                    nLockCount;     // set when smsgWant first sent, unset at end of smsgMsg, ticks down in ThreadSecureMsg()
     uint32_t                    nLockPeerId;    // id of peer that bucket is locked for
+    uint32_t                    nFileLast;      // file new messages are appended to
     std::set<SecMsgToken>       setTokens;
     
 };
@@ -322,6 +352,7 @@ std::string fsReadable(uint64_t nBytes);
 
 
 int SecureMsgBuildBucketSet();
+void SecureMsgUnmapBuckets();
 int SecureMsgAddWalletAddresses();
 
 int SecureMsgReadIni();
@@ -344,6 +375,7 @@ bool SecureMsgScanBuckets();
 
 
 int SecureMsgWalletUnlocked();
+void SecureMsgWalletLocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(unsigned char *pHeader, unsigned char *pPayload, uint32_t nPayload, bool reportToGui);
@@ -4,6 +4,7 @@
 
 #include "stealth.h"
 #include "base58.h"
+#include "key.h"
 
 
 #include <openssl/rand.h>
@@ -165,6 +166,20 @@ int SecretToPublicKey(const ec_secret& secret, ec_point& out)
     // -- public key = private * G
     int rv = 0;
     
+#ifdef USE_SECP256K1
+    const secp256k1_context* ctx = GetSecp256k1Context();
+    secp256k1_pubkey pubkey;
+    if (!secp256k1_ec_pubkey_create(ctx, &pubkey, &secret.e[0]))
+    {
+        printf("SecretToPublicKey(): secp256k1_ec_pubkey_create failed.\n");
+        return 1;
+    };
+    size_t nOut = ec_compressed_size;
+    out.resize(ec_compressed_size);
+    secp256k1_ec_pubkey_serialize(ctx, &out[0], &nOut, &pubkey, SECP256K1_EC_COMPRESSED);
+    return rv;
+#endif
+    
     EC_GROUP *ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
     
     if (!ecgrp)
@@ -430,6 +445,42 @@ int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret&
     int rv = 0;
     std::vector<uint8_t> vchOutP;
     
+#ifdef USE_SECP256K1
+    {
+        const secp256k1_context* ctx = GetSecp256k1Context();
+        secp256k1_pubkey P;
+        if (ephemPubkey.empty()
+            || !secp256k1_ec_pubkey_parse(ctx, &P, &ephemPubkey[0], ephemPubkey.size()))
+        {
+            printf("StealthSecretSpend(): P secp256k1_ec_pubkey_parse failed\n");
+            return 1;
+        };
+        
+        // -- dP
+        if (!secp256k1_ec_pubkey_tweak_mul(ctx, &P, &scanSecret.e[0]))
+        {
+            printf("StealthSecretSpend(): dP secp256k1_ec_pubkey_tweak_mul failed\n");
+            return 1;
+        };
+        
+        size_t nOutP = ec_compressed_size;
+        vchOutP.resize(ec_compressed_size);
+        secp256k1_ec_pubkey_serialize(ctx, &vchOutP[0], &nOutP, &P, SECP256K1_EC_COMPRESSED);
+        
+        uint8_t hash1[32];
+        SHA256(&vchOutP[0], vchOutP.size(), (uint8_t*)hash1);
+        
+        // -- f + c mod order
+        memcpy(&secretOut.e[0], &spendSecret.e[0], ec_secret_size);
+        if (!secp256k1_ec_privkey_tweak_add(ctx, &secretOut.e[0], hash1))
+        {
+            printf("StealthSecretSpend(): secp256k1_ec_privkey_tweak_add failed.\n");
+            return 1;
+        };
+        return 0;
+    }
+#endif
+    
     BN_CTX* bnCtx           = NULL;
     BIGNUM* bnScanSecret    = NULL;
     BIGNUM* bnP             = NULL;
@@ -681,3 +732,198 @@ bool IsStealthAddress(const std::string& encodedAddress)
     
     return true;
 };
+
+
+class CStealthScanState
+{
+public:
+#ifdef USE_SECP256K1
+    std::vector<ec_secret> vScan;
+    std::vector<secp256k1_pubkey> vSpend;
+#else
+    std::vector<BIGNUM*> vScan;
+    std::vector<EC_POINT*> vSpend;
+#endif
+    EC_GROUP* ecgrp;
+    BN_CTX* bnCtx;
+    EC_POINT* P;
+    EC_POINT* Q;
+    EC_POINT* Rout;
+    BIGNUM* bnc;
+    
+    CStealthScanState()
+    {
+        ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        bnCtx = BN_CTX_new();
+        P = ecgrp ? EC_POINT_new(ecgrp) : NULL;
+        Q = ecgrp ? EC_POINT_new(ecgrp) : NULL;
+        Rout = ecgrp ? EC_POINT_new(ecgrp) : NULL;
+        bnc = BN_new();
+    }
+    
+    ~CStealthScanState()
+    {
+        Clear();
+        if (bnc)        BN_free(bnc);
+        if (Rout)       EC_POINT_free(Rout);
+        if (Q)          EC_POINT_free(Q);
+        if (P)          EC_POINT_free(P);
+        if (bnCtx)      BN_CTX_free(bnCtx);
+        if (ecgrp)      EC_GROUP_free(ecgrp);
+    }
+    
+    bool IsValid() const
+    {
+        return ecgrp && bnCtx && P && Q && Rout && bnc;
+    }
+    
+    void Clear()
+    {
+#ifndef USE_SECP256K1
+        for (size_t i = 0; i < vScan.size(); ++i)
+            BN_clear_free(vScan[i]);
+        for (size_t i = 0; i < vSpend.size(); ++i)
+            EC_POINT_free(vSpend[i]);
+#endif
+        vScan.clear();
+        vSpend.clear();
+    }
+    
+    bool Add(const CStealthAddress& sxAddr)
+    {
+#ifdef USE_SECP256K1
+        const secp256k1_context* ctx = GetSecp256k1Context();
+        secp256k1_pubkey R;
+        if (sxAddr.spend_pubkey.empty()
+            || !secp256k1_ec_pubkey_parse(ctx, &R, &sxAddr.spend_pubkey[0], sxAddr.spend_pubkey.size()))
+            return false;
+        ec_secret sScan;
+        memcpy(&sScan.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+        vScan.push_back(sScan);
+        vSpend.push_back(R);
+        return true;
+#else
+        if (!IsValid() || sxAddr.spend_pubkey.empty())
+            return false;
+        EC_POINT* R = EC_POINT_new(ecgrp);
+        if (!R || !EC_POINT_oct2point(ecgrp, R, &sxAddr.spend_pubkey[0], sxAddr.spend_pubkey.size(), bnCtx))
+        {
+            if (R) EC_POINT_free(R);
+            return false;
+        };
+        BIGNUM* bnScan = BN_bin2bn(&sxAddr.scan_secret[0], ec_secret_size, BN_new());
+        if (!bnScan)
+        {
+            EC_POINT_free(R);
+            return false;
+        };
+        vScan.push_back(bnScan);
+        vSpend.push_back(R);
+        return true;
+#endif
+    }
+};
+
+CStealthScanner::CStealthScanner()
+{
+    pstate = new CStealthScanState();
+}
+
+CStealthScanner::~CStealthScanner()
+{
+    delete pstate;
+}
+
+void CStealthScanner::SetAddresses(const std::set<CStealthAddress>& setAddress)
+{
+    // the set is ordered by scan public key, so the same owned addresses
+    // come out in the same order
+    std::vector<ec_point> vOwned;
+    for (std::set<CStealthAddress>::const_iterator it = setAddress.begin(); it != setAddress.end(); ++it)
+        if (it->scan_secret.size() == ec_secret_size)
+            vOwned.push_back(it->scan_pubkey);
+    if (vOwned == vAddress && pstate->vScan.size() == vAddress.size())
+        return;
+    
+    vAddress.clear();
+    pstate->Clear();
+    for (std::set<CStealthAddress>::const_iterator it = setAddress.begin(); it != setAddress.end(); ++it)
+    {
+        if (it->scan_secret.size() != ec_secret_size)
+            continue;
+        if (!pstate->Add(*it))
+        {
+            printf("CStealthScanner::SetAddresses(): could not parse %s.\n", it->Encoded().c_str());
+            continue;
+        };
+        vAddress.push_back(it->scan_pubkey);
+    };
+}
+
+bool CStealthScanner::Scan(const ec_point& ephemPubkey, std::vector<CStealthScanResult>& vResult)
+{
+    vResult.clear();
+    if (vAddress.empty() || ephemPubkey.size() != ec_compressed_size)
+        return false;
+    
+    std::vector<uint8_t> vchOutQ(ec_compressed_size);
+    
+#ifdef USE_SECP256K1
+    const secp256k1_context* ctx = GetSecp256k1Context();
+    secp256k1_pubkey P;
+    if (!secp256k1_ec_pubkey_parse(ctx, &P, &ephemPubkey[0], ephemPubkey.size()))
+        return false;
+    
+    for (size_t i = 0; i < vAddress.size(); ++i)
+    {
+        CStealthScanResult result;
+        result.nAddress = i;
+        
+        // -- dP
+        secp256k1_pubkey Q = P;
+        if (!secp256k1_ec_pubkey_tweak_mul(ctx, &Q, &pstate->vScan[i].e[0]))
+            continue;
+        size_t nOutQ = ec_compressed_size;
+        secp256k1_ec_pubkey_serialize(ctx, &vchOutQ[0], &nOutQ, &Q, SECP256K1_EC_COMPRESSED);
+        SHA256(&vchOutQ[0], vchOutQ.size(), &result.sShared.e[0]);
+        
+        // -- R + cG
+        secp256k1_pubkey Rout = pstate->vSpend[i];
+        if (!secp256k1_ec_pubkey_tweak_add(ctx, &Rout, &result.sShared.e[0]))
+            continue;
+        size_t nOut = ec_compressed_size;
+        result.pkOut.resize(ec_compressed_size);
+        secp256k1_ec_pubkey_serialize(ctx, &result.pkOut[0], &nOut, &Rout, SECP256K1_EC_COMPRESSED);
+        vResult.push_back(result);
+    };
+#else
+    CStealthScanState& state = *pstate;
+    if (!state.IsValid()
+        || !EC_POINT_oct2point(state.ecgrp, state.P, &ephemPubkey[0], ephemPubkey.size(), state.bnCtx))
+        return false;
+    
+    for (size_t i = 0; i < vAddress.size(); ++i)
+    {
+        CStealthScanResult result;
+        result.nAddress = i;
+        
+        // -- dP
+        if (!EC_POINT_mul(state.ecgrp, state.Q, NULL, state.P, state.vScan[i], state.bnCtx)
+            || EC_POINT_point2oct(state.ecgrp, state.Q, POINT_CONVERSION_COMPRESSED,
+                                  &vchOutQ[0], vchOutQ.size(), state.bnCtx) != ec_compressed_size)
+            continue;
+        SHA256(&vchOutQ[0], vchOutQ.size(), &result.sShared.e[0]);
+        
+        // -- cG + R in one multiplication
+        result.pkOut.resize(ec_compressed_size);
+        if (!BN_bin2bn(&result.sShared.e[0], ec_secret_size, state.bnc)
+            || !EC_POINT_mul(state.ecgrp, state.Rout, state.bnc, state.vSpend[i], BN_value_one(), state.bnCtx)
+            || EC_POINT_point2oct(state.ecgrp, state.Rout, POINT_CONVERSION_COMPRESSED,
+                                  &result.pkOut[0], result.pkOut.size(), state.bnCtx) != ec_compressed_size)
+            continue;
+        vResult.push_back(result);
+    };
+#endif
+    
+    return !vResult.empty();
+}
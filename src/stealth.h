@@ -10,6 +10,7 @@
 
 #include <stdlib.h> 
 #include <stdio.h> 
+#include <set>
 #include <vector>
 #include <inttypes.h>
 
@@ -110,5 +111,47 @@ int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_se
 bool IsStealthAddress(const std::string& encodedAddress);
 
 
+/** What an ephemeral key pays to one of the scanned stealth addresses */
+class CStealthScanResult
+{
+public:
+    size_t nAddress;        // index into CStealthScanner::vAddress
+    ec_secret sShared;      // c = H(dP)
+    ec_point pkOut;         // R' = R + cG
+};
+
+class CStealthScanState;
+
+/** Scan side of the owned stealth addresses.
+ *
+ *  The scan secrets and spend public keys are parsed into curve state once,
+ *  along with the context and temporaries the multiplications need, so
+ *  testing an ephemeral key costs one ECDH and one point addition per
+ *  address. Not safe to share between threads.
+ */
+class CStealthScanner
+{
+private:
+    CStealthScanState* pstate;
+
+    // not copyable
+    CStealthScanner(const CStealthScanner&);
+    CStealthScanner& operator=(const CStealthScanner&);
+
+public:
+    // scan public keys of the addresses set, in scan order
+    std::vector<ec_point> vAddress;
+
+    CStealthScanner();
+    ~CStealthScanner();
+
+    /** Rebuild from the addresses with a scan secret, unless those are the ones already set */
+    void SetAddresses(const std::set<CStealthAddress>& setAddress);
+
+    /** One result per scanned address that ephemPubkey gives a valid key for */
+    bool Scan(const ec_point& ephemPubkey, std::vector<CStealthScanResult>& vResult);
+};
+
+
 #endif  // BITCOIN_STEALTHADDRESS_H
 
@@ -0,0 +1,82 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned int TEST_FILE = 9999;
+static const int TEST_TXS = 200;
+
+static CTransaction NewTransaction(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1 + n % 3);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        tx.vin[i].prevout.hash = uint256(n * 3 + i);
+        tx.vin[i].prevout.n = i;
+        tx.vin[i].scriptSig = CScript() << vector<unsigned char>(72, n) << vector<unsigned char>(33, i);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n;
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, n) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].nValue = n * 2;
+    return tx;
+}
+
+// appends txs to the test file as WriteToDisk does, returning their positions
+static void AppendTransactions(int nBegin, int nEnd, vector<CDiskTxPos>& vPos)
+{
+    CAutoFile fileout = CAutoFile(OpenBlockFile(TEST_FILE, 0, "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!!fileout);
+    fseek(fileout, 0, SEEK_END);
+    for (int n = nBegin; n < nEnd; n++)
+    {
+        vPos.push_back(CDiskTxPos(TEST_FILE, 0, ftell(fileout)));
+        fileout << NewTransaction(n);
+    }
+    fflush(fileout);
+}
+
+static void ReadTransactions(const vector<CDiskTxPos>& vPos)
+{
+    for (unsigned int n = 0; n < vPos.size(); n++)
+    {
+        CTransaction tx;
+        BOOST_CHECK(tx.ReadFromDisk(vPos[n]));
+        BOOST_CHECK(tx.GetHash() == NewTransaction(n).GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+BOOST_AUTO_TEST_CASE(blockfile_read)
+{
+    bool fMapBefore = fMapBlockFiles;
+    boost::filesystem::remove(BlockFilePath(TEST_FILE));
+
+    vector<CDiskTxPos> vPos;
+    AppendTransactions(0, TEST_TXS / 2, vPos);
+
+    fMapBlockFiles = true;
+    ReadTransactions(vPos);
+
+    // appended after the file was mapped, read through a new map
+    AppendTransactions(TEST_TXS / 2, TEST_TXS, vPos);
+    ReadTransactions(vPos);
+
+    fMapBlockFiles = false;
+    ReadTransactions(vPos);
+
+    // past the end of the file neither way finds anything
+    CTransaction tx;
+    fMapBlockFiles = true;
+    BOOST_CHECK(!tx.ReadFromDisk(CDiskTxPos(TEST_FILE, 0, 0x7000000)));
+
+    fMapBlockFiles = fMapBefore;
+    blockFileMaps.Clear();
+    boost::filesystem::remove(BlockFilePath(TEST_FILE));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,111 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+// fills vIndex with a branch on top of pindexFork, nSpacing seconds apart
+static void BuildBranch(vector<CBlockIndex>& vIndex, CBlockIndex* pindexFork, unsigned int nTime, int nSpacing)
+{
+    for (unsigned int n = 0; n < vIndex.size(); n++)
+    {
+        CBlockIndex* pprev = n > 0 ? &vIndex[n - 1] : pindexFork;
+        vIndex[n].pprev = pprev;
+        vIndex[n].nHeight = pprev ? pprev->nHeight + 1 : 0;
+        vIndex[n].nTime = nTime + n * nSpacing;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+BOOST_AUTO_TEST_CASE(chain_height_lookup)
+{
+    CActiveChain chain;
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+    BOOST_CHECK(chain[0] == NULL);
+
+    vector<CBlockIndex> vMain(100);
+    BuildBranch(vMain, NULL, 1000, 10);
+    chain.SetTip(&vMain[99]);
+    BOOST_CHECK_EQUAL(chain.Height(), 99);
+    for (int n = 0; n < 100; n++)
+        BOOST_CHECK(chain[n] == &vMain[n]);
+    BOOST_CHECK(chain[100] == NULL);
+    BOOST_CHECK(chain[-1] == NULL);
+
+    // a shorter branch with more trust replaces everything above the fork
+    vector<CBlockIndex> vBranch(20);
+    BuildBranch(vBranch, &vMain[59], 1605, 10);
+    chain.SetTip(&vBranch[19]);
+    BOOST_CHECK_EQUAL(chain.Height(), 79);
+    BOOST_CHECK(chain[59] == &vMain[59]);
+    BOOST_CHECK(chain[60] == &vBranch[0]);
+    BOOST_CHECK(chain[79] == &vBranch[19]);
+    BOOST_CHECK(chain[80] == NULL);
+    BOOST_CHECK(chain.Contains(&vMain[10]));
+    BOOST_CHECK(!chain.Contains(&vMain[60]));
+
+    // and back
+    chain.SetTip(&vMain[99]);
+    BOOST_CHECK(chain[79] == &vMain[79]);
+    BOOST_CHECK(!chain.Contains(&vBranch[0]));
+}
+
+BOOST_AUTO_TEST_CASE(chain_time_lookup)
+{
+    CActiveChain chain;
+    vector<CBlockIndex> vMain(100);
+    BuildBranch(vMain, NULL, 1000, 10);
+
+    // a block earlier than the one before it does not move the search
+    vMain[50].nTime = 1400;
+    chain.SetTip(&vMain[99]);
+
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(0), 0);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1000), 0);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1001), 1);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1400), 40);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1490), 49);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1495), 51);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1990), 99);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1991), 100);
+
+    // times above the fork follow a reorganisation
+    vector<CBlockIndex> vBranch(10);
+    BuildBranch(vBranch, &vMain[89], 5000, 100);
+    chain.SetTip(&vBranch[9]);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(1990), 90);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(5900), 99);
+    chain.SetTip(&vMain[95]);
+    BOOST_CHECK_EQUAL(chain.FindHeightByTime(5000), 96);
+}
+
+BOOST_AUTO_TEST_CASE(chain_index_arena)
+{
+    CBlockIndexArena arena;
+    BlockMap mapIndex;
+    vector<CBlockIndex*> vIndex;
+    for (unsigned int n = 0; n < CBlockIndexArena::CHUNK_ENTRIES + 10; n++)
+    {
+        CBlockIndex* pindex = arena.New();
+        BOOST_CHECK(pindex->pprev == NULL && pindex->nHeight == 0 && pindex->nChainTrust == 0);
+        pindex->nHeight = n;
+        BlockMap::iterator mi = mapIndex.insert(make_pair(uint256(n), pindex)).first;
+        pindex->phashBlock = &((*mi).first);
+        vIndex.push_back(pindex);
+    }
+
+    // entries of a chunk are next to each other
+    BOOST_CHECK(vIndex[1] == vIndex[0] + 1);
+    BOOST_CHECK(vIndex[CBlockIndexArena::CHUNK_ENTRIES - 1] == vIndex[0] + CBlockIndexArena::CHUNK_ENTRIES - 1);
+
+    // and the hashes they point to stay where they are as the map grows
+    for (unsigned int n = 0; n < vIndex.size(); n++)
+    {
+        BOOST_CHECK(vIndex[n]->nHeight == (int)n);
+        BOOST_CHECK(vIndex[n]->GetBlockHash() == uint256(n));
+        BOOST_CHECK(mapIndex[uint256(n)] == vIndex[n]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
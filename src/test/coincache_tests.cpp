@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include "coincache.h"
+
+using namespace std;
+
+static CTransaction NewTransaction(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = uint256(n + 1);
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n;
+    tx.vout[1].nValue = n + 1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(coincache_tests)
+
+BOOST_AUTO_TEST_CASE(coincache_lookup)
+{
+    CCoinCache cache(1024 * 1024);
+    CTransaction tx = NewTransaction(1);
+    uint256 hash = tx.GetHash();
+    CTxIndex txindex(CDiskTxPos(1, 2, 3), tx.vout.size());
+
+    CTxIndex txindexGot;
+    CTransaction txGot;
+    BOOST_CHECK(!cache.Get(hash, txindexGot, txGot));
+    cache.Put(hash, txindex, tx);
+    BOOST_CHECK(cache.Get(hash, txindexGot, txGot));
+    BOOST_CHECK(txGot.GetHash() == hash);
+    BOOST_CHECK(txindexGot.pos == txindex.pos);
+
+    // spends are followed, a fully spent transaction is dropped
+    txindex.vSpent[0] = CDiskTxPos(1, 2, 4);
+    cache.Update(hash, txindex);
+    BOOST_CHECK(cache.Get(hash, txindexGot, txGot));
+    BOOST_CHECK(txindexGot.vSpent[0] == txindex.vSpent[0]);
+    BOOST_CHECK(txindexGot.vSpent[1].IsNull());
+    txindex.vSpent[1] = CDiskTxPos(1, 2, 5);
+    cache.Update(hash, txindex);
+    BOOST_CHECK(!cache.Get(hash, txindexGot, txGot));
+
+    // and so is one that is never cached
+    cache.Put(hash, txindex, tx);
+    BOOST_CHECK(!cache.Get(hash, txindexGot, txGot));
+
+    uint64_t nEntries, nHits, nMisses;
+    int64_t nBytes, nMaxBytes;
+    cache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 0U);
+    BOOST_CHECK_EQUAL(nBytes, 0);
+    BOOST_CHECK_EQUAL(nHits, 2U);
+    BOOST_CHECK_EQUAL(nMisses, 3U);
+}
+
+BOOST_AUTO_TEST_CASE(coincache_evicts_least_recent)
+{
+    CCoinCache cache(1024 * 1024);
+    vector<uint256> vHash;
+    for (int n = 0; n < 100; n++)
+    {
+        CTransaction tx = NewTransaction(n);
+        vHash.push_back(tx.GetHash());
+        cache.Put(vHash.back(), CTxIndex(CDiskTxPos(1, 1, n + 1), tx.vout.size()), tx);
+    }
+
+    uint64_t nEntries, nHits, nMisses;
+    int64_t nBytes, nMaxBytes;
+    cache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nEntries, 100U);
+
+    // the first one is used again, then room is made for half of them
+    CTxIndex txindex;
+    CTransaction tx;
+    BOOST_CHECK(cache.Get(vHash[0], txindex, tx));
+    cache.SetMaxBytes(nBytes / 2);
+    BOOST_CHECK(cache.Get(vHash[0], txindex, tx));
+    BOOST_CHECK(!cache.Get(vHash[1], txindex, tx));
+    BOOST_CHECK(cache.Get(vHash[99], txindex, tx));
+
+    cache.GetStats(nEntries, nBytes, nMaxBytes, nHits, nMisses);
+    BOOST_CHECK(nBytes <= nMaxBytes);
+    BOOST_CHECK(nEntries < 100U && nEntries >= 49U);
+
+    cache.Erase(vHash[99]);
+    BOOST_CHECK(!cache.Get(vHash[99], txindex, tx));
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(vHash[0], txindex, tx));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -144,4 +144,40 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_verify_backends)
+{
+    const int nSignatures = 20;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int i = 0; i < nSignatures; i++)
+    {
+        string strMsg = strprintf("Test message %i", i);
+        vHash.push_back(Hash(strMsg.begin(), strMsg.end()));
+        vSig.push_back(vector<unsigned char>());
+        BOOST_CHECK(key.Sign(vHash.back(), vSig.back()));
+    }
+
+    // both paths agree, also on signatures of other messages
+    for (int i = 0; i < nSignatures; i++)
+    {
+        CKey keyVerify;
+        keyVerify.SetPubKey(pubkey);
+        BOOST_CHECK(keyVerify.Verify(vHash[i], vSig[i]));
+        BOOST_CHECK(pubkey.Verify(vHash[i], vSig[i]));
+        BOOST_CHECK(!keyVerify.Verify(vHash[i], vSig[(i + 1) % nSignatures]));
+        BOOST_CHECK(!pubkey.Verify(vHash[i], vSig[(i + 1) % nSignatures]));
+
+        vector<unsigned char> vchCompact;
+        BOOST_CHECK(key.SignCompact(vHash[i], vchCompact));
+        CPubKey pubkeyRecovered;
+        BOOST_CHECK(pubkeyRecovered.RecoverCompact(vHash[i], vchCompact));
+        BOOST_CHECK(pubkeyRecovered == pubkey);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -59,4 +59,67 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_stats)
+{
+    map<string, CRPCMethodStats> mapBefore, mapAfter;
+    tableRPC.GetStats(mapBefore);
+
+    Array params;
+    params.push_back("[1, 2]");
+    BOOST_CHECK_NO_THROW(tableRPC.execute("encodebase58", params));
+    BOOST_CHECK_NO_THROW(tableRPC.execute("encodebase58", params));
+    BOOST_CHECK_THROW(tableRPC.execute("encodebase58", Array()), Object);
+    BOOST_CHECK_THROW(tableRPC.execute("nosuchmethod", Array()), Object);
+
+    tableRPC.GetStats(mapAfter);
+    const CRPCMethodStats& before = mapBefore["encodebase58"];
+    const CRPCMethodStats& after = mapAfter["encodebase58"];
+    BOOST_CHECK_EQUAL(after.nCalls - before.nCalls, 3);
+    BOOST_CHECK_EQUAL(after.nErrors - before.nErrors, 1);
+    int64_t nBucketed = 0;
+    for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+        nBucketed += after.vLatency[i] - before.vLatency[i];
+    BOOST_CHECK_EQUAL(nBucketed, 3);
+
+    // methods that are not found are not counted
+    BOOST_CHECK(!mapAfter.count("nosuchmethod"));
+
+    BOOST_CHECK_EQUAL(tableRPC["encodebase58"]->lock, RPC_LOCK_NONE);
+    BOOST_CHECK_EQUAL(tableRPC["getblock"]->lock, RPC_LOCK_MAIN);
+    BOOST_CHECK_EQUAL(tableRPC["sendtoaddress"]->lock, RPC_LOCK_WALLET);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stream_writer)
+{
+    Object obj;
+    obj.push_back(Pair("a", 1));
+    obj.push_back(Pair("b", Array()));
+    obj.push_back(Pair("c", Object()));
+    Array arr;
+    arr.push_back("x\"y");
+    arr.push_back(obj);
+    arr.push_back(Value::null);
+    arr.push_back(1.5);
+
+    // written in parts, it is the same text write_string gives
+    ostringstream os;
+    CJSONStreamWriter writer(os);
+    writer.BeginObject();
+    writer.WritePairs(obj);
+    writer.Key("list");
+    writer.BeginArray();
+    BOOST_FOREACH(const Value& value, arr)
+        writer.Write(value);
+    writer.BeginArray();
+    writer.EndArray();
+    writer.EndArray();
+    writer.EndObject();
+
+    Object expected = obj;
+    Array list = arr;
+    list.push_back(Array());
+    expected.push_back(Pair("list", list));
+    BOOST_CHECK_EQUAL(os.str(), write_string(Value(expected), false));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
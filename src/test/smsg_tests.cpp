@@ -0,0 +1,64 @@
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "smessage.h"
+#include "util.h"
+
+using namespace std;
+
+static const int TEST_MESSAGES = 4;
+static const uint32_t TEST_PAYLOAD = 512;
+
+// the proof of work hash as HMAC_Init_ex computed it before
+static void ReferencePowHash(const unsigned char* pHeader, const unsigned char* pPayload, uint32_t nPayload, unsigned char* sha256Hash)
+{
+    const SecureMessage* psmsg = (const SecureMessage*) pHeader;
+    unsigned char civ[32];
+    for (int i = 0; i < 32; i += 4)
+        memcpy(civ + i, &psmsg->nonse[0], 4);
+
+    vector<unsigned char> vchData(pHeader + 4, pHeader + SMSG_HDR_LEN);
+    vchData.insert(vchData.end(), pPayload, pPayload + nPayload);
+    vchData.insert(vchData.end(), pPayload, pPayload + nPayload);
+
+    unsigned int nBytes;
+    HMAC(EVP_sha256(), civ, 32, &vchData[0], vchData.size(), sha256Hash, &nBytes);
+}
+
+BOOST_AUTO_TEST_SUITE(smsg_tests)
+
+BOOST_AUTO_TEST_CASE(smsg_pow)
+{
+    bool fEnabledBefore = fSecMsgEnabled;
+    fSecMsgEnabled = true;
+
+    vector<unsigned char> vchMessage(SMSG_HDR_LEN + TEST_PAYLOAD);
+    unsigned char* pHeader = &vchMessage[0];
+    unsigned char* pPayload = &vchMessage[SMSG_HDR_LEN];
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+    for (int i = 0; i < TEST_MESSAGES; i++)
+    {
+        RAND_bytes(pHeader, vchMessage.size());
+        psmsg->version[0] = 1;
+        psmsg->nPayload = TEST_PAYLOAD;
+
+        BOOST_CHECK_EQUAL(SecureMsgSetHash(pHeader, pPayload, TEST_PAYLOAD), 0);
+        BOOST_CHECK_EQUAL(SecureMsgValidate(pHeader, pPayload, TEST_PAYLOAD), 0);
+
+        unsigned char sha256Hash[32];
+        ReferencePowHash(pHeader, pPayload, TEST_PAYLOAD, sha256Hash);
+        BOOST_CHECK(memcmp(psmsg->hash, sha256Hash, 4) == 0);
+        BOOST_CHECK(sha256Hash[31] == 0 && sha256Hash[30] == 0 && !(sha256Hash[29] & 1));
+
+        // any other payload byte breaks the proof
+        pPayload[i] ^= 1;
+        BOOST_CHECK(SecureMsgValidate(pHeader, pPayload, TEST_PAYLOAD) != 0);
+    }
+
+    fSecMsgEnabled = fEnabledBefore;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
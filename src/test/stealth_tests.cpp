@@ -0,0 +1,80 @@
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "stealth.h"
+#include "util.h"
+
+using namespace std;
+
+static const unsigned int TEST_ADDRESSES = 4;
+static const int TEST_OUTPUTS = 20;
+
+static CStealthAddress NewStealthAddress()
+{
+    CStealthAddress sxAddr;
+    ec_secret sScan, sSpend;
+    BOOST_CHECK_EQUAL(GenerateRandomSecret(sScan), 0);
+    BOOST_CHECK_EQUAL(GenerateRandomSecret(sSpend), 0);
+    BOOST_CHECK_EQUAL(SecretToPublicKey(sScan, sxAddr.scan_pubkey), 0);
+    BOOST_CHECK_EQUAL(SecretToPublicKey(sSpend, sxAddr.spend_pubkey), 0);
+    sxAddr.scan_secret.assign(&sScan.e[0], &sScan.e[0] + ec_secret_size);
+    sxAddr.spend_secret.assign(&sSpend.e[0], &sSpend.e[0] + ec_secret_size);
+    return sxAddr;
+}
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+BOOST_AUTO_TEST_CASE(stealth_scan)
+{
+    set<CStealthAddress> setAddress;
+    while (setAddress.size() < TEST_ADDRESSES)
+        setAddress.insert(NewStealthAddress());
+
+    // an address without its scan secret is not scanned for
+    CStealthAddress sxWatch = NewStealthAddress();
+    sxWatch.scan_secret.clear();
+    setAddress.insert(sxWatch);
+
+    CStealthScanner scanner;
+    scanner.SetAddresses(setAddress);
+    BOOST_CHECK_EQUAL(scanner.vAddress.size(), (size_t)TEST_ADDRESSES);
+
+    // ephemeral keys, each paying one of the addresses as the sender would
+    vector<ec_point> vEphem(TEST_OUTPUTS);
+    vector<ec_point> vPaid(TEST_OUTPUTS);
+    vector<size_t> vAddress(TEST_OUTPUTS);
+    for (int i = 0; i < TEST_OUTPUTS; i++)
+    {
+        ec_secret sEphem, sShared;
+        BOOST_CHECK_EQUAL(GenerateRandomSecret(sEphem), 0);
+        BOOST_CHECK_EQUAL(SecretToPublicKey(sEphem, vEphem[i]), 0);
+
+        vAddress[i] = GetRandInt(TEST_ADDRESSES);
+        CStealthAddress sxFind;
+        sxFind.scan_pubkey = scanner.vAddress[vAddress[i]];
+        CStealthAddress sxAddr = *setAddress.find(sxFind);
+        BOOST_CHECK_EQUAL(StealthSecret(sEphem, sxAddr.scan_pubkey, sxAddr.spend_pubkey, sShared, vPaid[i]), 0);
+    }
+
+    vector<CStealthScanResult> vResult;
+    for (int i = 0; i < TEST_OUTPUTS; i++)
+    {
+        BOOST_CHECK(scanner.Scan(vEphem[i], vResult));
+        BOOST_CHECK_EQUAL(vResult.size(), (size_t)TEST_ADDRESSES);
+        int nMatch = 0;
+        BOOST_FOREACH(const CStealthScanResult& result, vResult)
+        {
+            if (result.pkOut != vPaid[i])
+                continue;
+            nMatch++;
+            BOOST_CHECK_EQUAL(result.nAddress, vAddress[i]);
+        }
+        BOOST_CHECK_EQUAL(nMatch, 1);
+    }
+
+    // a bad ephemeral key matches nothing
+    ec_point pkBad(ec_compressed_size, 0xff);
+    BOOST_CHECK(!scanner.Scan(pkBad, vResult));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -261,4 +261,38 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_hash_cache)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << dummyTransactions[0];
+    CTransaction tx;
+    ss >> tx;
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+    BOOST_CHECK(tx.GetHash() == dummyTransactions[0].GetHash());
+
+    // copies keep it, a change in place has to drop it
+    CTransaction txCopy(tx);
+    txCopy.vout[0].nValue++;
+    BOOST_CHECK(txCopy.GetHash() == tx.GetHash());
+    txCopy.InvalidateHash();
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    BOOST_CHECK(txCopy.GetHash() != tx.GetHash());
+
+    // signing drops it itself
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    txSpend.vin[0].prevout.n = 0;
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 1;
+    ss << txSpend;
+    ss >> txSpend;
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[0], txSpend, 0));
+    BOOST_CHECK(txSpend.GetHash() == SerializeHash(txSpend));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "main.h"
+#include "turbo.h"
+#include "util.h"
+
+#define CHAIN_LENGTH 400
+#define LOOKBACK 600
+#define SPACING 118
+#define SPACING2 298
+
+// what the pprev walk in GetTurboStakeMultiplier counts
+static void WalkWindow(const CKeyID& keyID, int64_t txTime, const CBlockIndex* pindex, unsigned int nAllowed,
+                       int& nTurboCount, int& nBlockCount, bool& fTooClose)
+{
+    nTurboCount = 1;
+    nBlockCount = 1;
+    fTooClose = false;
+    int64_t nTimeLast = txTime;
+    for (; pindex->pprev != NULL && pindex->nTime >= txTime - LOOKBACK; pindex = pindex->pprev)
+    {
+        nBlockCount++;
+        if (pindex->IsProofOfStake() && pindex->keyStakeSigner == keyID)
+        {
+            if (nTimeLast - pindex->nTime < nAllowed)
+            {
+                fTooClose = true;
+                return;
+            }
+            nTurboCount++;
+            nTimeLast = pindex->nTime;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(turbo_tests)
+
+BOOST_AUTO_TEST_CASE(turbo_window_matches_walk)
+{
+    CKeyID keys[3];
+    for (int i = 0; i < 3; i++)
+        keys[i] = CKeyID(uint160(i + 1));
+
+    vector<CBlockIndex> vIndex(CHAIN_LENGTH);
+    CTurboIndex index(SPACING, SPACING2, 1000000000);
+    unsigned int nTime = 1000000;
+    for (int h = 0; h < CHAIN_LENGTH; h++)
+    {
+        CBlockIndex& block = vIndex[h];
+        block.nHeight = h;
+        block.pprev = h ? &vIndex[h - 1] : NULL;
+        // mostly increasing times with some that drift backwards
+        nTime += GetRandInt(240);
+        block.nTime = nTime - GetRandInt(60);
+        if (h > 0 && GetRandInt(3))
+        {
+            block.SetProofOfStake();
+            block.keyStakeSigner = keys[GetRandInt(3)];
+        }
+        BOOST_CHECK(index.Connect(&block, 0));
+    }
+
+    // a block off the indexed chain is refused
+    CBlockIndex orphan;
+    orphan.nHeight = CHAIN_LENGTH + 1;
+    BOOST_CHECK(!index.Connect(&orphan, 0));
+
+    for (int nTest = 0; nTest < 2000; nTest++)
+    {
+        const CBlockIndex* pindex = &vIndex[1 + GetRandInt(CHAIN_LENGTH - 1)];
+        int64_t txTime = pindex->nTime + GetRandInt(400) - 50;
+        const CKeyID& keyID = keys[GetRandInt(3)];
+        bool fSpacing2 = GetRandInt(2);
+
+        int nTurbo, nBlocks, nTurboWalk, nBlocksWalk;
+        bool fClose, fCloseWalk;
+        BOOST_CHECK(index.GetWindow(keyID, txTime, txTime - LOOKBACK, pindex, fSpacing2, nTurbo, nBlocks, fClose));
+        WalkWindow(keyID, txTime, pindex, fSpacing2 ? SPACING2 : SPACING, nTurboWalk, nBlocksWalk, fCloseWalk);
+
+        BOOST_CHECK_EQUAL(fClose, fCloseWalk);
+        if (!fCloseWalk)
+        {
+            BOOST_CHECK_EQUAL(nTurbo, nTurboWalk);
+            BOOST_CHECK_EQUAL(nBlocks, nBlocksWalk);
+        }
+    }
+
+    // disconnected blocks are no longer answered for, the new tip still is
+    for (int h = CHAIN_LENGTH - 1; h > CHAIN_LENGTH / 2; h--)
+        index.Disconnect(&vIndex[h]);
+    const CBlockIndex* pindexTip = &vIndex[CHAIN_LENGTH / 2];
+    int64_t txTime = pindexTip->nTime + 120;
+    int nTurbo, nBlocks, nTurboWalk, nBlocksWalk;
+    bool fClose, fCloseWalk;
+    BOOST_CHECK(!index.GetWindow(keys[0], txTime, txTime - LOOKBACK, &vIndex[CHAIN_LENGTH - 1], false, nTurbo, nBlocks, fClose));
+    BOOST_CHECK(index.GetWindow(keys[0], txTime, txTime - LOOKBACK, pindexTip, false, nTurbo, nBlocks, fClose));
+    WalkWindow(keys[0], txTime, pindexTip, SPACING, nTurboWalk, nBlocksWalk, fCloseWalk);
+    BOOST_CHECK_EQUAL(fClose, fCloseWalk);
+    if (!fCloseWalk)
+        BOOST_CHECK_EQUAL(nTurbo, nTurboWalk);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,188 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <algorithm>
+
+#include "turbo.h"
+#include "main.h"
+
+using namespace std;
+
+struct CTurboStakeByHeightDesc
+{
+    bool operator()(const CTurboStake& a, const CTurboStake& b) const
+    {
+        return a.nHeight > b.nHeight;
+    }
+};
+
+CTurboIndex::CTurboIndex(unsigned int nAllowedSpacingIn, unsigned int nAllowedSpacing2In, int64_t nMaxTimeIn)
+{
+    nAllowedSpacing = nAllowedSpacingIn;
+    nAllowedSpacing2 = nAllowedSpacing2In;
+    nMaxTime = nMaxTimeIn;
+}
+
+void CTurboIndex::SetNull()
+{
+    LOCK(cs);
+    vBlock.clear();
+    vMinTime.clear();
+    mapSigner.clear();
+}
+
+bool CTurboIndex::Accepts(const CBlockIndex* pindex) const
+{
+    LOCK(cs);
+    if (pindex->nHeight != (int)vBlock.size() || pindex->nTime > nMaxTime)
+        return false;
+    return vBlock.empty() ? (pindex->pprev == NULL) : (pindex->pprev == vBlock.back());
+}
+
+bool CTurboIndex::Connect(CBlockIndex* pindex, int nMultiplier)
+{
+    LOCK(cs);
+    if (!Accepts(pindex))
+        return false;
+
+    int nHeight = pindex->nHeight;
+    vBlock.push_back(pindex);
+
+    // extend every level whose span now fits
+    for (unsigned int k = 0; (1 << k) <= nHeight + 1; k++)
+    {
+        if (k == vMinTime.size())
+            vMinTime.push_back(vector<unsigned int>());
+        if (k == 0)
+        {
+            vMinTime[0].push_back(pindex->nTime);
+            continue;
+        }
+        const vector<unsigned int>& vPrev = vMinTime[k - 1];
+        vMinTime[k].push_back(min(vPrev[nHeight + 1 - (1 << (k - 1))], vPrev[nHeight + 1 - (1 << k)]));
+    }
+
+    if (pindex->IsProofOfStake() && pindex->keyStakeSigner != 0)
+    {
+        CTurboSigner& signer = mapSigner[pindex->keyStakeSigner];
+        int i = signer.vHeight.size();
+        int nLastClose = -1;
+        int nLastClose2 = -1;
+        if (i > 0)
+        {
+            int64_t nGap = (int64_t)pindex->nTime - vBlock[signer.vHeight[i - 1]]->nTime;
+            nLastClose = (nGap < nAllowedSpacing) ? i : signer.vLastClose[i - 1];
+            nLastClose2 = (nGap < nAllowedSpacing2) ? i : signer.vLastClose2[i - 1];
+        }
+        signer.vHeight.push_back(nHeight);
+        signer.vMultiplier.push_back(nMultiplier);
+        signer.vLastClose.push_back(nLastClose);
+        signer.vLastClose2.push_back(nLastClose2);
+    }
+    return true;
+}
+
+void CTurboIndex::Disconnect(CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (vBlock.empty() || vBlock.back() != pindex)
+        return;
+
+    int nHeight = pindex->nHeight;
+    for (unsigned int k = 0; (1 << k) <= nHeight + 1; k++)
+        vMinTime[k].pop_back();
+    while (!vMinTime.empty() && vMinTime.back().empty())
+        vMinTime.pop_back();
+    vBlock.pop_back();
+
+    map<CKeyID, CTurboSigner>::iterator mi = mapSigner.find(pindex->keyStakeSigner);
+    if (mi == mapSigner.end())
+        return;
+    CTurboSigner& signer = mi->second;
+    if (signer.vHeight.empty() || signer.vHeight.back() != nHeight)
+        return;
+    signer.vHeight.pop_back();
+    signer.vMultiplier.pop_back();
+    signer.vLastClose.pop_back();
+    signer.vLastClose2.pop_back();
+    if (signer.vHeight.empty())
+        mapSigner.erase(mi);
+}
+
+bool CTurboIndex::GetWindow(const CKeyID& keyID, int64_t txTime, int64_t nLookbackTime,
+                            const CBlockIndex* pindexPrev, bool fSpacing2,
+                            int& nTurboCount, int& nBlockCount, bool& fTooClose) const
+{
+    LOCK(cs);
+    int nTip = pindexPrev->nHeight;
+    if (nTip < 0 || nTip >= (int)vBlock.size() || vBlock[nTip] != pindexPrev)
+        return false;
+
+    // skip back over the run of blocks not older than the lookback time,
+    // halving the step each time; nStop ends on the block the walk stops at
+    int nStop = nTip;
+    for (int k = (int)vMinTime.size() - 1; k >= 0; k--)
+    {
+        int nSpan = 1 << k;
+        if (nStop + 1 >= nSpan && (int64_t)vMinTime[k][nStop + 1 - nSpan] >= nLookbackTime)
+            nStop -= nSpan;
+    }
+    // the walk never counts the genesis block
+    nStop = max(nStop, 0);
+
+    nBlockCount = 1 + nTip - nStop;
+    nTurboCount = 1;
+    fTooClose = false;
+
+    map<CKeyID, CTurboSigner>::const_iterator mi = mapSigner.find(keyID);
+    if (mi == mapSigner.end())
+        return true;
+    const CTurboSigner& signer = mi->second;
+
+    // stakes at heights nStop + 1 .. nTip
+    int nFirst = lower_bound(signer.vHeight.begin(), signer.vHeight.end(), nStop + 1) - signer.vHeight.begin();
+    int nLast = (upper_bound(signer.vHeight.begin(), signer.vHeight.end(), nTip) - signer.vHeight.begin()) - 1;
+    if (nLast < nFirst)
+        return true;
+
+    unsigned int nAllowed = fSpacing2 ? nAllowedSpacing2 : nAllowedSpacing;
+    const vector<int>& vLastClose = fSpacing2 ? signer.vLastClose2 : signer.vLastClose;
+    if ((txTime - vBlock[signer.vHeight[nLast]]->nTime) < nAllowed || vLastClose[nLast] > nFirst)
+        fTooClose = true;
+
+    nTurboCount += nLast - nFirst + 1;
+    return true;
+}
+
+void CTurboIndex::GetLastStakes(int64_t nTime, vector<CTurboStake>& vStake) const
+{
+    LOCK(cs);
+    vStake.clear();
+    for (map<CKeyID, CTurboSigner>::const_iterator mi = mapSigner.begin(); mi != mapSigner.end(); ++mi)
+    {
+        const CTurboSigner& signer = mi->second;
+        for (int i = signer.vHeight.size() - 1; i >= 0; i--)
+        {
+            if (vBlock[signer.vHeight[i]]->nTime <= nTime)
+            {
+                vStake.push_back(CTurboStake(mi->first, signer.vHeight[i], signer.vMultiplier[i]));
+                break;
+            }
+        }
+    }
+    sort(vStake.begin(), vStake.end(), CTurboStakeByHeightDesc());
+}
+
+void CTurboIndex::GetStakes(const CKeyID& keyID, int64_t nTime, vector<CTurboStake>& vStake) const
+{
+    LOCK(cs);
+    vStake.clear();
+    map<CKeyID, CTurboSigner>::const_iterator mi = mapSigner.find(keyID);
+    if (mi == mapSigner.end())
+        return;
+    const CTurboSigner& signer = mi->second;
+    for (unsigned int i = 0; i < signer.vHeight.size(); i++)
+        if (vBlock[signer.vHeight[i]]->nTime <= nTime)
+            vStake.push_back(CTurboStake(keyID, signer.vHeight[i], signer.vMultiplier[i]));
+}
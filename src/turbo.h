@@ -0,0 +1,93 @@
+// Copyright (c) 2015 The Synergy developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef SYNERGY_TURBO_H
+#define SYNERGY_TURBO_H
+
+#include <map>
+#include <vector>
+
+#include "key.h"
+#include "sync.h"
+
+class CBlockIndex;
+
+/** A coinstake of the turbo period and the multiplier it earned */
+class CTurboStake
+{
+public:
+    CKeyID keyID;
+    int nHeight;
+    int nMultiplier;
+
+    CTurboStake(const CKeyID& keyIDIn, int nHeightIn, int nMultiplierIn) :
+        keyID(keyIDIn), nHeight(nHeightIn), nMultiplier(nMultiplierIn) { }
+};
+
+/** Coinstakes of one signer on the active chain, oldest first */
+class CTurboSigner
+{
+public:
+    std::vector<int> vHeight;
+    std::vector<int> vMultiplier;
+    // index of the latest stake at or before i that came too soon after
+    // the stake before it (-1 if none), for either target spacing
+    std::vector<int> vLastClose;
+    std::vector<int> vLastClose2;
+};
+
+/** Active chain view of the turbo period.
+ *
+ * Blocks are appended as they are connected and dropped as they are
+ * disconnected, so the lookback window of GetTurboStakeMultiplier and a
+ * signer's stakes inside it are found by search instead of walking pprev.
+ * Only a contiguous run of blocks from genesis up to nMaxTime is kept.
+ */
+class CTurboIndex
+{
+private:
+    mutable CCriticalSection cs;
+
+    // active chain by height
+    std::vector<CBlockIndex*> vBlock;
+
+    // vMinTime[k][h + 1 - 2^k] is the earliest block time of heights h + 1 - 2^k .. h
+    std::vector<std::vector<unsigned int> > vMinTime;
+
+    std::map<CKeyID, CTurboSigner> mapSigner;
+
+    unsigned int nAllowedSpacing;
+    unsigned int nAllowedSpacing2;
+    int64_t nMaxTime;
+
+public:
+    CTurboIndex(unsigned int nAllowedSpacingIn, unsigned int nAllowedSpacing2In, int64_t nMaxTimeIn);
+
+    void SetNull();
+
+    /** True if pindex extends the indexed chain and is within the turbo period */
+    bool Accepts(const CBlockIndex* pindex) const;
+
+    bool Connect(CBlockIndex* pindex, int nMultiplier);
+    void Disconnect(CBlockIndex* pindex);
+
+    /**
+     * Counts what a pprev walk from pindexPrev back to nLookbackTime sees:
+     * the blocks in the window, the stakes of keyID among them, and whether
+     * any two of those stakes (or the last one and txTime) are closer than
+     * the allowed spacing. Returns false if pindexPrev is not indexed.
+     */
+    bool GetWindow(const CKeyID& keyID, int64_t txTime, int64_t nLookbackTime,
+                   const CBlockIndex* pindexPrev, bool fSpacing2,
+                   int& nTurboCount, int& nBlockCount, bool& fTooClose) const;
+
+    /** Last stake of every signer with a stake at or before nTime, most recent first */
+    void GetLastStakes(int64_t nTime, std::vector<CTurboStake>& vStake) const;
+
+    /** Every stake of keyID at or before nTime, oldest first */
+    void GetStakes(const CKeyID& keyID, int64_t nTime, std::vector<CTurboStake>& vStake) const;
+};
+
+extern CTurboIndex turboIndex;
+
+#endif // SYNERGY_TURBO_H
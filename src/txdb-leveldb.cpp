@@ -25,11 +25,17 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+static leveldb::Options txdbOptions; // as the shared instance was opened
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.write_buffer_size = std::max((int64_t)1, GetArg("-dbwritebuffer", 4)) * 1048576;
+    options.max_open_files = std::max((int64_t)64, GetArg("-dbmaxopenfiles", 1000));
+    options.block_size = std::max((int64_t)1, GetArg("-dbblocksize", 4)) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
@@ -53,6 +59,7 @@ void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
 
             nFile++;
         }
+        blockFileMaps.Clear();
     }
 
     filesystem::create_directory(directory);
@@ -80,7 +87,7 @@ CTxDB::CTxDB(const char* pszMode)
 
     options = GetOptions();
     options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    txdbOptions = options;
 
     init_blockindex(options); // Init directory
     pdb = txdb;
@@ -99,6 +106,7 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            mapBatch.clear();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -130,6 +138,17 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    mapBatch.clear();
+}
+
+const leveldb::Options& CTxDB::GetOpenOptions()
+{
+    return txdbOptions;
+}
+
+bool CTxDB::GetProperty(const std::string& strName, std::string& strValue)
+{
+    return pdb && pdb->GetProperty(strName, &strValue);
 }
 
 bool CTxDB::TxnBegin()
@@ -145,55 +164,31 @@ bool CTxDB::TxnCommit()
     leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
+    mapBatch.clear();
     if (!status.ok()) {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
+        coinCache.Clear();
         return false;
     }
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
-        }
-    }
-
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
-    }
-};
-
 // When performing a read, if we have an active batch we need to check it first
 // before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
+// a database transaction begins reads are consistent with it. mapBatch mirrors
+// the batch so this is a hash lookup rather than a walk over every pending
+// write, which used to make large reorganizations quadratic.
 bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
-    }
-    return scanner.foundEntry;
+    boost::unordered_map<string, pair<bool, string> >::const_iterator mi = mapBatch.find(key.str());
+    if (mi == mapBatch.end())
+        return false;
+    if (mi->second.first)
+        *deleted = true;
+    else
+        *value = mi->second.second;
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -206,7 +201,10 @@ bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    coinCache.Update(hash, txindex);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -216,6 +214,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
+    coinCache.Erase(hash);
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -224,6 +223,7 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
+    coinCache.Erase(hash);
     return Erase(make_pair(string("tx"), hash));
 }
 
@@ -304,22 +304,98 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadAddressIndexed(bool& fIndexed)
+{
+    fIndexed = false;
+    return Read(string("addressindex"), fIndexed);
+}
+
+bool CTxDB::WriteAddressIndexed(bool fIndexed)
+{
+    return Write(string("addressindex"), fIndexed);
+}
+
+bool CTxDB::WriteAddressIndex(const AddressIndexVector& vIndex)
+{
+    for (AddressIndexVector::const_iterator it = vIndex.begin(); it != vIndex.end(); ++it)
+        if (!Write(make_pair(string("addr"), it->first), it->second))
+            return false;
+    return true;
+}
+
+bool CTxDB::EraseAddressIndex(const AddressIndexVector& vIndex)
+{
+    for (AddressIndexVector::const_iterator it = vIndex.begin(); it != vIndex.end(); ++it)
+        if (!Erase(make_pair(string("addr"), it->first)))
+            return false;
+    return true;
+}
+
+bool CTxDB::ReadAddressIndex(unsigned char nType, const uint160& hashBytes, AddressIndexVector& vIndex)
+{
+    vIndex.clear();
+
+    // the records of one address share the serialized (type, hash) prefix
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(string("addr"), make_pair(nType, hashBytes));
+    string strPrefix = ssPrefix.str();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(strPrefix); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice key = iterator->key();
+        if (!key.starts_with(strPrefix))
+            break;
+        try {
+            CDataStream ssKey(key.data(), key.data() + key.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(iterator->value().data(), iterator->value().data() + iterator->value().size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            pair<CAddressIndexKey, CAddressIndexValue> item;
+            ssKey >> strType >> item.first;
+            ssValue >> item.second;
+            vIndex.push_back(item);
+        }
+        catch (std::exception &e) {
+            delete iterator;
+            return error("CTxDB::ReadAddressIndex() : deserialize error");
+        }
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::WipeAddressIndex()
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("addr");
+    string strPrefix = ssPrefix.str();
+
+    leveldb::WriteBatch batch;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    for (iterator->Seek(strPrefix); iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Next())
+        batch.Delete(iterator->key());
+    delete iterator;
+
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("CTxDB::WipeAddressIndex() : %s", status.ToString().c_str());
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return (*ret.first).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = blockIndexArena.New();
+    (*ret.first).second = pindexNew;
+    pindexNew->phashBlock = &((*ret.first).first);
 
     return pindexNew;
 }
@@ -339,13 +415,18 @@ bool CTxDB::LoadBlockIndex()
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
     ssStartKey << make_pair(string("blockindex"), uint256(0));
     iterator->Seek(ssStartKey.str());
-    // Now read each entry.
+    // Now read each entry, into the same streams, and count them by height so
+    // that chain trust can be added up in order without sorting.
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    vector<CBlockIndex*> vLoaded;
+    vector<unsigned int> vHeightCount;
     while (iterator->Valid())
     {
         // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.clear();
         ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.clear();
         ssValue.write(iterator->value().data(), iterator->value().size());
         string strType;
         ssKey >> strType;
@@ -369,6 +450,7 @@ bool CTxDB::LoadBlockIndex()
         pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
         pindexNew->nFile          = diskindex.nFile;
         pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nBlockSize     = diskindex.nBlockSize;
         pindexNew->nHeight        = diskindex.nHeight;
         pindexNew->nMint          = diskindex.nMint;
         pindexNew->nMoneySupply   = diskindex.nMoneySupply;
@@ -376,6 +458,7 @@ bool CTxDB::LoadBlockIndex()
         pindexNew->nStakeModifier = diskindex.nStakeModifier;
         pindexNew->prevoutStake   = diskindex.prevoutStake;
         pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->keyStakeSigner = diskindex.keyStakeSigner;
         pindexNew->hashProof      = diskindex.hashProof;
         pindexNew->nVersion       = diskindex.nVersion;
         pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
@@ -396,6 +479,15 @@ bool CTxDB::LoadBlockIndex()
         if (pindexNew->IsProofOfStake())
             setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 
+        if (pindexNew->nHeight < 0) {
+            delete iterator;
+            return error("LoadBlockIndex() : negative height %d", pindexNew->nHeight);
+        }
+        if (pindexNew->nHeight >= (int)vHeightCount.size())
+            vHeightCount.resize(pindexNew->nHeight + 1, 0);
+        vHeightCount[pindexNew->nHeight]++;
+        vLoaded.push_back(pindexNew);
+
         iterator->Next();
     }
     delete iterator;
@@ -403,18 +495,22 @@ bool CTxDB::LoadBlockIndex()
     if (fRequestShutdown)
         return true;
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Counting sort by height: turn the counts into start offsets, then place
+    unsigned int nOffset = 0;
+    for (unsigned int i = 0; i < vHeightCount.size(); i++)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        unsigned int nCount = vHeightCount[i];
+        vHeightCount[i] = nOffset;
+        nOffset += nCount;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    vector<CBlockIndex*> vSortedByHeight(vLoaded.size());
+    BOOST_FOREACH(CBlockIndex* pindex, vLoaded)
+        vSortedByHeight[vHeightCount[pindex->nHeight]++] = pindex;
+    vector<CBlockIndex*>().swap(vLoaded);
+
+    // Calculate nChainTrust
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
         // NovaCoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
@@ -432,6 +528,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -7,6 +7,7 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "coincache.h"
 
 #include <map>
 #include <string>
@@ -15,6 +16,8 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <boost/unordered_map.hpp>
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -34,18 +37,31 @@ public:
     ~CTxDB() {
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
+        if (activeBatch)
+            coinCache.Clear();
         delete activeBatch;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
     void Close();
 
+    // Options the shared instance was opened with.
+    static const leveldb::Options& GetOpenOptions();
+
+    // Reads a LevelDB property such as "leveldb.stats".
+    bool GetProperty(const std::string& strName, std::string& strValue);
+
 private:
     leveldb::DB *pdb;  // Points to the global instance.
 
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // The puts and deletes in activeBatch by key, as (deleted, value), so a
+    // read inside a transaction finds them without walking the whole batch.
+    boost::unordered_map<std::string, std::pair<bool, std::string> > mapBatch;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -53,7 +69,7 @@ private:
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
-    // delete for it.
+    // delete for it. Looked up in mapBatch.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
     template<typename K, typename T>
@@ -111,7 +127,10 @@ protected:
         ssValue << value;
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            std::string strKey = ssKey.str();
+            std::string strValue = ssValue.str();
+            activeBatch->Put(strKey, strValue);
+            mapBatch[strKey] = std::make_pair(false, strValue);
             return true;
         }
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
@@ -134,7 +153,9 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            std::string strKey = ssKey.str();
+            activeBatch->Delete(strKey);
+            mapBatch[strKey] = std::make_pair(true, std::string());
             return true;
         }
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
@@ -151,8 +172,8 @@ protected:
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
+            if (ScanBatch(ssKey, &unused, &deleted)) {
+                return !deleted;
             }
         }
 
@@ -167,8 +188,11 @@ public:
     bool TxnCommit();
     bool TxnAbort()
     {
+        // the coin cache may hold writes of the batch
+        coinCache.Clear();
         delete activeBatch;
         activeBatch = NULL;
+        mapBatch.clear();
         return true;
     }
 
@@ -201,6 +225,13 @@ public:
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
+    bool ReadAddressIndexed(bool& fIndexed);
+    bool WriteAddressIndexed(bool fIndexed);
+    bool WriteAddressIndex(const AddressIndexVector& vIndex);
+    bool EraseAddressIndex(const AddressIndexVector& vIndex);
+    // Reads committed records only, not those of an open transaction.
+    bool ReadAddressIndex(unsigned char nType, const uint160& hashBytes, AddressIndexVector& vIndex);
+    bool WipeAddressIndex();
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
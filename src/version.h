@@ -26,6 +26,12 @@ extern const std::string CLIENT_DATE;
 //
 static const int DATABASE_VERSION = 70508;
 
+// disk block index records carry the coinstake signer from this version on
+static const int STAKE_SIGNER_VERSION = 1020002;
+
+// and the serialized size of the block from this version on
+static const int BLOCK_SIZE_VERSION = 1020003;
+
 //
 // network protocol versioning
 //
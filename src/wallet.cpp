@@ -15,6 +15,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 extern unsigned int nStakeMaxAge;
@@ -167,7 +168,10 @@ bool CWallet::Lock()
             sxAddr.spend_secret = sxAddrTemp.spend_secret;
         };
     }
-    return LockKeyStore();
+    if (!LockKeyStore())
+        return false;
+    SecureMsgWalletLocked();
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -938,40 +942,280 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Rescans read blocks ahead on several threads, which also find the
+// transactions that could involve the wallet, so the wallet lock is only
+// taken to apply those
+static const unsigned int RESCAN_BATCH_SIZE = 200;
+static const int MAX_RESCAN_THREADS = 8;
+
+/** A block read ahead by a rescan */
+class CRescanBlock
+{
+public:
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    std::vector<uint256> vHash;
+    std::vector<bool> vMatch; // an output pays the wallet or one of its stealth addresses
+    std::vector<int> vStealth; // stealth outputs of each transaction
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fRead(false) { }
+};
+
+/** Blocks of a rescan shared out to reader threads, with a snapshot of what to match */
+class CRescanBatch
+{
+public:
+    std::vector<CRescanBlock> vBlock;
+    boost::mutex cs;
+    unsigned int nNext;
+    boost::thread_group threads;
+
+    const CKeyStore* pkeystore;
+    std::set<CKeyID> setKeys;
+    std::set<CStealthAddress> setStealth;
+    unsigned int nMatchCount; // CWallet::GetMatchCount() when the snapshot was taken
+
+    CRescanBatch(CWallet* pwallet)
+    {
+        nNext = 0;
+        pkeystore = pwallet;
+        LOCK(pwallet->cs_wallet);
+        nMatchCount = pwallet->GetMatchCount();
+        pwallet->GetKeys(setKeys);
+        setStealth = pwallet->stealthAddresses;
+    }
+
+    // Pay to key hash and pay to key outputs are looked up in the key
+    // snapshot, anything else goes through the full IsMine
+    bool IsMine(const CScript& script) const
+    {
+        if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20
+            && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+            return setKeys.count(CKeyID(uint160(vector<unsigned char>(script.begin() + 3, script.begin() + 23))));
+        if (((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65))
+            && script[script.size() - 1] == OP_CHECKSIG)
+            return setKeys.count(CKeyID(Hash160(vector<unsigned char>(script.begin() + 1, script.end() - 1))));
+        return ::IsMine(*pkeystore, script);
+    }
+
+    // Same match as FindStealthTransactions
+    bool IsStealthMatch(const CTransaction& tx, CStealthScanner& scanner, int& nStealthOut) const
+    {
+        nStealthOut = 0;
+        set<CKeyID> setDest;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            CTxDestination address;
+            if (ExtractDestination(txout.scriptPubKey, address) && address.type() == typeid(CKeyID))
+                setDest.insert(boost::get<CKeyID>(address));
+        }
+
+        bool fMatch = false;
+        vector<CStealthScanResult> vResult;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            opcodetype opCode;
+            vector<unsigned char> vchEphemPK;
+            CScript::const_iterator pc = txout.scriptPubKey.begin();
+            if (!txout.scriptPubKey.GetOp(pc, opCode, vchEphemPK) || opCode != OP_RETURN
+                || !txout.scriptPubKey.GetOp(pc, opCode, vchEphemPK) || vchEphemPK.size() != 33)
+                continue;
+            nStealthOut++;
+
+            if (fMatch || setDest.empty() || !scanner.Scan(vchEphemPK, vResult))
+                continue;
+            BOOST_FOREACH(const CStealthScanResult& result, vResult)
+            {
+                CPubKey cpkE(result.pkOut);
+                if (cpkE.IsValid() && setDest.count(cpkE.GetID()))
+                    fMatch = true;
+            }
+        }
+        return fMatch;
+    }
+
+    void Read()
+    {
+        CStealthScanner scanner;
+        scanner.SetAddresses(setStealth);
+        while (!fShutdown)
+        {
+            unsigned int n;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext >= vBlock.size())
+                    return;
+                n = nNext++;
+            }
+
+            CRescanBlock& scan = vBlock[n];
+            if (!scan.block.ReadFromDisk(scan.pindex, true))
+                continue;
+
+            unsigned int nTx = scan.block.vtx.size();
+            scan.vHash.resize(nTx);
+            scan.vMatch.resize(nTx);
+            scan.vStealth.resize(nTx);
+            for (unsigned int i = 0; i < nTx; i++)
+            {
+                const CTransaction& tx = scan.block.vtx[i];
+                scan.vHash[i] = tx.GetHash();
+                bool fMatch = false;
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                {
+                    if (IsMine(txout.scriptPubKey))
+                    {
+                        fMatch = true;
+                        break;
+                    }
+                }
+                if (IsStealthMatch(tx, scanner, scan.vStealth[i]))
+                    fMatch = true;
+                scan.vMatch[i] = fMatch;
+            }
+            scan.fRead = true;
+        }
+    }
+};
+
+// Starts reading the blocks after pindex (or pindex itself if fFirst) that
+// are younger than the wallet (any block if !fKeyBirthday), NULL if the
+// chain ends there
+static CRescanBatch* StartRescanBatch(CWallet* pwallet, CBlockIndex* pindex, bool fFirst, bool fKeyBirthday)
+{
+    CRescanBatch* pbatch = new CRescanBatch(pwallet);
+    {
+        LOCK(cs_main);
+        if (!fFirst && pindex)
+            pindex = pindex->pnext;
+        for (; pindex && pbatch->vBlock.size() < RESCAN_BATCH_SIZE; pindex = pindex->pnext)
+        {
+            // no need to read and scan block, if block was created before
+            // our wallet birthday (as adjusted for block time variability)
+            if (fKeyBirthday && pwallet->nTimeFirstKey && (pindex->nTime < (pwallet->nTimeFirstKey - 7200)))
+                continue;
+            pbatch->vBlock.push_back(CRescanBlock(pindex));
+        }
+    }
+    if (pbatch->vBlock.empty())
+    {
+        delete pbatch;
+        return NULL;
+    }
+
+    int nThreads = min(max((int)boost::thread::hardware_concurrency(), 1), MAX_RESCAN_THREADS);
+    nThreads = min(nThreads, (int)pbatch->vBlock.size());
+    for (int i = 0; i < nThreads; i++)
+        pbatch->threads.create_thread(boost::bind(&CRescanBatch::Read, pbatch));
+    return pbatch;
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, void (*pProgress)(int))
+//
+// Blocks are read and filtered a batch ahead while the previous batch is
+// applied in height order, holding cs_main and cs_wallet only for one
+// batch at a time. The last block applied is written to the wallet, so a
+// rescan that is interrupted resumes from there on the next start.
+// Blocks older than the first key are skipped unless fKeyBirthday is false.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, void (*pProgress)(int), bool fKeyBirthday)
 {
-
     fRescanLock = true;
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    CBlockIndex* pindexLast = NULL; // last block applied
+    CRescanBatch* pbatch = StartRescanBatch(this, pindexStart, true, fKeyBirthday);
+    while (pbatch)
     {
-        LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        pbatch->threads.join_all();
+
+        // read the next batch while this one is applied
+        CRescanBatch* pbatchNext = NULL;
+        if (!fShutdown)
+            pbatchNext = StartRescanBatch(this, pbatch->vBlock.back().pindex, false, fKeyBirthday);
+
+        bool fReorganized = false;
         {
-            if (pProgress != NULL) {
-                  (*pProgress)(pindex->nHeight);
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(CRescanBlock& scan, pbatch->vBlock)
+            {
+                if (fShutdown)
+                    break;
+
+                // the chain moved under the batch, continue from where it forks
+                if (!scan.pindex->IsInMainChain())
+                {
+                    fReorganized = true;
+                    break;
+                }
+                if (pProgress != NULL)
+                    (*pProgress)(scan.pindex->nHeight);
+                pindexLast = scan.pindex;
+                if (!scan.fRead)
+                    continue;
+
+                for (unsigned int i = 0; i < scan.block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = scan.block.vtx[i];
+
+                    // keys added since the batch was read, by earlier
+                    // transactions or by other threads, are not in its
+                    // snapshot, so from there on every transaction is checked
+                    bool fStale = GetMatchCount() != pbatch->nMatchCount;
+
+                    // spends of wallet coins and wallet transactions are checked as well
+                    bool fCheck = fStale || scan.vMatch[i] || mapWallet.count(scan.vHash[i]);
+                    for (unsigned int j = 0; j < tx.vin.size() && !fCheck; j++)
+                        fCheck = mapWallet.count(tx.vin[j].prevout.hash);
+
+                    if (!fCheck)
+                    {
+                        nStealth += scan.vStealth[i];
+                        continue;
+                    }
+                    if (AddToWalletIfInvolvingMe(tx, &scan.block, fUpdate))
+                        ret++;
+                }
             }
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
+
+            if (fReorganized && !pindexLast)
+            {
+                // nothing applied yet, start again where pindexStart forks off
+                while (pindexStart->pprev && !pindexStart->IsInMainChain())
+                    pindexStart = pindexStart->pprev;
+            }
+            else if (pindexLast && !fShutdown)
+            {
+                while (pindexLast->pprev && !pindexLast->IsInMainChain())
+                    pindexLast = pindexLast->pprev;
+                if (fFileBacked)
+                    CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(pindexLast));
             }
+        }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        if (fReorganized && !fShutdown)
+        {
+            // what was read ahead may be off the chain as well
+            printf("ScanForWalletTransactions() : chain reorganized, continuing at height %d\n",
+                   pindexLast ? pindexLast->nHeight + 1 : pindexStart->nHeight);
+            if (pbatchNext)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                pbatchNext->threads.join_all();
+                delete pbatchNext;
             }
-            pindex = pindex->pnext;
+            delete pbatch;
+            pbatch = StartRescanBatch(this, pindexLast ? pindexLast : pindexStart, pindexLast == NULL, fKeyBirthday);
+            continue;
         }
+
+        delete pbatch;
+        pbatch = pbatchNext;
     }
+
+    if (!fShutdown && fFileBacked)
+        CWalletDB(strWalletFile).EraseRescanBlock();
     fRescanLock = false;
     return ret;
 }
@@ -1038,9 +1282,20 @@ void CWallet::ReacceptWalletTransactions()
         }
         if (!vMissingTx.empty())
         {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
-                fRepeat = true;  // Found missing transactions: re-do re-accept.
+            // The tx index says where the spends are, so read those blocks
+            // instead of scanning the whole chain for them
+            set<pair<unsigned int, unsigned int> > setBlockPos;
+            BOOST_FOREACH(const CDiskTxPos& pos, vMissingTx)
+                setBlockPos.insert(make_pair(pos.nFile, pos.nBlockPos));
+            BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& blockPos, setBlockPos)
+            {
+                CBlock block;
+                if (!block.ReadFromDisk(blockPos.first, blockPos.second))
+                    continue;
+                BOOST_FOREACH(const CTransaction& tx, block.vtx)
+                    if (AddToWalletIfInvolvingMe(tx, &block, false))
+                        fRepeat = true;  // Found missing transactions: re-do re-accept.
+            }
         }
     }
     fRescanLock = false;
@@ -2212,10 +2467,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     LOCK(cs_wallet);
     ec_secret sSpendR;
     ec_secret sSpend;
-    ec_secret sScan;
-    ec_secret sShared;
-
-    ec_point pkExtracted;
 
     std::vector<uint8_t> vchEphemPK;
     std::vector<uint8_t> vchDataB;
@@ -2223,6 +2474,9 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     opcodetype opCode;
     char cbuf[256];
 
+    // -- gather the ephemeral keys first, most transactions have none
+    std::vector<std::pair<int32_t, ec_point> > vEphem;
+
     int32_t nOutputIdOuter = -1;
     BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
@@ -2262,188 +2516,174 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
             continue;
         }
 
-        int32_t nOutputId = -1;
-        nStealth++;
-        BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
-        {
-            nOutputId++;
+        vEphem.push_back(std::make_pair(nOutputIdOuter, vchEphemPK));
+    };
 
-            // printf("The nOutputID is: %d\n", nOutputId);
+    if (vEphem.empty())
+        return true;
+    nStealth += vEphem.size();
 
-            if (&txoutB == &txout)
-                continue;
+    // -- the outputs a stealth payment could go to, by key id
+    std::map<CKeyID, int32_t> mapDest;
+    for (int32_t nOutputId = (int32_t)tx.vout.size() - 1; nOutputId >= 0; nOutputId--)
+    {
+        CTxDestination address;
+        if (ExtractDestination(tx.vout[nOutputId].scriptPubKey, address)
+            && address.type() == typeid(CKeyID))
+            mapDest[boost::get<CKeyID>(address)] = nOutputId; // first output wins
+    };
+    if (mapDest.empty())
+        return true;
 
-            bool txnMatch = false; // only 1 txn will match an ephem pk
-            //printf("txoutB scriptPubKey %s\n",  txoutB.scriptPubKey.ToString().c_str());
+    stealthScanner.SetAddresses(stealthAddresses);
 
-            CTxDestination address;
-            if (!ExtractDestination(txoutB.scriptPubKey, address))
-            {
-                if (fDebug)
-                {
-                    printf("CWallet::FindStealthTransactions: Could not extract destination %s.\n",
-                                      CBitcoinAddress(address).ToString().c_str());
-                }
+    std::vector<CStealthScanResult> vResult;
+    for (size_t e = 0; e < vEphem.size(); ++e)
+    {
+        const CTxOut& txout = tx.vout[vEphem[e].first];
+        vchEphemPK = vEphem[e].second;
+
+        // The vchEphemPK needs to be extracted to scan for encrypted narrations
+        // even if the key has already been added.
+        stealthScanner.Scan(vchEphemPK, vResult);
+        BOOST_FOREACH(const CStealthScanResult& result, vResult)
+        {
+            CPubKey cpkE(result.pkOut);
+            if (!cpkE.IsValid())
                 continue;
-            }
 
-            if (address.type() != typeid(CKeyID))
-            {
-                if (fDebug)
-                {
-                    printf("CWallet::FindStealthTransactions: Address is not right type %s.\n",
-                                      CBitcoinAddress(address).ToString().c_str());
-                }
+            std::map<CKeyID, int32_t>::const_iterator mi = mapDest.find(cpkE.GetID());
+            if (mi == mapDest.end())
                 continue;
-            }
+            CKeyID ckidMatch = mi->first;
+            int32_t nOutputId = mi->second;
+            ec_secret sShared = result.sShared;
+
+            CStealthAddress sxFind;
+            sxFind.scan_pubkey = stealthScanner.vAddress[result.nAddress];
+            std::set<CStealthAddress>::iterator it = stealthAddresses.find(sxFind);
+            if (it == stealthAddresses.end())
+                continue;
+
+            // the narration follows the ephemeral key in the same output
+            CScript::const_iterator itTxA = txout.scriptPubKey.begin();
+            txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr);
+            txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr);
 
-            CKeyID ckidMatch = boost::get<CKeyID>(address);
+            if (fDebug)
+                printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-            // The vchEphemPK needs to be extracted to scan for encrypted narrations
-            // even if the key has already been added.
-            std::set<CStealthAddress>::iterator it;
-            for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+            if (!HaveKey(ckidMatch)) // no point adding if already have key
             {
-                if (it->scan_secret.size() != ec_secret_size)
-                    continue; // Stealth Address is not owned
+              if (IsLocked())
+              {
+                  if (fDebug)
+                      printf("Wallet is locked, adding key without secret.\n");
+
+                  // -- add key without secret
+                  std::vector<uint8_t> vchEmpty;
+                  AddCryptedKey(cpkE, vchEmpty);
+                  CKeyID keyId = cpkE.GetID();
+                  CBitcoinAddress coinAddress(keyId);
+                  std::string sLabel = it->Encoded();
+                  SetAddressBookName(keyId, sLabel);
+
+                  CPubKey cpkEphem(vchEphemPK);
+                  CPubKey cpkScan(it->scan_pubkey);
+                  CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
+
+                  if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
+                      printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
+
+                  mapStealthKeyMeta[keyId] = lockedSkMeta;
+                  nFoundStealth++;
+              }
+              else
+              {
+                  if (it->spend_secret.size() != ec_secret_size)
+                      continue;
+                  memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
+
+
+                  if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
+                  {
+                      printf("StealthSharedToSecretSpend() failed.\n");
+                      continue;
+                  };
 
-                //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+                  ec_point pkTestSpendR;
+                  if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
+                  {
+                      printf("SecretToPublicKey() failed.\n");
+                      continue;
+                  };
 
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
-                {
-                    printf("CWallet::FindStealthTransactions: StealthSecret failed.\n");
-                    continue;
-                };
-                //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
+                  CSecret vchSecret;
+                  vchSecret.resize(ec_secret_size);
 
-                CPubKey cpkE(pkExtracted);
+                  memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
+                  CKey ckey;
 
-                if (!cpkE.IsValid())
-                    continue;
-                CKeyID ckidE = cpkE.GetID();
+                  try {
+                      ckey.SetSecret(vchSecret, true);
+                  } catch (std::exception& e) {
+                      printf("ckey.SetSecret() threw: %s.\n", e.what());
+                      continue;
+                  };
 
-                if (ckidMatch != ckidE)
-                    continue;
+                  CPubKey cpkT = ckey.GetPubKey();
+                  if (!cpkT.IsValid())
+                  {
+                      printf("cpkT is invalid.\n");
+                      continue;
+                  };
 
-                if (fDebug)
-                    printf("Found stealth txn to address %s\n", it->Encoded().c_str());
+                  if (!ckey.IsValid())
+                  {
+                      printf("Reconstructed key is invalid.\n");
+                      continue;
+                  };
 
-                if (!HaveKey(ckidMatch)) // no point adding if already have key
-                {
-                  if (IsLocked())
+                  CKeyID keyID = cpkT.GetID();
+                  if (fDebug)
                   {
-                      if (fDebug)
-                          printf("Wallet is locked, adding key without secret.\n");
-
-                      // -- add key without secret
-                      std::vector<uint8_t> vchEmpty;
-                      AddCryptedKey(cpkE, vchEmpty);
-                      CKeyID keyId = cpkE.GetID();
-                      CBitcoinAddress coinAddress(keyId);
-                      std::string sLabel = it->Encoded();
-                      SetAddressBookName(keyId, sLabel);
-
-                      CPubKey cpkEphem(vchEphemPK);
-                      CPubKey cpkScan(it->scan_pubkey);
-                      CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
-
-                      if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
-                          printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
-
-                      mapStealthKeyMeta[keyId] = lockedSkMeta;
-                      nFoundStealth++;
-                  }
-                  else
+                      CBitcoinAddress coinAddress(keyID);
+                      printf("Adding key %s.\n", coinAddress.ToString().c_str());
+                  };
+
+                  if (!AddKey(ckey))
                   {
-                      if (it->spend_secret.size() != ec_secret_size)
-                          continue;
-                      memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
-
-
-                      if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
-                      {
-                          printf("StealthSharedToSecretSpend() failed.\n");
-                          continue;
-                      };
-
-                      ec_point pkTestSpendR;
-                      if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-                      {
-                          printf("SecretToPublicKey() failed.\n");
-                          continue;
-                      };
-
-                      CSecret vchSecret;
-                      vchSecret.resize(ec_secret_size);
-
-                      memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-                      CKey ckey;
-
-                      try {
-                          ckey.SetSecret(vchSecret, true);
-                      } catch (std::exception& e) {
-                          printf("ckey.SetSecret() threw: %s.\n", e.what());
-                          continue;
-                      };
-
-                      CPubKey cpkT = ckey.GetPubKey();
-                      if (!cpkT.IsValid())
-                      {
-                          printf("cpkT is invalid.\n");
-                          continue;
-                      };
-
-                      if (!ckey.IsValid())
-                      {
-                          printf("Reconstructed key is invalid.\n");
-                          continue;
-                      };
-
-                      CKeyID keyID = cpkT.GetID();
-                      if (fDebug)
-                      {
-                          CBitcoinAddress coinAddress(keyID);
-                          printf("Adding key %s.\n", coinAddress.ToString().c_str());
-                      };
-
-                      if (!AddKey(ckey))
-                      {
-                          printf("AddKey failed.\n");
-                          continue;
-                      };
-
-                      std::string sLabel = it->Encoded();
-                      SetAddressBookName(keyID, sLabel);
-                      nFoundStealth++;
+                      printf("AddKey failed.\n");
+                      continue;
                   };
-                }
 
-                // on rescan, must decrypt any encrypted narrations
-                if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && opCode == OP_RETURN
-                    && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && vchENarr.size() > 0)
-                {
-                    SecMsgCrypter crypter;
-                    crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
-                    std::vector<uint8_t> vchNarr;
-                    if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
-                    {
-                        printf("Decrypt narration failed.\n");
-                        continue;
-                    };
-                    std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
+                  std::string sLabel = it->Encoded();
+                  SetAddressBookName(keyID, sLabel);
+                  nFoundStealth++;
+              };
+            }
 
-                    snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
-                    mapNarr[cbuf] = sNarr;
+            // on rescan, must decrypt any encrypted narrations
+            if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+                && opCode == OP_RETURN
+                && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+                && vchENarr.size() > 0)
+            {
+                SecMsgCrypter crypter;
+                crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
+                std::vector<uint8_t> vchNarr;
+                if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
+                {
+                    printf("Decrypt narration failed.\n");
+                    continue;
                 };
+                std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
 
-                txnMatch = true;
-                break;
+                snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
+                mapNarr[cbuf] = sNarr;
             };
-            if (txnMatch)
-                break;
+
+            break; // only 1 txn will match an ephem pk
         };
     };
 
@@ -2547,45 +2787,66 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
+    static int nMaxStakeSearchInterval = 60;
+
+    // Gather the kernel inputs of every coin that could stake, looking up
+    // only the coins not seen by an earlier search
+    vector<CStakeKernel> vKernel;
+    vector<PAIRTYPE(const CWalletTx*, unsigned int) > vKernelCoin;
+    vKernel.reserve(setCoins.size());
+    vKernelCoin.reserve(setCoins.size());
     CTxDB txdb("r");
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        // Read block header
-        CBlock block;
+        CStakeKernel kernel;
         {
             LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            if (!GetStakeKernel(txdb, *pcoin.first, pcoin.second, kernel))
                 continue;
         }
 
-
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (kernel.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
+        if (kernel.pindexModifier == NULL)
+            continue;
 
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
-        {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
+        // only support pay to public key and pay to address that we can sign for
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions))
+            continue;
+        if (whichType == TX_PUBKEYHASH && !keystore.HaveKey(uint160(vSolutions[0])))
+            continue;
+        if (whichType == TX_PUBKEY && !keystore.HaveKey(Hash160(vSolutions[0])))
+            continue;
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+            continue;
+
+        vKernel.push_back(kernel);
+        vKernelCoin.push_back(pcoin);
+    }
+
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    unsigned int nKernel = 0, nTimeKernel = 0;
+    unsigned int nSearch = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+    if (!vKernel.empty() && nSearch > 0 &&
+        FindStakeKernel(nBits, vKernel, txNew.nTime, nSearch, pindexPrev, nKernel, nTimeKernel) &&
+        !fShutdown && pindexPrev == pindexBest)
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vKernelCoin[nKernel];
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        if (CheckStakeKernelHash(nBits, vKernel[nKernel], nTimeKernel, hashProofOfStake, targetProofOfStake))
+        {
+            // Found a kernel
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : kernel found\n");
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            CScript scriptPubKeyOut;
+            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+            do
             {
-                // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
                 if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
@@ -2594,12 +2855,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                 }
                 if (fDebug && GetBoolArg("-printcoinstake"))
                     printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
                 if (whichType == TX_PUBKEYHASH) // pay to address type
                 {
                     // convert to pay to public key type
@@ -2621,33 +2876,28 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                         break;  // unable to find corresponding public key
                     }
 
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                    if (key.GetPubKey() != vchPubKey)
+                    {
+                        if (fDebug && GetBoolArg("-printcoinstake"))
+                            printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
                         break; // keys mismatch
                     }
 
                     scriptPubKeyOut = scriptPubKeyKernel;
                 }
 
-                txNew.nTime -= n;
+                txNew.nTime = nTimeKernel;
                 txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
                 nCredit += pcoin.first->vout[pcoin.second].nValue;
                 vwtxPrev.push_back(pcoin.first);
                 txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-                if (GetWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < nStakeSplitAge)
+                if (GetWeight(vKernel[nKernel].nTimeBlockFrom, (int64_t)txNew.nTime) < nStakeSplitAge)
                     txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
                 if (fDebug && GetBoolArg("-printcoinstake"))
                     printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
+            } while (false);
         }
-
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -3440,7 +3690,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -96,6 +96,7 @@ public:
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
 
     std::set<CStealthAddress> stealthAddresses;
+    CStealthScanner stealthScanner; // scan keys of stealthAddresses, under cs_wallet
     StealthKeyMetaMap mapStealthKeyMeta;
     uint32_t nStealth, nFoundStealth;
 
@@ -157,6 +158,13 @@ public:
     bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript);
+    // Number of keys, scripts and stealth addresses outputs are matched against
+    unsigned int GetMatchCount() const
+    {
+        AssertLockHeld(cs_wallet); // stealthAddresses
+        LOCK(cs_KeyStore);
+        return mapKeys.size() + mapCryptedKeys.size() + mapScripts.size() + stealthAddresses.size();
+    }
     bool Lock();
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
@@ -184,7 +192,7 @@ public:
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, void (*pProgress)(int)=NULL);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, void (*pProgress)(int)=NULL, bool fKeyBirthday = true);
     int ScanForWalletTransaction(const uint256& hashTx);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
@@ -768,7 +776,7 @@ public:
             {
                // Find the block the tx is in
                CBlockIndex* pindex = NULL;
-               std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(this->hashBlock);
+               BlockMap::iterator mi = mapBlockIndex.find(this->hashBlock);
                if (mi != mapBlockIndex.end()) {
                     pindex = (*mi).second;
                }
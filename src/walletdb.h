@@ -202,6 +202,24 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    // last block applied by a rescan that has not finished
+    bool WriteRescanBlock(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanblock"), locator);
+    }
+
+    bool ReadRescanBlock(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanblock"), locator);
+    }
+
+    bool EraseRescanBlock()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanblock"));
+    }
+
     bool WriteOrderPosNext(int64_t nOrderPosNext)
     {
         nWalletDBUpdated++;
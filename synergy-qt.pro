@@ -125,6 +125,13 @@ contains(USE_IPV6, -) {
     DEFINES += USE_IPV6=$$USE_IPV6
 }
 
+# use: qmake "USE_SECP256K1=1" to verify signatures with libsecp256k1
+contains(USE_SECP256K1, 1) {
+    message(Building with libsecp256k1 signature verification)
+    DEFINES += USE_SECP256K1
+    LIBS += -lsecp256k1
+}
+
 contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     DEFINES += BITCOIN_NEED_QT_PLUGINS
     QTPLUGIN += qcncodecs qjpcodecs qtwcodecs qkrcodecs qtaccessiblewidgets
@@ -234,6 +241,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/walletdb.h \
     src/script.h \
     src/stealth.h \
+    src/turbo.h \
+    src/blockfile.h \
+    src/coincache.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
@@ -455,6 +465,9 @@ SOURCES += \
     src/scrypt.cpp \
     src/pbkdf2.cpp \
     src/stealth.cpp \
+    src/turbo.cpp \
+    src/blockfile.cpp \
+    src/coincache.cpp \
     src/json/json_spirit_reader.cpp \
     src/json/json_spirit_value.cpp \
     src/json/json_spirit_writer.cpp \